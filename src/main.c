@@ -63,30 +63,30 @@ static void v4l2_subdev_print_format(struct media_entity *entity,
 	       v4l2_subdev_pixelcode_to_string(format.code),
 	       format.width, format.height);
 
+	/* The first selection read records the sub-device capabilities, the
+	 * following reads return -ENOTTY without an ioctl when the selection
+	 * or crop API isn't supported.
+	 */
 	ret = v4l2_subdev_get_selection(entity, &rect, pad,
-					V4L2_SEL_TGT_CROP_BOUNDS,
-					which);
+					V4L2_SEL_TGT_CROP_BOUNDS, which);
 	if (ret == 0)
-		printf("\n\t\t crop.bounds:(%u,%u)/%ux%u", rect.left, rect.top,
-		       rect.width, rect.height);
+		printf("\n\t\t crop.bounds:(%u,%u)/%ux%u",
+		       rect.left, rect.top, rect.width, rect.height);
 
 	ret = v4l2_subdev_get_selection(entity, &rect, pad,
-					V4L2_SEL_TGT_CROP,
-					which);
+					V4L2_SEL_TGT_CROP, which);
 	if (ret == 0)
-		printf("\n\t\t crop:(%u,%u)/%ux%u", rect.left, rect.top,
-		       rect.width, rect.height);
+		printf("\n\t\t crop:(%u,%u)/%ux%u",
+		       rect.left, rect.top, rect.width, rect.height);
 
 	ret = v4l2_subdev_get_selection(entity, &rect, pad,
-					V4L2_SEL_TGT_COMPOSE_BOUNDS,
-					which);
+					V4L2_SEL_TGT_COMPOSE_BOUNDS, which);
 	if (ret == 0)
 		printf("\n\t\t compose.bounds:(%u,%u)/%ux%u",
 		       rect.left, rect.top, rect.width, rect.height);
 
 	ret = v4l2_subdev_get_selection(entity, &rect, pad,
-					V4L2_SEL_TGT_COMPOSE,
-					which);
+					V4L2_SEL_TGT_COMPOSE, which);
 	if (ret == 0)
 		printf("\n\t\t compose:(%u,%u)/%ux%u",
 		       rect.left, rect.top, rect.width, rect.height);
@@ -329,6 +329,57 @@ static void media_print_topology_text(struct media_device *media)
 	}
 }
 
+static void media_print_modes(struct media_device *media)
+{
+	unsigned int nents = media_get_entities_count(media);
+	unsigned int i, j, k;
+
+	for (i = 0; i < nents; ++i) {
+		struct media_entity *entity = media_get_entity(media, i);
+		const struct media_entity_desc *info = media_entity_get_info(entity);
+
+		if (media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+			continue;
+
+		printf("- entity %u: %s\n", info->id, info->name);
+
+		for (j = 0; j < info->pads; ++j) {
+			const struct v4l2_subdev_mode *modes;
+			unsigned int num_modes;
+			int ret;
+
+			ret = v4l2_subdev_get_modes(entity, j, &modes, &num_modes);
+			if (ret < 0) {
+				printf("\tpad%u: unable to enumerate modes (%d)\n",
+				       j, ret);
+				continue;
+			}
+
+			printf("\tpad%u: %u mode%s\n", j, num_modes,
+			       num_modes == 1 ? "" : "s");
+
+			for (k = 0; k < num_modes; ++k) {
+				const struct v4l2_subdev_mode *mode = &modes[k];
+
+				printf("\t\t%s",
+				       v4l2_subdev_pixelcode_to_string(mode->code));
+				if (mode->max_width)
+					printf(" %ux%u", mode->min_width,
+					       mode->min_height);
+				if (mode->max_width != mode->min_width ||
+				    mode->max_height != mode->min_height)
+					printf("-%ux%u", mode->max_width,
+					       mode->max_height);
+				if (mode->interval.denominator)
+					printf(" @%u/%u", mode->interval.numerator,
+					       mode->interval.denominator);
+				printf("\n");
+			}
+		}
+		printf("\n");
+	}
+}
+
 void media_print_topology(struct media_device *media, int dot)
 {
 	if (dot)
@@ -337,6 +388,107 @@ void media_print_topology(struct media_device *media, int dot)
 		media_print_topology_text(media);
 }
 
+static int media_route(struct media_device *media, const char *p)
+{
+	struct media_link_setup *changes;
+	unsigned int num_changes;
+	struct media_entity *sink;
+	struct media_pad *source;
+	unsigned int i;
+	char *end;
+	int ret;
+
+	source = media_parse_pad(media, p, &end);
+	if (source == NULL)
+		return -EINVAL;
+
+	if (end[0] != '-' || end[1] != '>')
+		return -EINVAL;
+
+	sink = media_parse_entity(media, end + 2, &end);
+	if (sink == NULL || *end != '\0')
+		return -EINVAL;
+
+	if (!media_opts.dry_run)
+		return media_setup_route(media, source, sink);
+
+	ret = media_find_route(media, source, sink, &changes, &num_changes);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < num_changes; ++i) {
+		const struct media_link *link = changes[i].link;
+
+		printf("\"%s\":%u->\"%s\":%u[%u]\n",
+		       media_entity_get_info(link->source->entity)->name,
+		       link->source->index,
+		       media_entity_get_info(link->sink->entity)->name,
+		       link->sink->index,
+		       changes[i].flags & MEDIA_LNK_FL_ENABLED ? 1 : 0);
+	}
+
+	free(changes);
+	return 0;
+}
+
+static void media_validate_print(void *priv __attribute__((unused)),
+				 struct media_pad *pad, const char *message)
+{
+	printf("\"%s\":%u: %s\n", media_entity_get_info(pad->entity)->name,
+	       pad->index, message);
+}
+
+/*
+ * Whether the command reads subdev state back after writing it, comparing
+ * values before writing them, or propagating or negotiating formats.
+ */
+static bool media_opts_reads_back(void)
+{
+	return media_opts.skip_identical || media_opts.reconcile ||
+	       media_opts.propagate || media_opts.negotiate ||
+	       media_opts.profile;
+}
+
+/*
+ * When the entity lookup is the only requested action the device is enumerated
+ * until the entity is found, without building the whole graph.
+ */
+static bool media_entity_lookup_only(void)
+{
+	return media_opts.entity && !media_opts.print && !media_opts.print_dot &&
+	       !media_opts.print_modes && !media_opts.pad &&
+	       !media_opts.validate && !media_opts.reset &&
+	       !media_opts.reset_from && !media_opts.route &&
+	       !media_opts.profile && !media_opts.links &&
+	       !media_opts.formats && !media_opts.negotiate &&
+	       !media_opts.propagate && !media_opts.interactive;
+}
+
+struct media_lookup {
+	struct media_device *media;
+	const char *name;
+};
+
+static int media_lookup_entity(
+	void *priv, const struct media_entity_desc *info,
+	const struct media_pad_desc *pads __attribute__((unused)),
+	const struct media_link_desc *links __attribute__((unused)))
+{
+	struct media_lookup *lookup = priv;
+	char devname[32];
+
+	if (strcmp(info->name, lookup->name))
+		return 0;
+
+	if (media_device_get_devname(lookup->media, info, devname,
+				     sizeof(devname)) < 0)
+		printf("(null)\n");
+	else
+		printf("%s\n", devname);
+
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
 	struct media_device *media;
@@ -355,6 +507,40 @@ int main(int argc, char **argv)
 		media_debug_set_handler(media,
 			(void (*)(void *, ...))fprintf, stdout);
 
+	if (media_opts.cache) {
+		ret = media_device_set_cache(media, media_opts.cache);
+		if (ret < 0) {
+			printf("Failed to set topology cache (%d)\n", ret);
+			goto out;
+		}
+	}
+
+	/* Device node names are only needed by a few options, look them up
+	 * on demand.
+	 */
+	media_device_set_lazy_devnames(media, 1);
+
+	if (media_entity_lookup_only()) {
+		struct media_lookup lookup = {
+			.media = media,
+			.name = media_opts.entity,
+		};
+
+		ret = media_device_enumerate_stream(media, media_lookup_entity,
+						    &lookup);
+		if (ret < 0) {
+			printf("Failed to enumerate %s (%d)\n",
+			       media_opts.devname, ret);
+			goto out;
+		}
+
+		if (ret == 0)
+			printf("Entity '%s' not found\n", media_opts.entity);
+
+		ret = 0;
+		goto out;
+	}
+
 	/* Enumerate entities, pads and links. */
 	ret = media_device_enumerate(media);
 	if (ret < 0) {
@@ -362,6 +548,15 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
+	/* All subdev state changes during the run go through libv4l2subdev,
+	 * values read back after being set don't need to be queried again.
+	 * The cache subscribes to events on every subdev it covers, only
+	 * enable it for commands that read state back after writing it.
+	 */
+	if (media_opts_reads_back())
+		v4l2_subdev_enable_cache(media, 1);
+	v4l2_subdev_set_compare(media, media_opts.skip_identical);
+
 	if (media_opts.print) {
 		const struct media_device_info *info = media_get_info(media);
 
@@ -412,10 +607,37 @@ int main(int argc, char **argv)
 	}
 
 	if (media_opts.print || media_opts.print_dot) {
+		/* The topology includes all device node names, and the text
+		 * topology queries the formats of all subdevs. Resolve the names
+		 * and open the subdevs upfront in parallel, failures are
+		 * reported when printing.
+		 */
+		media_device_prefetch_devnames(media, NULL, 0);
+		if (media_opts.print)
+			v4l2_subdev_open_entities(media, NULL, 0);
+
 		media_print_topology(media, media_opts.print_dot);
 		printf("\n");
 	}
 
+	if (media_opts.print_modes)
+		media_print_modes(media);
+
+	if (media_opts.validate) {
+		ret = v4l2_subdev_validate_pipeline(media, media_opts.links,
+				media_opts.formats,
+				media_opts.reset ? V4L2_SUBDEV_VALIDATE_RESET : 0,
+				media_validate_print, NULL);
+		if (ret < 0)
+			printf("Unable to parse configuration: %s (%d)\n",
+			       strerror(-ret), -ret);
+		else if (ret > 0)
+			printf("%d error(s) found\n", ret);
+		else
+			printf("Configuration is valid\n");
+		goto out;
+	}
+
 	if (media_opts.reset) {
 		if (media_opts.verbose)
 			printf("Resetting all links to inactive\n");
@@ -427,8 +649,72 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (media_opts.reset_from) {
+		struct media_entity *entity;
+
+		entity = media_get_entity_by_name(media, media_opts.reset_from,
+						  strlen(media_opts.reset_from));
+		if (entity == NULL) {
+			printf("Entity '%s' not found\n", media_opts.reset_from);
+			goto out;
+		}
+
+		if (media_opts.verbose)
+			printf("Resetting links %s '%s' to inactive\n",
+			       media_opts.reset_downstream ? "downstream of"
+			       : "connected to", media_opts.reset_from);
+		ret = media_reset_links_from(media, entity,
+					     media_opts.reset_downstream ?
+					     MEDIA_RESET_DOWNSTREAM :
+					     MEDIA_RESET_COMPONENT);
+		if (ret) {
+			printf("Unable to reset links: %s (%d)\n",
+			       strerror(-ret), -ret);
+			goto out;
+		}
+	}
+
+	if (media_opts.route) {
+		ret = media_route(media, media_opts.route);
+		if (ret) {
+			printf("Unable to set up route: %s (%d)\n",
+			       strerror(-ret), -ret);
+			goto out;
+		}
+	}
+
+	if (media_opts.profile) {
+		struct v4l2_subdev_profiles *profiles;
+
+		if (media_opts.profiles == NULL) {
+			printf("No profiles file given\n");
+			ret = -EINVAL;
+			goto out;
+		}
+
+		profiles = v4l2_subdev_profiles_new(media);
+		if (profiles == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = v4l2_subdev_profiles_load(profiles, media_opts.profiles);
+		if (ret == 0)
+			ret = v4l2_subdev_profiles_apply(profiles,
+							 media_opts.profile);
+		v4l2_subdev_profiles_free(profiles);
+		if (ret) {
+			printf("Unable to apply profile %s: %s (%d)\n",
+			       media_opts.profile, strerror(-ret), -ret);
+			goto out;
+		}
+	}
+
 	if (media_opts.links) {
-		ret = media_parse_setup_links(media, media_opts.links);
+		if (media_opts.reconcile)
+			ret = media_reconcile_links(media, media_opts.links);
+		else
+			ret = media_parse_setup_links(media, media_opts.links);
 		if (ret) {
 			printf("Unable to parse link: %s (%d)\n",
 			       strerror(-ret), -ret);
@@ -436,14 +722,77 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (media_opts.formats) {
-		ret = v4l2_subdev_parse_setup_formats(media,
-						      media_opts.formats);
+	if (media_opts.formats && media_opts.dry_run) {
+		ret = v4l2_subdev_try_setup_formats(media, media_opts.formats,
+						    V4L2_SUBDEV_TRY_ONLY,
+						    media_validate_print, NULL);
+		if (ret < 0) {
+			printf("Unable to try formats: %s (%d)\n",
+			       strerror(-ret), -ret);
+			goto out;
+		}
+
+		printf("%d format(s) adjusted\n", ret);
+		ret = 0;
+	} else if (media_opts.formats) {
+		if (media_opts.reconcile)
+			ret = v4l2_subdev_reconcile_formats(media,
+							    media_opts.formats);
+		else if (media_opts.parallel)
+			ret = v4l2_subdev_parse_setup_formats_parallel(media,
+							media_opts.formats);
+		else
+			ret = v4l2_subdev_parse_setup_formats(media,
+							      media_opts.formats);
 		if (ret) {
 			printf("Unable to setup formats: %s (%d)\n",
 			       strerror(-ret), -ret);
 			goto out;
 		}
+
+		if (media_opts.verbose) {
+			struct v4l2_subdev_skip_counts skipped;
+
+			v4l2_subdev_get_skip_counts(media, &skipped);
+			printf("Skipped %u format(s), %u selection(s), %u frame interval(s)\n",
+			       skipped.format, skipped.selection,
+			       skipped.interval);
+		}
+	}
+
+	if (media_opts.negotiate) {
+		struct v4l2_subdev_mode mode;
+
+		ret = v4l2_subdev_parse_negotiate(media, media_opts.negotiate,
+						  &mode);
+		if (ret) {
+			printf("Unable to negotiate formats: %s (%d)\n",
+			       strerror(-ret), -ret);
+			goto out;
+		}
+
+		if (media_opts.verbose)
+			printf("Selected sensor mode %s %ux%u @%u/%u\n",
+			       v4l2_subdev_pixelcode_to_string(mode.code),
+			       mode.max_width, mode.max_height,
+			       mode.interval.numerator,
+			       mode.interval.denominator);
+	}
+
+	if (media_opts.propagate) {
+		struct media_pad *stop;
+
+		ret = v4l2_subdev_propagate_formats(media, NULL, &stop);
+		if (ret) {
+			if (stop)
+				printf("Unable to propagate formats at pad \"%s\":%u: %s (%d)\n",
+				       media_entity_get_info(stop->entity)->name,
+				       stop->index, strerror(-ret), -ret);
+			else
+				printf("Unable to propagate formats: %s (%d)\n",
+				       strerror(-ret), -ret);
+			goto out;
+		}
 	}
 
 	if (media_opts.interactive) {
@@ -0,0 +1,646 @@
+/*
+ * Media controller interface library - persistent topology cache
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/media.h>
+
+#include "mediactl.h"
+#include "mediactl-priv.h"
+#include "tools.h"
+
+/*
+ * The cache file is a flat snapshot of the topology made of fixed-size records
+ * that can be used directly from an mmap()ed file:
+ *
+ *	struct media_cache_header	header
+ *	struct media_cache_entity	entities[header.num_entities]
+ *	struct media_cache_pad		pads[header.num_pads]
+ *	struct media_cache_link		links[header.num_links]
+ *
+ * Pads are stored in entity order, entity->info.pads records per entity. Only
+ * forward links are stored, backlinks are recreated when loading the cache.
+ * Entities are referenced by their index in the entities array.
+ *
+ * The file is only valid for the machine that wrote it, no attempt is made to
+ * handle endianness or structure layout differences.
+ */
+
+#define MEDIA_CACHE_MAGIC	"MCTLTOPO"
+#define MEDIA_CACHE_VERSION	2
+
+struct media_cache_header {
+	char magic[8];
+	__u32 version;
+	__u32 size;
+	__u32 checksum;
+	__u32 num_entities;
+	__u32 num_pads;
+	__u32 num_links;
+	struct media_device_info info;
+};
+
+struct media_cache_entity {
+	struct media_entity_desc info;
+	char devname[32];
+};
+
+struct media_cache_pad {
+	__u32 index;
+	__u32 flags;
+};
+
+struct media_cache_link {
+	__u32 source;
+	__u32 source_pad;
+	__u32 sink;
+	__u32 sink_pad;
+	__u32 flags;
+};
+
+__u32 media_cache_checksum(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	__u32 hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static unsigned long long media_cache_key(const struct media_device_info *info)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	const unsigned char *fields[] = {
+		(const unsigned char *)info->driver,
+		(const unsigned char *)info->serial,
+		(const unsigned char *)info->bus_info,
+	};
+	unsigned int i;
+	size_t j;
+
+	for (i = 0; i < ARRAY_SIZE(fields); ++i) {
+		for (j = 0; fields[i][j]; ++j) {
+			hash ^= fields[i][j];
+			hash *= 1099511628211ULL;
+		}
+		hash ^= 0xff;
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= info->hw_revision;
+	hash *= 1099511628211ULL;
+	hash ^= info->driver_version;
+	hash *= 1099511628211ULL;
+
+	return hash;
+}
+
+/*
+ * Two device information structures describe the same device if all the
+ * fields used to build the cache key match. The media API version is checked
+ * as well as it influences the kernel enumeration behaviour.
+ */
+static bool media_cache_info_match(const struct media_device_info *a,
+				   const struct media_device_info *b)
+{
+	return strncmp(a->driver, b->driver, sizeof(a->driver)) == 0 &&
+	       strncmp(a->serial, b->serial, sizeof(a->serial)) == 0 &&
+	       strncmp(a->bus_info, b->bus_info, sizeof(a->bus_info)) == 0 &&
+	       a->hw_revision == b->hw_revision &&
+	       a->driver_version == b->driver_version &&
+	       a->media_version == b->media_version;
+}
+
+char *media_cache_path(struct media_device *media, const char *ext)
+{
+	size_t size;
+	char *path;
+
+	size = strlen(media->cache_dir) + strlen(ext)
+	     + sizeof("/media-0123456789abcdef.");
+	path = malloc(size);
+	if (path == NULL)
+		return NULL;
+
+	snprintf(path, size, "%s/media-%016llx.%s", media->cache_dir,
+		 media_cache_key(&media->info), ext);
+	return path;
+}
+
+int media_cache_write(struct media_device *media, const char *path,
+		      const void *data, size_t size)
+{
+	ssize_t written;
+	char *tmppath;
+	int ret;
+	int fd;
+
+	tmppath = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (tmppath == NULL)
+		return -ENOMEM;
+
+	/* Write to a temporary file and rename it to update the cache
+	 * atomically, concurrent readers will see either the old or the new
+	 * version.
+	 */
+	sprintf(tmppath, "%s.XXXXXX", path);
+	fd = mkstemp(tmppath);
+	if (fd < 0) {
+		ret = -errno;
+		media_dbg(media, "Unable to create cache file %s (%s)\n",
+			  path, strerror(errno));
+		goto done;
+	}
+
+	fchmod(fd, 0644);
+	written = write(fd, data, size);
+	ret = written == (ssize_t)size ? 0 : written < 0 ? -errno : -ENOSPC;
+	close(fd);
+
+	if (ret == 0 && rename(tmppath, path) < 0)
+		ret = -errno;
+
+	if (ret < 0) {
+		unlink(tmppath);
+		media_dbg(media, "Unable to write cache file %s (%s)\n",
+			  path, strerror(-ret));
+	}
+
+done:
+	free(tmppath);
+	return ret;
+}
+
+int media_device_set_cache(struct media_device *media, const char *path)
+{
+	char *dir = NULL;
+
+	if (path != NULL) {
+		dir = strdup(path);
+		if (dir == NULL)
+			return -ENOMEM;
+	}
+
+	free(media->cache_dir);
+	media->cache_dir = dir;
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Load
+ */
+
+static int media_cache_validate(struct media_device *media, const void *data,
+				size_t size)
+{
+	const struct media_cache_header *header = data;
+	const struct media_cache_entity *entities;
+	const struct media_cache_pad *pads;
+	const struct media_cache_link *links;
+	unsigned int num_pads = 0;
+	unsigned int i;
+
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, MEDIA_CACHE_MAGIC, sizeof(header->magic)) ||
+	    header->version != MEDIA_CACHE_VERSION)
+		return -EINVAL;
+
+	if (!media_cache_info_match(&header->info, &media->info))
+		return -ESTALE;
+
+	if (header->num_entities > size / sizeof(*entities) ||
+	    header->num_pads > size / sizeof(*pads) ||
+	    header->num_links > size / sizeof(*links) ||
+	    header->size != size ||
+	    size != sizeof(*header)
+		  + header->num_entities * sizeof(*entities)
+		  + header->num_pads * sizeof(*pads)
+		  + header->num_links * sizeof(*links))
+		return -EINVAL;
+
+	if (header->checksum != media_cache_checksum(header + 1,
+						     size - sizeof(*header)))
+		return -EINVAL;
+
+	entities = (const void *)(header + 1);
+	pads = (const void *)(entities + header->num_entities);
+	links = (const void *)(pads + header->num_pads);
+
+	for (i = 0; i < header->num_entities; ++i)
+		num_pads += entities[i].info.pads;
+
+	if (num_pads != header->num_pads)
+		return -EINVAL;
+
+	for (i = 0; i < header->num_links; ++i) {
+		const struct media_cache_link *link = &links[i];
+
+		if (link->source >= header->num_entities ||
+		    link->sink >= header->num_entities ||
+		    link->source_pad >= entities[link->source].info.pads ||
+		    link->sink_pad >= entities[link->sink].info.pads)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Verify the cached topology against the kernel and refresh the link flags.
+ *
+ * The entities are enumerated from the kernel and their descriptors, including
+ * the number of pads and links, must match the cache exactly. Entities added
+ * to or removed from the device are detected by the enumeration.
+ *
+ * Link flags are runtime state and can't be trusted from the cache. They're
+ * refreshed for all entities that have at least one mutable outbound link,
+ * which also verifies the endpoints of those links. The endpoints of immutable
+ * links are only covered by the link counts.
+ */
+static int media_cache_refresh_links(struct media_device *media,
+				     const struct media_cache_header *header,
+				     __u32 *flags)
+{
+	const struct media_cache_entity *entities = (const void *)(header + 1);
+	const struct media_cache_pad *pads =
+		(const void *)(entities + header->num_entities);
+	const struct media_cache_link *links =
+		(const void *)(pads + header->num_pads);
+	struct media_link_desc *descs = NULL;
+	struct media_entity_desc info;
+	unsigned int max_descs = 0;
+	unsigned int first = 0;
+	unsigned int i, j;
+	__u32 id = 0;
+	int ret = 0;
+
+	for (i = 0; i < header->num_entities; ++i) {
+		const struct media_cache_entity *entity = &entities[i];
+		unsigned int count = entity->info.links;
+		struct media_links_enum desc;
+		bool dynamic = false;
+
+		memset(&info, 0, sizeof(info));
+		info.id = id | MEDIA_ENT_ID_FLAG_NEXT;
+
+		if (ioctl(media->fd, MEDIA_IOC_ENUM_ENTITIES, &info) < 0) {
+			/* The device has less entities than the cache. */
+			ret = errno == EINVAL ? -ESTALE : -errno;
+			break;
+		}
+
+		/*
+		 * The cache stores the descriptors as reported by the kernel,
+		 * they must be identical.
+		 */
+		if (memcmp(&info, &entity->info, sizeof(info))) {
+			ret = -ESTALE;
+			break;
+		}
+
+		id = info.id;
+
+		if (first + count > header->num_links) {
+			ret = -EINVAL;
+			break;
+		}
+
+		for (j = first; j < first + count; ++j) {
+			if (links[j].source != i) {
+				ret = -EINVAL;
+				goto done;
+			}
+
+			flags[j] = links[j].flags;
+			if (!(links[j].flags & MEDIA_LNK_FL_IMMUTABLE))
+				dynamic = true;
+		}
+
+		if (!dynamic) {
+			first += count;
+			continue;
+		}
+
+		/*
+		 * The kernel copies all links of the entity without bounds
+		 * check, size the buffer from the count it just reported.
+		 */
+		if (info.links > max_descs) {
+			struct media_link_desc *tmp;
+
+			tmp = realloc(descs, info.links * sizeof(*descs));
+			if (tmp == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			descs = tmp;
+			max_descs = info.links;
+		}
+
+		memset(&desc, 0, sizeof(desc));
+		desc.entity = entity->info.id;
+		desc.links = descs;
+
+		if (ioctl(media->fd, MEDIA_IOC_ENUM_LINKS, &desc) < 0) {
+			ret = -errno;
+			break;
+		}
+
+		for (j = 0; j < count; ++j) {
+			const struct media_cache_link *link = &links[first + j];
+			const struct media_link_desc *ulink = &descs[j];
+
+			if (ulink->source.entity != entity->info.id ||
+			    ulink->source.index != link->source_pad ||
+			    ulink->sink.entity != entities[link->sink].info.id ||
+			    ulink->sink.index != link->sink_pad) {
+				ret = -ESTALE;
+				goto done;
+			}
+
+			flags[first + j] = ulink->flags;
+		}
+
+		first += count;
+	}
+
+	if (ret == 0 && first != header->num_links)
+		ret = -EINVAL;
+
+	/* Make sure the device has no entity beyond the cached ones. */
+	if (ret == 0) {
+		memset(&info, 0, sizeof(info));
+		info.id = id | MEDIA_ENT_ID_FLAG_NEXT;
+
+		if (ioctl(media->fd, MEDIA_IOC_ENUM_ENTITIES, &info) == 0)
+			ret = -ESTALE;
+	}
+
+done:
+	free(descs);
+	return ret;
+}
+
+static int media_cache_build(struct media_device *media,
+			     const struct media_cache_header *header,
+			     const __u32 *flags)
+{
+	const struct media_cache_entity *entities = (const void *)(header + 1);
+	const struct media_cache_pad *pads =
+		(const void *)(entities + header->num_entities);
+	const struct media_cache_link *links =
+		(const void *)(pads + header->num_pads);
+	unsigned int i, j;
+	int ret;
+
+	ret = media_device_alloc_graph(media, header->num_entities,
+				       header->num_pads, header->num_links * 2);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < header->num_entities; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		entity->info = entities[i].info;
+		memcpy(entity->devname, entities[i].devname,
+		       sizeof(entity->devname));
+		entity->devname[sizeof(entity->devname) - 1] = '\0';
+	}
+
+	for (i = 0; i < header->num_links; ++i) {
+		media->entities[links[i].source].max_links++;
+		media->entities[links[i].sink].max_links++;
+	}
+
+	media_device_init_graph(media);
+
+	for (i = 0; i < header->num_entities; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->info.pads; ++j, ++pads) {
+			entity->pads[j].index = pads->index;
+			entity->pads[j].flags = pads->flags;
+		}
+	}
+
+	for (i = 0; i < header->num_links; ++i) {
+		const struct media_cache_link *link = &links[i];
+		struct media_entity *source = &media->entities[link->source];
+		struct media_entity *sink = &media->entities[link->sink];
+
+		media_device_add_link(&source->pads[link->source_pad],
+				      &sink->pads[link->sink_pad], flags[i]);
+	}
+
+	return media_device_sort_links(media);
+}
+
+int media_cache_load(struct media_device *media)
+{
+	const struct media_cache_header *header;
+	struct stat st;
+	__u32 *flags = NULL;
+	void *data;
+	char *path;
+	int ret;
+	int fd;
+
+	path = media_cache_path(media, "topo");
+	if (path == NULL)
+		return -ENOMEM;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		media_dbg(media, "No topology cache at %s\n", path);
+		free(path);
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		free(path);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		free(path);
+		return -errno;
+	}
+
+	header = data;
+
+	ret = media_cache_validate(media, data, st.st_size);
+	if (ret < 0) {
+		media_dbg(media, "Ignoring %s topology cache %s\n",
+			  ret == -ESTALE ? "stale" : "invalid", path);
+		goto done;
+	}
+
+	flags = malloc((header->num_links ? header->num_links : 1)
+		       * sizeof(*flags));
+	if (flags == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = media_cache_refresh_links(media, header, flags);
+	if (ret < 0) {
+		media_dbg(media, "Topology cache %s doesn't match the device\n",
+			  path);
+		goto done;
+	}
+
+	ret = media_cache_build(media, header, flags);
+	if (ret < 0) {
+		media_device_free_entities(media);
+		goto done;
+	}
+
+	media_dbg(media, "Loaded topology from cache %s\n", path);
+
+done:
+	munmap(data, st.st_size);
+	free(flags);
+	free(path);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Store
+ */
+
+int media_cache_store(struct media_device *media,
+		      const struct media_link_desc *ulinks)
+{
+	struct media_cache_header *header;
+	struct media_cache_entity *entities;
+	struct media_cache_pad *pads;
+	struct media_cache_link *links;
+	unsigned int num_pads = 0;
+	unsigned int num_links = 0;
+	unsigned int i, j;
+	char *path = NULL;
+	size_t size;
+	void *data;
+	int ret;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		num_pads += entity->info.pads;
+		num_links += entity->info.links;
+	}
+
+	size = sizeof(*header) + media->entities_count * sizeof(*entities)
+	     + num_pads * sizeof(*pads) + num_links * sizeof(*links);
+
+	data = calloc(1, size);
+	if (data == NULL)
+		return -ENOMEM;
+
+	header = data;
+	entities = (void *)(header + 1);
+	pads = (void *)(entities + media->entities_count);
+	links = (void *)(pads + num_pads);
+
+	memcpy(header->magic, MEDIA_CACHE_MAGIC, sizeof(header->magic));
+	header->version = MEDIA_CACHE_VERSION;
+	header->size = size;
+	header->num_entities = media->entities_count;
+	header->num_pads = num_pads;
+	header->num_links = num_links;
+	header->info = media->info;
+
+	/*
+	 * Links are stored grouped by source entity in the order the kernel
+	 * reports them. This allows validating them against the kernel with a
+	 * single MEDIA_IOC_ENUM_LINKS call per entity when loading the cache,
+	 * and rebuilding the graph in the same order as an enumeration. The
+	 * entity links are sorted by pad, use the kernel descriptors.
+	 */
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		entities[i].info = entity->info;
+		memcpy(entities[i].devname, entity->devname,
+		       sizeof(entities[i].devname));
+
+		for (j = 0; j < entity->info.pads; ++j, ++pads) {
+			pads->index = entity->pads[j].index;
+			pads->flags = entity->pads[j].flags;
+		}
+
+		for (j = 0; j < entity->info.links; ++j, ++ulinks) {
+			struct media_entity *sink;
+
+			sink = media_get_entity_by_id(media, ulinks->sink.entity);
+
+			links->source = i;
+			links->source_pad = ulinks->source.index;
+			links->sink = sink - media->entities;
+			links->sink_pad = ulinks->sink.index;
+			links->flags = ulinks->flags;
+			links++;
+		}
+	}
+
+	header->checksum = media_cache_checksum(header + 1,
+						size - sizeof(*header));
+
+	path = media_cache_path(media, "topo");
+	if (path == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = media_cache_write(media, path, data, size);
+	if (ret < 0)
+		goto done;
+
+	media_dbg(media, "Stored topology in cache %s\n", path);
+
+done:
+	free(path);
+	free(data);
+	return ret;
+}
@@ -22,20 +22,55 @@
 #ifndef __MEDIA_PRIV_H__
 #define __MEDIA_PRIV_H__
 
+#include <stdbool.h>
+
 #include <linux/media.h>
+#include <linux/v4l2-subdev.h>
 
 #include "mediactl.h"
 
+/*
+ * Links of an entity are sorted by pad, see media_device_sort_links(). The
+ * links of a pad start at index first in the entity links array, with the
+ * num_out links originating from the pad followed by the num_in links
+ * arriving at the pad.
+ */
+struct media_pad_links {
+	unsigned int first;
+	unsigned int num_out;
+	unsigned int num_in;
+};
+
 struct media_entity {
 	struct media_device *media;
 	struct media_entity_desc info;
 	struct media_pad *pads;
+	struct media_pad_links *pad_links;
 	struct media_link *links;
 	unsigned int max_links;
 	unsigned int num_links;
 
 	char devname[32];
+	bool devname_pending;
 	int fd;
+	unsigned long fd_serial;
+
+	/* Cached subdev state, see v4l2_subdev_enable_cache(). */
+	struct v4l2_subdev_cache *cache;
+
+	/* Supported modes, see v4l2_subdev_get_modes(). */
+	struct v4l2_subdev_mode *modes;
+	unsigned int num_modes;
+	bool modes_valid;
+
+	/* Sub-device capabilities, see v4l2_subdev_get_caps(). */
+	unsigned int subdev_caps;
+	unsigned int subdev_caps_valid;
+};
+
+struct media_entity_id {
+	__u32 id;
+	unsigned int index;
 };
 
 struct media_device {
@@ -47,9 +82,58 @@ struct media_device {
 	struct media_entity *entities;
 	unsigned int entities_count;
 
+	/* Entities, pads and links storage, see media_device_alloc_graph(). */
+	void *graph;
+	struct media_pad *pads;
+	unsigned int pads_count;
+	struct media_link *links;
+	unsigned int links_count;
+	struct media_pad_links *pad_links;
+
+	/* Entity lookup by ID and name, see media_device_index_entities(). */
+	unsigned int *entities_by_id;
+	unsigned int entities_max_id;
+	struct media_entity_id *entities_sorted;
+	unsigned int *entities_by_name;
+	unsigned int entities_by_name_mask;
+
 	void (*debug_handler)(void *, ...);
 	void *debug_priv;
 
+	char *cache_dir;
+	bool lazy_devnames;
+	struct udev *udev;
+	bool subdev_cache;
+	bool modes_loaded;
+
+	/* Subdev file descriptors pool, see v4l2_subdev_set_max_open(). */
+	struct {
+		unsigned int max;
+		unsigned int holds;
+		unsigned long serial;
+	} fd_pool;
+
+	/* Compare before write, see v4l2_subdev_set_compare(). */
+	struct {
+		bool enabled;
+		unsigned int format;
+		unsigned int selection;
+		unsigned int interval;
+	} compare;
+
+	/*
+	 * Link setup transaction, see media_links_begin(). The slot array is
+	 * indexed by link position in the links array and stores the staged
+	 * index of the link plus one, or zero when the link isn't staged.
+	 */
+	struct {
+		bool active;
+		struct media_link_setup *staged;
+		unsigned int count;
+		unsigned int max;
+		unsigned int *slot;
+	} setup;
+
 	struct {
 		struct media_entity *v4l;
 		struct media_entity *fb;
@@ -61,4 +145,83 @@ struct media_device {
 #define media_dbg(media, ...) \
 	(media)->debug_handler((media)->debug_priv, __VA_ARGS__)
 
+/* mediactl.c */
+int media_device_alloc_graph(struct media_device *media,
+			     unsigned int num_entities, unsigned int num_pads,
+			     unsigned int num_links);
+void media_device_init_graph(struct media_device *media);
+int media_device_add_link(struct media_pad *source, struct media_pad *sink,
+			  __u32 flags);
+int media_device_sort_links(struct media_device *media);
+void media_device_free_entities(struct media_device *media);
+int media_device_index_entities(struct media_device *media);
+/* Stage all enabled mutable links as disabled in the current transaction. */
+int media_links_stage_disable_all(struct media_device *media);
+int media_parse_links(struct media_device *media, const char *p,
+		      struct media_link_setup **links, unsigned int *num_links);
+
+/* mediactl-cache.c */
+int media_cache_load(struct media_device *media);
+/* Store the topology, ulinks are the links in enumeration order. */
+int media_cache_store(struct media_device *media,
+		      const struct media_link_desc *ulinks);
+/* Compute the checksum stored in cache file headers. */
+__u32 media_cache_checksum(const void *data, size_t size);
+/* Return the path of the cache file with the given extension for the device. */
+char *media_cache_path(struct media_device *media, const char *ext);
+/* Atomically replace the cache file at path with the given data. */
+int media_cache_write(struct media_device *media, const char *path,
+		      const void *data, size_t size);
+
+/* v4l2subdev.c */
+
+/*
+ * Desired configuration of a subdev pad. Unset properties have a zero width
+ * format, a crop or compose rectangle with a -1 left offset, or a zero frame
+ * interval numerator.
+ */
+struct v4l2_subdev_pad_state {
+	struct media_pad *pad;
+	struct v4l2_mbus_framefmt format;
+	struct v4l2_rect crop;
+	struct v4l2_rect compose;
+	struct v4l2_fract interval;
+};
+
+int v4l2_subdev_parse_pad_states(struct media_device *media, const char *p,
+				 struct v4l2_subdev_pad_state **states,
+				 unsigned int *num_states);
+/* Return the number of properties set, or a negative error code. */
+int v4l2_subdev_reconcile_pad(struct v4l2_subdev_pad_state *state);
+/*
+ * Keep all subdevs open until the matching release, for operations that rely
+ * on the TRY state. Holds nest, the pool is trimmed on the last release.
+ */
+void v4l2_subdev_hold_pool(struct media_device *media);
+void v4l2_subdev_release_pool(struct media_device *media);
+
+/*
+ * ACTIVE format and selection rectangles of a pad. The valid field is a bitmask
+ * of cached entries, bit 0 for the format and bits 1 to 6 for the selection
+ * targets in the order of v4l2_subdev_cache_target(). Selection targets not
+ * supported by the subdev are cached with their error code.
+ */
+#define V4L2_SUBDEV_CACHE_FORMAT	(1 << 0)
+#define V4L2_SUBDEV_CACHE_SEL(n)	(1 << ((n) + 1))
+#define V4L2_SUBDEV_CACHE_NUM_SEL	6
+
+struct v4l2_subdev_pad_cache {
+	unsigned int valid;
+	struct v4l2_mbus_framefmt format;
+	int sel_ret[V4L2_SUBDEV_CACHE_NUM_SEL];
+	struct v4l2_rect sel[V4L2_SUBDEV_CACHE_NUM_SEL];
+};
+
+struct v4l2_subdev_cache {
+	bool subscribed;
+	bool interval_valid;
+	struct v4l2_fract interval;
+	struct v4l2_subdev_pad_cache pads[];
+};
+
 #endif /* __MEDIA_PRIV_H__ */
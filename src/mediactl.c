@@ -23,11 +23,14 @@
 
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,26 +48,150 @@
  * Graph access
  */
 
+static struct media_pad_links *media_pad_links(struct media_pad *pad)
+{
+	struct media_entity *entity = pad->entity;
+
+	if (entity->pad_links == NULL)
+		return NULL;
+
+	return &entity->pad_links[pad - entity->pads];
+}
+
 struct media_pad *media_entity_remote_source(struct media_pad *pad)
 {
+	struct media_pad_links *plinks;
+	struct media_link *links;
 	unsigned int i;
 
 	if (!(pad->flags & MEDIA_PAD_FL_SINK))
 		return NULL;
 
-	for (i = 0; i < pad->entity->num_links; ++i) {
-		struct media_link *link = &pad->entity->links[i];
+	plinks = media_pad_links(pad);
+	if (plinks == NULL)
+		return NULL;
+
+	links = &pad->entity->links[plinks->first + plinks->num_out];
+
+	for (i = 0; i < plinks->num_in; ++i) {
+		if (links[i].flags & MEDIA_LNK_FL_ENABLED)
+			return links[i].source;
+	}
+
+	return NULL;
+}
+
+unsigned int media_entity_remote_sinks(struct media_pad *pad,
+				       struct media_pad **sinks,
+				       unsigned int max_sinks)
+{
+	struct media_pad_links *plinks;
+	struct media_link *links;
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (!(pad->flags & MEDIA_PAD_FL_SOURCE))
+		return 0;
+
+	plinks = media_pad_links(pad);
+	if (plinks == NULL)
+		return 0;
+
+	links = &pad->entity->links[plinks->first];
+
+	for (i = 0; i < plinks->num_out; ++i) {
+		if (!(links[i].flags & MEDIA_LNK_FL_ENABLED))
+			continue;
+
+		if (count < max_sinks)
+			sinks[count] = links[i].sink;
+		count++;
+	}
+
+	return count;
+}
+
+unsigned int media_pad_get_links_count(struct media_pad *pad)
+{
+	struct media_pad_links *plinks = media_pad_links(pad);
+
+	return plinks ? plinks->num_out + plinks->num_in : 0;
+}
+
+struct media_link *media_pad_get_link(struct media_pad *pad, unsigned int index)
+{
+	struct media_pad_links *plinks = media_pad_links(pad);
+
+	if (plinks == NULL || index >= plinks->num_out + plinks->num_in)
+		return NULL;
+
+	return &pad->entity->links[plinks->first + index];
+}
+
+unsigned int media_pad_get_enabled_links(struct media_pad *pad,
+					 struct media_link **links,
+					 unsigned int max_links)
+{
+	struct media_pad_links *plinks = media_pad_links(pad);
+	struct media_link *link;
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (plinks == NULL)
+		return 0;
+
+	link = &pad->entity->links[plinks->first];
 
+	for (i = 0; i < plinks->num_out + plinks->num_in; ++i, ++link) {
 		if (!(link->flags & MEDIA_LNK_FL_ENABLED))
 			continue;
 
-		if (link->sink == pad)
-			return link->source;
+		if (count < max_links)
+			links[count] = link;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Find the link between a source and a sink pad, using the outbound links
+ * of the source pad.
+ */
+static struct media_link *media_pad_find_link(struct media_pad *source,
+					      struct media_pad *sink)
+{
+	struct media_pad_links *plinks = media_pad_links(source);
+	struct media_link *links;
+	unsigned int i;
+
+	if (plinks == NULL)
+		return NULL;
+
+	links = &source->entity->links[plinks->first];
+
+	for (i = 0; i < plinks->num_out; ++i) {
+		if (links[i].sink->entity == sink->entity &&
+		    links[i].sink->index == sink->index)
+			return &links[i];
 	}
 
 	return NULL;
 }
 
+static unsigned int media_entity_name_hash(const char *name, size_t length)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < length; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
 struct media_entity *media_get_entity_by_name(struct media_device *media,
 					      const char *name, size_t length)
 {
@@ -76,6 +203,22 @@ struct media_entity *media_get_entity_by_name(struct media_device *media,
 	if (length >= FIELD_SIZEOF(struct media_entity_desc, name))
 		return NULL;
 
+	if (media->entities_by_name) {
+		unsigned int mask = media->entities_by_name_mask;
+
+		for (i = media_entity_name_hash(name, length) & mask;
+		     media->entities_by_name[i]; i = (i + 1) & mask) {
+			struct media_entity *entity =
+				&media->entities[media->entities_by_name[i] - 1];
+
+			if (strncmp(entity->info.name, name, length) == 0 &&
+			    entity->info.name[length] == '\0')
+				return entity;
+		}
+
+		return NULL;
+	}
+
 	for (i = 0; i < media->entities_count; ++i) {
 		struct media_entity *entity = &media->entities[i];
 
@@ -87,6 +230,28 @@ struct media_entity *media_get_entity_by_name(struct media_device *media,
 	return NULL;
 }
 
+/*
+ * Return the position in the sorted entities index of the first entity whose
+ * ID is larger than or equal to @id.
+ */
+static unsigned int media_entity_id_lower_bound(struct media_device *media,
+						__u32 id)
+{
+	unsigned int lo = 0;
+	unsigned int hi = media->entities_count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (media->entities_sorted[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 struct media_entity *media_get_entity_by_id(struct media_device *media,
 					    __u32 id)
 {
@@ -95,6 +260,26 @@ struct media_entity *media_get_entity_by_id(struct media_device *media,
 
 	id &= ~MEDIA_ENT_ID_FLAG_NEXT;
 
+	if (!next && media->entities_by_id) {
+		if (id > media->entities_max_id ||
+		    media->entities_by_id[id] == 0)
+			return NULL;
+
+		return &media->entities[media->entities_by_id[id] - 1];
+	}
+
+	if (media->entities_sorted) {
+		if (next && id == ~MEDIA_ENT_ID_FLAG_NEXT)
+			return NULL;
+
+		i = media_entity_id_lower_bound(media, next ? id + 1 : id);
+		if (i == media->entities_count ||
+		    (!next && media->entities_sorted[i].id != id))
+			return NULL;
+
+		return &media->entities[media->entities_sorted[i].index];
+	}
+
 	for (i = 0; i < media->entities_count; ++i) {
 		struct media_entity *entity = &media->entities[i];
 
@@ -142,9 +327,46 @@ const struct media_link *media_entity_get_link(struct media_entity *entity, unsi
 
 const char *media_entity_get_devname(struct media_entity *entity)
 {
+	if (entity->devname_pending)
+		media_device_prefetch_devnames(entity->media, &entity, 1);
+
 	return entity->devname[0] ? entity->devname : NULL;
 }
 
+int media_device_get_devname(struct media_device *media,
+			     const struct media_entity_desc *info,
+			     char *devname, size_t size)
+{
+	struct media_entity *entity = NULL;
+	struct media_entity tmp;
+	const char *name;
+
+	if (media->entities)
+		entity = media_get_entity_by_id(media, info->id);
+
+	if (entity == NULL) {
+		/* The graph isn't built yet, resolve through a private copy. */
+		memset(&tmp, 0, sizeof(tmp));
+		tmp.media = media;
+		tmp.info = *info;
+		tmp.fd = -1;
+		tmp.devname_pending =
+			media_entity_type(&tmp) == MEDIA_ENT_T_DEVNODE ||
+			media_entity_type(&tmp) == MEDIA_ENT_T_V4L2_SUBDEV;
+		entity = &tmp;
+	}
+
+	name = media_entity_get_devname(entity);
+	if (name == NULL)
+		return -ENODEV;
+
+	if (strlen(name) >= size)
+		return -ENOSPC;
+
+	strcpy(devname, name);
+	return 0;
+}
+
 struct media_entity *media_get_default_entity(struct media_device *media,
 					      unsigned int type)
 {
@@ -213,44 +435,20 @@ static void media_device_close(struct media_device *media)
  * Link setup
  */
 
-int media_setup_link(struct media_device *media,
-		     struct media_pad *source,
-		     struct media_pad *sink,
-		     __u32 flags)
+static int __media_setup_link(struct media_device *media,
+			      struct media_link *link, __u32 flags)
 {
-	struct media_link *link;
 	struct media_link_desc ulink;
-	unsigned int i;
 	int ret;
 
-	ret = media_device_open(media);
-	if (ret < 0)
-		goto done;
-
-	for (i = 0; i < source->entity->num_links; i++) {
-		link = &source->entity->links[i];
-
-		if (link->source->entity == source->entity &&
-		    link->source->index == source->index &&
-		    link->sink->entity == sink->entity &&
-		    link->sink->index == sink->index)
-			break;
-	}
-
-	if (i == source->entity->num_links) {
-		media_dbg(media, "%s: Link not found\n", __func__);
-		ret = -ENOENT;
-		goto done;
-	}
-
 	/* source pad */
-	ulink.source.entity = source->entity->info.id;
-	ulink.source.index = source->index;
+	ulink.source.entity = link->source->entity->info.id;
+	ulink.source.index = link->source->index;
 	ulink.source.flags = MEDIA_PAD_FL_SOURCE;
 
 	/* sink pad */
-	ulink.sink.entity = sink->entity->info.id;
-	ulink.sink.index = sink->index;
+	ulink.sink.entity = link->sink->entity->info.id;
+	ulink.sink.index = link->sink->index;
 	ulink.sink.flags = MEDIA_PAD_FL_SINK;
 
 	ulink.flags = flags | (link->flags & MEDIA_LNK_FL_IMMUTABLE);
@@ -260,175 +458,1382 @@ int media_setup_link(struct media_device *media,
 		ret = -errno;
 		media_dbg(media, "%s: Unable to setup link (%s)\n",
 			  __func__, strerror(errno));
-		goto done;
+		return ret;
 	}
 
 	link->flags = ulink.flags;
 	link->twin->flags = ulink.flags;
 
-	ret = 0;
+	return 0;
+}
+
+int media_setup_link(struct media_device *media,
+		     struct media_pad *source,
+		     struct media_pad *sink,
+		     __u32 flags)
+{
+	struct media_link *link;
+	int ret;
+
+	ret = media_device_open(media);
+	if (ret < 0)
+		goto done;
+
+	link = media_pad_find_link(source, sink);
+	if (link == NULL) {
+		media_dbg(media, "%s: Link not found\n", __func__);
+		ret = -ENOENT;
+		goto done;
+	}
+
+	ret = __media_setup_link(media, link, flags);
 
 done:
-	media_device_close(media);
+	/* Keep the device open for the transaction in progress, if any. */
+	if (!media->setup.active)
+		media_device_close(media);
 	return ret;
 }
 
-int media_reset_links(struct media_device *media)
+int media_links_begin(struct media_device *media)
 {
-	unsigned int i, j;
-	int ret;
+	if (media->setup.active)
+		return -EBUSY;
 
-	for (i = 0; i < media->entities_count; ++i) {
-		struct media_entity *entity = &media->entities[i];
+	media->setup.active = true;
+	media->setup.count = 0;
 
-		for (j = 0; j < entity->num_links; j++) {
-			struct media_link *link = &entity->links[j];
+	return 0;
+}
 
-			if (link->flags & MEDIA_LNK_FL_IMMUTABLE ||
-			    link->source->entity != entity)
-				continue;
+int media_links_stage(struct media_device *media, struct media_pad *source,
+		      struct media_pad *sink, __u32 flags)
+{
+	struct media_link_setup *setup;
+	struct media_link *link;
+	unsigned int *slot;
 
-			ret = media_setup_link(media, link->source, link->sink,
-					       link->flags & ~MEDIA_LNK_FL_ENABLED);
-			if (ret < 0)
-				return ret;
-		}
+	if (!media->setup.active)
+		return -EINVAL;
+
+	link = media_pad_find_link(source, sink);
+	if (link == NULL) {
+		media_dbg(media, "%s: Link not found\n", __func__);
+		return -ENOENT;
+	}
+
+	if (media->setup.slot == NULL) {
+		media->setup.slot = calloc(media->links_count,
+					   sizeof(*media->setup.slot));
+		if (media->setup.slot == NULL)
+			return -ENOMEM;
+	}
+
+	slot = &media->setup.slot[link - media->links];
+	if (*slot) {
+		media->setup.staged[*slot - 1].flags = flags;
+		return 0;
+	}
+
+	if (media->setup.count == media->setup.max) {
+		unsigned int max = media->setup.max ? media->setup.max * 2 : 16;
+
+		setup = realloc(media->setup.staged, max * sizeof(*setup));
+		if (setup == NULL)
+			return -ENOMEM;
+
+		media->setup.staged = setup;
+		media->setup.max = max;
 	}
 
+	setup = &media->setup.staged[media->setup.count++];
+	setup->link = link;
+	setup->flags = flags;
+	*slot = media->setup.count;
+
 	return 0;
 }
 
-/* -----------------------------------------------------------------------------
- * Entities, pads and links enumeration
- */
-
-static struct media_link *media_entity_add_link(struct media_entity *entity)
+void media_links_abort(struct media_device *media)
 {
-	if (entity->num_links >= entity->max_links) {
-		struct media_link *links = entity->links;
-		unsigned int max_links = entity->max_links * 2;
-		unsigned int i;
+	unsigned int i;
 
-		links = realloc(links, max_links * sizeof *links);
-		if (links == NULL)
-			return NULL;
+	if (!media->setup.active)
+		return;
 
-		for (i = 0; i < entity->num_links; ++i)
-			links[i].twin->twin = &links[i];
+	for (i = 0; i < media->setup.count; ++i)
+		media->setup.slot[media->setup.staged[i].link - media->links] = 0;
 
-		entity->max_links = max_links;
-		entity->links = links;
-	}
+	media->setup.active = false;
+	media->setup.count = 0;
+	media_device_close(media);
+}
 
-	return &entity->links[entity->num_links++];
+/*
+ * Restore the links changed by a failed commit to their previous state, in
+ * reverse order so that sink pads are released before being reused.
+ */
+static void media_links_rollback(struct media_device *media,
+				 const unsigned int *applied,
+				 unsigned int count)
+{
+	while (count--) {
+		struct media_link *link = media->setup.staged[applied[count]].link;
+		__u32 flags = link->flags ^ MEDIA_LNK_FL_ENABLED;
+
+		media_dbg(media, "Restoring link %u:%u -> %u:%u [%u]\n",
+			  link->source->entity->info.id, link->source->index,
+			  link->sink->entity->info.id, link->sink->index,
+			  flags & MEDIA_LNK_FL_ENABLED ? 1 : 0);
+
+		if (__media_setup_link(media, link,
+				       flags & ~MEDIA_LNK_FL_IMMUTABLE) < 0)
+			media_dbg(media, "Unable to restore link\n");
+	}
 }
 
-static int media_enum_links(struct media_device *media)
+int media_links_commit(struct media_device *media, media_link_result_t result,
+		       void *priv)
 {
-	__u32 id;
+	unsigned int *order;
+	unsigned int applied = 0;
+	unsigned int pass;
+	unsigned int i;
 	int ret = 0;
 
-	for (id = 1; id <= media->entities_count; id++) {
-		struct media_entity *entity = &media->entities[id - 1];
-		struct media_links_enum links;
-		unsigned int i;
-
-		links.entity = entity->info.id;
-		links.pads = calloc(entity->info.pads, sizeof(struct media_pad_desc));
-		links.links = calloc(entity->info.links, sizeof(struct media_link_desc));
+	if (!media->setup.active)
+		return -EINVAL;
 
-		if (ioctl(media->fd, MEDIA_IOC_ENUM_LINKS, &links) < 0) {
-			ret = -errno;
-			media_dbg(media,
-				  "%s: Unable to enumerate pads and links (%s).\n",
-				  __func__, strerror(errno));
-			free(links.pads);
-			free(links.links);
-			return ret;
-		}
+	/* Record the changed links to restore them if a later change fails. */
+	order = malloc((media->setup.count ? media->setup.count : 1)
+		       * sizeof(*order));
+	if (order == NULL) {
+		media_links_abort(media);
+		return -ENOMEM;
+	}
 
-		for (i = 0; i < entity->info.pads; ++i) {
-			entity->pads[i].entity = entity;
-			entity->pads[i].index = links.pads[i].index;
-			entity->pads[i].flags = links.pads[i].flags;
-		}
+	/* Disable links first to release the sink pads that the enabled links
+	 * will use, then enable links.
+	 */
+	for (pass = 0; pass < 2 && ret == 0; ++pass) {
+		__u32 enabled = pass ? MEDIA_LNK_FL_ENABLED : 0;
 
-		for (i = 0; i < entity->info.links; ++i) {
-			struct media_link_desc *link = &links.links[i];
-			struct media_link *fwdlink;
-			struct media_link *backlink;
-			struct media_entity *source;
-			struct media_entity *sink;
+		for (i = 0; i < media->setup.count; ++i) {
+			struct media_link_setup *setup = &media->setup.staged[i];
+			struct media_link *link = setup->link;
 
-			source = media_get_entity_by_id(media, link->source.entity);
-			sink = media_get_entity_by_id(media, link->sink.entity);
+			if ((setup->flags & MEDIA_LNK_FL_ENABLED) != enabled)
+				continue;
 
-			if (source == NULL || sink == NULL) {
-				media_dbg(media,
-					  "WARNING entity %u link %u from %u/%u to %u/%u is invalid!\n",
-					  id, i, link->source.entity,
-					  link->source.index,
-					  link->sink.entity,
-					  link->sink.index);
-				ret = -EINVAL;
-			} else {
-				fwdlink = media_entity_add_link(source);
-				fwdlink->source = &source->pads[link->source.index];
-				fwdlink->sink = &sink->pads[link->sink.index];
-				fwdlink->flags = link->flags;
-
-				backlink = media_entity_add_link(sink);
-				backlink->source = &source->pads[link->source.index];
-				backlink->sink = &sink->pads[link->sink.index];
-				backlink->flags = link->flags;
-
-				fwdlink->twin = backlink;
-				backlink->twin = fwdlink;
+			if (!((link->flags ^ setup->flags) & MEDIA_LNK_FL_ENABLED)) {
+				if (result)
+					result(priv, link, setup->flags, 1);
+				continue;
 			}
-		}
 
-		free(links.pads);
-		free(links.links);
+			media_dbg(media,
+				  "Setting up link %u:%u -> %u:%u [%u]\n",
+				  link->source->entity->info.id,
+				  link->source->index,
+				  link->sink->entity->info.id,
+				  link->sink->index, setup->flags);
+
+			/* The device is opened on the first link change and
+			 * stays open until the end of the transaction.
+			 */
+			ret = media_device_open(media);
+			if (ret == 0)
+				ret = __media_setup_link(media, link,
+							 setup->flags);
+			if (result)
+				result(priv, link, setup->flags, ret);
+			if (ret < 0)
+				break;
+
+			order[applied++] = i;
+		}
 	}
 
+	media_dbg(media, "%u of %u staged links changed\n", applied,
+		  media->setup.count);
+
+	if (ret < 0)
+		media_links_rollback(media, order, applied);
+
+	free(order);
+	media_links_abort(media);
 	return ret;
 }
 
-#ifdef HAVE_LIBUDEV
+int media_links_stage_disable_all(struct media_device *media)
+{
+	unsigned int i, j;
+	int ret;
 
-#include <libudev.h>
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->num_links; j++) {
+			struct media_link *link = &entity->links[j];
+
+			if (link->flags & MEDIA_LNK_FL_IMMUTABLE ||
+			    !(link->flags & MEDIA_LNK_FL_ENABLED) ||
+			    link->source->entity != entity)
+				continue;
+
+			ret = media_links_stage(media, link->source, link->sink,
+						link->flags & ~MEDIA_LNK_FL_ENABLED);
+			if (ret < 0)
+				return ret;
+		}
+	}
 
-static inline int media_udev_open(struct udev **udev)
-{
-	*udev = udev_new();
-	if (*udev == NULL)
-		return -ENOMEM;
 	return 0;
 }
 
-static inline void media_udev_close(struct udev *udev)
+int media_reset_links(struct media_device *media)
 {
-	if (udev != NULL)
-		udev_unref(udev);
+	int ret;
+
+	ret = media_links_begin(media);
+	if (ret < 0)
+		return ret;
+
+	ret = media_links_stage_disable_all(media);
+	if (ret < 0) {
+		media_links_abort(media);
+		return ret;
+	}
+
+	return media_links_commit(media, NULL, NULL);
 }
 
-static int media_get_devname_udev(struct udev *udev,
-		struct media_entity *entity)
+int media_reset_links_from(struct media_device *media,
+			   struct media_entity *entity,
+			   enum media_reset_scope scope)
 {
-	struct udev_device *device;
-	dev_t devnum;
-	const char *p;
+	unsigned int *queue;
+	bool *visited;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	unsigned int i;
+	int ret;
+
+	queue = malloc(media->entities_count * sizeof(*queue));
+	visited = calloc(media->entities_count, sizeof(*visited));
+	if (queue == NULL || visited == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = media_links_begin(media);
+	if (ret < 0)
+		goto done;
+
+	/* Walk the enabled links breadth-first, staging the outbound links of
+	 * every visited entity.
+	 */
+	queue[tail++] = entity - media->entities;
+	visited[entity - media->entities] = true;
+
+	while (head < tail) {
+		entity = &media->entities[queue[head++]];
+
+		for (i = 0; i < entity->num_links; ++i) {
+			struct media_link *link = &entity->links[i];
+			struct media_entity *remote;
+			bool outbound;
+
+			if (!(link->flags & MEDIA_LNK_FL_ENABLED))
+				continue;
+
+			outbound = link->source->entity == entity;
+			if (!outbound && scope == MEDIA_RESET_DOWNSTREAM)
+				continue;
+
+			if (outbound && !(link->flags & MEDIA_LNK_FL_IMMUTABLE)) {
+				ret = media_links_stage(media, link->source,
+							link->sink,
+							link->flags & ~MEDIA_LNK_FL_ENABLED);
+				if (ret < 0) {
+					media_links_abort(media);
+					goto done;
+				}
+			}
+
+			remote = outbound ? link->sink->entity
+				 : link->source->entity;
+			if (visited[remote - media->entities])
+				continue;
+
+			visited[remote - media->entities] = true;
+			queue[tail++] = remote - media->entities;
+		}
+	}
+
+	ret = media_links_commit(media, NULL, NULL);
+
+done:
+	free(queue);
+	free(visited);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Route finding
+ */
+
+/*
+ * Return true if the link can be part of a route, that is if it is already
+ * enabled, or if it can be enabled after disabling the other links that arrive
+ * at the same sink pad.
+ */
+static bool media_route_link_usable(struct media_link *link)
+{
+	struct media_pad_links *plinks;
+	struct media_link *links;
+	struct media_pad *sink = link->sink;
+	unsigned int i;
+
+	if (link->flags & MEDIA_LNK_FL_ENABLED)
+		return true;
+
+	if (link->flags & MEDIA_LNK_FL_IMMUTABLE)
+		return false;
+
+	plinks = &sink->entity->pad_links[sink - sink->entity->pads];
+	links = &sink->entity->links[plinks->first + plinks->num_out];
+
+	for (i = 0; i < plinks->num_in; ++i) {
+		if ((links[i].flags & MEDIA_LNK_FL_ENABLED) &&
+		    (links[i].flags & MEDIA_LNK_FL_IMMUTABLE))
+			return false;
+	}
+
+	return true;
+}
+
+static int media_route_add_change(struct media_link_setup **changes,
+				  unsigned int *count, unsigned int *max,
+				  struct media_link *link, __u32 flags)
+{
+	struct media_link_setup *change = *changes;
+
+	if (*count == *max) {
+		unsigned int num = *max ? *max * 2 : 16;
+
+		change = realloc(*changes, num * sizeof(*change));
+		if (change == NULL)
+			return -ENOMEM;
+
+		*changes = change;
+		*max = num;
+	}
+
+	change[*count].link = link;
+	change[*count].flags = flags;
+	(*count)++;
+
+	return 0;
+}
+
+/*
+ * Build the list of link changes for the route ending at the sink pad, walking
+ * the route backwards. Conflicting links are disabled before the route links
+ * are enabled.
+ */
+static int media_route_build_plan(struct media_device *media,
+				  struct media_link **prev,
+				  struct media_pad *sink,
+				  struct media_link_setup **changes,
+				  unsigned int *num_changes)
+{
+	struct media_link_setup *enables = NULL;
+	unsigned int num_enables = 0;
+	unsigned int max_enables = 0;
+	unsigned int max_changes = 0;
+	struct media_link *link;
+	unsigned int i;
+	int ret = 0;
+
+	*changes = NULL;
+	*num_changes = 0;
+
+	for (link = prev[sink - media->pads]; link;
+	     link = prev[link->source - media->pads]) {
+		struct media_pad_links *plinks;
+		struct media_link *links;
+
+		if (link->flags & MEDIA_LNK_FL_ENABLED)
+			continue;
+
+		ret = media_route_add_change(&enables, &num_enables,
+					     &max_enables, link,
+					     link->flags | MEDIA_LNK_FL_ENABLED);
+		if (ret < 0)
+			goto done;
+
+		sink = link->sink;
+		plinks = &sink->entity->pad_links[sink - sink->entity->pads];
+		links = &sink->entity->links[plinks->first + plinks->num_out];
+
+		for (i = 0; i < plinks->num_in; ++i) {
+			if (!(links[i].flags & MEDIA_LNK_FL_ENABLED))
+				continue;
+
+			/* Use the outbound copy of the link. */
+			ret = media_route_add_change(changes, num_changes,
+						     &max_changes, links[i].twin,
+						     links[i].flags & ~MEDIA_LNK_FL_ENABLED);
+			if (ret < 0)
+				goto done;
+		}
+	}
+
+	/* Enable links from the route start to its end. */
+	for (i = num_enables; i > 0; --i) {
+		ret = media_route_add_change(changes, num_changes,
+					     &max_changes, enables[i - 1].link,
+					     enables[i - 1].flags);
+		if (ret < 0)
+			goto done;
+	}
+
+done:
+	free(enables);
+	if (ret < 0) {
+		free(*changes);
+		*changes = NULL;
+		*num_changes = 0;
+	}
+	return ret;
+}
+
+/*
+ * Double-ended queue of pad indices, stored in a ring buffer. With 0-1 edge
+ * weights a pad is queued at most twice.
+ */
+struct media_route_queue {
+	unsigned int *items;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+};
+
+static void media_route_push_front(struct media_route_queue *queue,
+				   unsigned int index)
+{
+	queue->head = (queue->head + queue->size - 1) % queue->size;
+	queue->items[queue->head] = index;
+}
+
+static void media_route_push_back(struct media_route_queue *queue,
+				  unsigned int index)
+{
+	queue->items[queue->tail] = index;
+	queue->tail = (queue->tail + 1) % queue->size;
+}
+
+static unsigned int media_route_pop(struct media_route_queue *queue)
+{
+	unsigned int index = queue->items[queue->head];
+
+	queue->head = (queue->head + 1) % queue->size;
+	return index;
+}
+
+int media_find_route(struct media_device *media, struct media_pad *source,
+		     struct media_entity *sink, struct media_link_setup **changes,
+		     unsigned int *num_changes)
+{
+	struct media_route_queue queue;
+	struct media_pad *target = NULL;
+	struct media_link **prev;
+	unsigned int *dist;
+	bool *expanded;
+	unsigned int i;
+	int ret;
+
+	if (!(source->flags & MEDIA_PAD_FL_SOURCE) || media->pads_count == 0)
+		return -EINVAL;
+
+	queue.size = media->pads_count * 2 + 1;
+	queue.head = 0;
+	queue.tail = 0;
+
+	prev = calloc(media->pads_count, sizeof(*prev));
+	dist = malloc(media->pads_count * sizeof(*dist));
+	queue.items = malloc(queue.size * sizeof(*queue.items));
+	expanded = calloc(media->entities_count, sizeof(*expanded));
+	if (prev == NULL || dist == NULL || queue.items == NULL ||
+	    expanded == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	for (i = 0; i < media->pads_count; ++i)
+		dist[i] = -1U;
+
+	/* 0-1 breadth-first search over the pads. Links that are enabled cost
+	 * nothing, links that need to be enabled cost one, and moving from a
+	 * sink pad to a source pad of the same entity is free.
+	 */
+	dist[source - media->pads] = 0;
+	media_route_push_back(&queue, source - media->pads);
+
+	while (queue.head != queue.tail) {
+		unsigned int index = media_route_pop(&queue);
+		struct media_pad *pad = &media->pads[index];
+		struct media_entity *entity = pad->entity;
+		struct media_pad_links *plinks;
+		unsigned int d = dist[index];
+
+		if (pad->flags & MEDIA_PAD_FL_SINK) {
+			if (entity == sink) {
+				target = pad;
+				break;
+			}
+
+			/* The first sink pad of an entity reached by the
+			 * search has the shortest distance, the entity source
+			 * pads only need to be expanded once.
+			 */
+			if (expanded[entity - media->entities])
+				continue;
+
+			expanded[entity - media->entities] = true;
+
+			for (i = 0; i < entity->info.pads; ++i) {
+				unsigned int next = &entity->pads[i] - media->pads;
+
+				if (!(entity->pads[i].flags & MEDIA_PAD_FL_SOURCE) ||
+				    dist[next] <= d)
+					continue;
+
+				dist[next] = d;
+				prev[next] = prev[index];
+				media_route_push_front(&queue, next);
+			}
+
+			continue;
+		}
+
+		plinks = &entity->pad_links[pad - entity->pads];
+
+		for (i = 0; i < plinks->num_out; ++i) {
+			struct media_link *link = &entity->links[plinks->first + i];
+			unsigned int next = link->sink - media->pads;
+			unsigned int cost;
+
+			if (!media_route_link_usable(link))
+				continue;
+
+			cost = link->flags & MEDIA_LNK_FL_ENABLED ? 0 : 1;
+			if (dist[next] <= d + cost)
+				continue;
+
+			dist[next] = d + cost;
+			prev[next] = link;
+			if (cost)
+				media_route_push_back(&queue, next);
+			else
+				media_route_push_front(&queue, next);
+		}
+	}
+
+	if (target == NULL) {
+		media_dbg(media, "%s: No route from \"%s\":%u to \"%s\"\n",
+			  __func__, source->entity->info.name, source->index,
+			  sink->info.name);
+		ret = -ENOENT;
+		goto done;
+	}
+
+	ret = media_route_build_plan(media, prev, target, changes, num_changes);
+
+done:
+	free(prev);
+	free(dist);
+	free(queue.items);
+	free(expanded);
+	return ret;
+}
+
+int media_setup_route(struct media_device *media, struct media_pad *source,
+		      struct media_entity *sink)
+{
+	struct media_link_setup *changes;
+	unsigned int num_changes;
+	unsigned int i;
+	int ret;
+
+	ret = media_find_route(media, source, sink, &changes, &num_changes);
+	if (ret < 0)
+		return ret;
+
+	ret = media_links_begin(media);
+	if (ret < 0)
+		goto done;
+
+	for (i = 0; i < num_changes; ++i) {
+		struct media_link *link = changes[i].link;
+
+		ret = media_links_stage(media, link->source, link->sink,
+					changes[i].flags);
+		if (ret < 0) {
+			media_links_abort(media);
+			goto done;
+		}
+	}
+
+	ret = media_links_commit(media, NULL, NULL);
+
+done:
+	free(changes);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Entities index
+ */
+
+static int media_entity_id_compare(const void *a, const void *b)
+{
+	const struct media_entity_id *ea = a;
+	const struct media_entity_id *eb = b;
+
+	if (ea->id != eb->id)
+		return ea->id < eb->id ? -1 : 1;
+
+	return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
+static void media_device_clear_index(struct media_device *media)
+{
+	free(media->entities_sorted);
+	free(media->entities_by_id);
+	free(media->entities_by_name);
+	media->entities_sorted = NULL;
+	media->entities_by_id = NULL;
+	media->entities_max_id = 0;
+	media->entities_by_name = NULL;
+	media->entities_by_name_mask = 0;
+}
+
+/*
+ * Insert the entity at @index in the name hash table. Entities whose name is
+ * already present are skipped, the first entity with a given name wins.
+ */
+static void media_device_hash_entity(struct media_device *media,
+				     unsigned int index)
+{
+	const char *name = media->entities[index].info.name;
+	unsigned int mask = media->entities_by_name_mask;
+	size_t size = FIELD_SIZEOF(struct media_entity_desc, name);
+	unsigned int i;
+
+	for (i = media_entity_name_hash(name, strnlen(name, size)) & mask;
+	     media->entities_by_name[i]; i = (i + 1) & mask) {
+		const char *other =
+			media->entities[media->entities_by_name[i] - 1].info.name;
+
+		if (strncmp(other, name, size) == 0)
+			return;
+	}
+
+	media->entities_by_name[i] = index + 1;
+}
+
+/*
+ * Build the entity lookup tables. Entities are indexed by a sorted array of
+ * IDs, used for MEDIA_ENT_ID_FLAG_NEXT lookups, and by a direct-indexed table
+ * for exact lookups. As the kernel allocates entity IDs sequentially the table
+ * is usually dense, it is skipped for sparse ID spaces where exact lookups
+ * fall back to a binary search.
+ *
+ * Names are indexed by an open-addressing hash table sized to at least twice
+ * the number of entities.
+ *
+ * When several entities share the same ID or name the first one in the
+ * entities array wins, consistently with a linear search.
+ */
+int media_device_index_entities(struct media_device *media)
+{
+	struct media_entity_id *sorted;
+	unsigned int *by_name;
+	unsigned int *by_id = NULL;
+	unsigned int max_id = 0;
+	unsigned int size;
+	bool ordered = true;
+	unsigned int i;
+
+	media_device_clear_index(media);
+
+	if (media->entities_count == 0)
+		return 0;
+
+	for (size = 16; size < media->entities_count * 2; size *= 2);
+
+	by_name = calloc(size, sizeof(*by_name));
+	if (by_name == NULL)
+		return -ENOMEM;
+
+	media->entities_by_name = by_name;
+	media->entities_by_name_mask = size - 1;
+
+	for (i = 0; i < media->entities_count; ++i)
+		media_device_hash_entity(media, i);
+
+	sorted = malloc(media->entities_count * sizeof(*sorted));
+	if (sorted == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		sorted[i].id = media->entities[i].info.id;
+		sorted[i].index = i;
+
+		if (i && sorted[i].id < sorted[i - 1].id)
+			ordered = false;
+		if (sorted[i].id > max_id)
+			max_id = sorted[i].id;
+	}
+
+	/* Entities enumerated from the kernel are already sorted. */
+	if (!ordered)
+		qsort(sorted, media->entities_count, sizeof(*sorted),
+		      media_entity_id_compare);
+
+	if (max_id < media->entities_count * 4 + 64) {
+		by_id = calloc(max_id + 1, sizeof(*by_id));
+		if (by_id == NULL) {
+			free(sorted);
+			return -ENOMEM;
+		}
+
+		for (i = media->entities_count; i > 0; --i)
+			by_id[sorted[i - 1].id] = sorted[i - 1].index + 1;
+	}
+
+	media->entities_sorted = sorted;
+	media->entities_by_id = by_id;
+	media->entities_max_id = max_id;
+
+	return 0;
+}
+
+/*
+ * Add the last entity of the entities array to the lookup tables. The tables
+ * are rebuilt from scratch if they don't exist or if the entity ID doesn't fit
+ * in the direct-indexed table.
+ */
+static int media_device_index_entity(struct media_device *media)
+{
+	unsigned int index = media->entities_count - 1;
+	__u32 id = media->entities[index].info.id;
+	struct media_entity_id *sorted;
+	unsigned int pos;
+
+	if (media->entities_sorted == NULL ||
+	    (media->entities_by_id && id > media->entities_max_id) ||
+	    media->entities_count * 2 > media->entities_by_name_mask + 1)
+		return media_device_index_entities(media);
+
+	sorted = realloc(media->entities_sorted,
+			 media->entities_count * sizeof(*sorted));
+	if (sorted == NULL)
+		return -ENOMEM;
+
+	media->entities_sorted = sorted;
+
+	/* Insert the new entity after all entities with the same ID. */
+	media->entities_count--;
+	pos = media_entity_id_lower_bound(media, id + 1);
+	media->entities_count++;
+
+	memmove(&sorted[pos + 1], &sorted[pos], (index - pos) * sizeof(*sorted));
+	sorted[pos].id = id;
+	sorted[pos].index = index;
+
+	if (media->entities_by_id && media->entities_by_id[id] == 0)
+		media->entities_by_id[id] = index + 1;
+
+	media_device_hash_entity(media, index);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Entities, pads and links enumeration
+ */
+
+/*
+ * The graph is stored in a single allocation, made of the entities array
+ * followed by the pads, links and pad links arrays. The entity, pad and link
+ * structures contain pointers and have a size that is a multiple of the
+ * pointer alignment, the following arrays are thus naturally aligned.
+ *
+ * Entities are zero-initialized. The caller must fill the entity information
+ * and the number of links (max_links) for every entity, and then call
+ * media_device_init_graph() to distribute the pads and links arrays.
+ */
+int media_device_alloc_graph(struct media_device *media,
+			     unsigned int num_entities, unsigned int num_pads,
+			     unsigned int num_links)
+{
+	struct media_entity *entities;
+	size_t size;
+	unsigned int i;
+
+	size = num_entities * sizeof(*media->entities)
+	     + num_pads * sizeof(*media->pads)
+	     + num_links * sizeof(*media->links)
+	     + num_pads * sizeof(struct media_pad_links);
+
+	media->graph = calloc(1, size ? size : 1);
+	if (media->graph == NULL)
+		return -ENOMEM;
+
+	entities = media->graph;
+	media->entities = entities;
+	media->entities_count = num_entities;
+	media->pads = (struct media_pad *)(entities + num_entities);
+	media->pads_count = num_pads;
+	media->links = (struct media_link *)(media->pads + num_pads);
+	media->links_count = num_links;
+	media->pad_links = (struct media_pad_links *)(media->links + num_links);
+
+	for (i = 0; i < num_entities; ++i) {
+		entities[i].media = media;
+		entities[i].fd = -1;
+	}
+
+	return 0;
+}
+
+void media_device_init_graph(struct media_device *media)
+{
+	struct media_pad *pads = media->pads;
+	struct media_link *links = media->links;
+	struct media_pad_links *pad_links = media->pad_links;
+	unsigned int i, j;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		entity->pads = pads;
+		entity->pad_links = pad_links;
+		entity->links = links;
+		entity->num_links = 0;
+		pads += entity->info.pads;
+		pad_links += entity->info.pads;
+		links += entity->max_links;
+
+		for (j = 0; j < entity->info.pads; ++j) {
+			entity->pads[j].entity = entity;
+			entity->pads[j].index = j;
+		}
+
+		if (!(entity->info.flags & MEDIA_ENT_FL_DEFAULT))
+			continue;
+
+		switch (entity->info.type) {
+		case MEDIA_ENT_T_DEVNODE_V4L:
+			media->def.v4l = entity;
+			break;
+		case MEDIA_ENT_T_DEVNODE_FB:
+			media->def.fb = entity;
+			break;
+		case MEDIA_ENT_T_DEVNODE_ALSA:
+			media->def.alsa = entity;
+			break;
+		case MEDIA_ENT_T_DEVNODE_DVB:
+			media->def.dvb = entity;
+			break;
+		}
+	}
+}
+
+static struct media_link *media_entity_add_link(struct media_entity *entity)
+{
+	if (entity->num_links >= entity->max_links)
+		return NULL;
+
+	return &entity->links[entity->num_links++];
+}
+
+int media_device_add_link(struct media_pad *source, struct media_pad *sink,
+			  __u32 flags)
+{
+	struct media_link *fwdlink;
+	struct media_link *backlink;
+
+	fwdlink = media_entity_add_link(source->entity);
+	if (fwdlink == NULL)
+		return -ENOMEM;
+
+	backlink = media_entity_add_link(sink->entity);
+	if (backlink == NULL) {
+		source->entity->num_links--;
+		return -ENOMEM;
+	}
+
+	fwdlink->source = source;
+	fwdlink->sink = sink;
+	fwdlink->flags = flags;
+
+	backlink->source = source;
+	backlink->sink = sink;
+	backlink->flags = flags;
+
+	fwdlink->twin = backlink;
+	backlink->twin = fwdlink;
+
+	return 0;
+}
+
+/*
+ * A link is stored in the links arrays of both its source and sink entities.
+ * The copy stored in the source entity is the outbound link. For links that
+ * loop back to the same entity, media_device_add_link() stores the outbound
+ * copy first.
+ */
+static bool media_link_is_outbound(struct media_entity *entity,
+				   struct media_link *link)
+{
+	if (link->source->entity != entity)
+		return false;
+
+	return link->sink->entity != entity || link < link->twin;
+}
+
+/*
+ * Sort the links of every entity by pad, with the links originating from a pad
+ * first followed by the links arriving at the pad, and fill the pad links
+ * ranges. The sort is stable, links of a pad keep their enumeration order.
+ */
+int media_device_sort_links(struct media_device *media)
+{
+	struct media_link *sorted;
+	unsigned int *position;
+	unsigned int *cursor;
+	unsigned int i, j;
+
+	if (media->links_count == 0)
+		return 0;
+
+	sorted = malloc(media->links_count * sizeof(*sorted));
+	position = malloc(media->links_count * sizeof(*position));
+	cursor = malloc((media->pads_count * 2 + 1) * sizeof(*cursor));
+	if (sorted == NULL || position == NULL || cursor == NULL) {
+		free(sorted);
+		free(position);
+		free(cursor);
+		return -ENOMEM;
+	}
+
+	/* Compute the position of every link in the sorted array. */
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+		unsigned int base = entity->links - media->links;
+		unsigned int first = 0;
+
+		for (j = 0; j < entity->info.pads; ++j) {
+			entity->pad_links[j].num_out = 0;
+			entity->pad_links[j].num_in = 0;
+		}
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+
+			if (media_link_is_outbound(entity, link))
+				entity->pad_links[link->source - entity->pads].num_out++;
+			else
+				entity->pad_links[link->sink - entity->pads].num_in++;
+		}
+
+		for (j = 0; j < entity->info.pads; ++j) {
+			struct media_pad_links *plinks = &entity->pad_links[j];
+
+			plinks->first = first;
+			cursor[j * 2] = base + first;
+			cursor[j * 2 + 1] = base + first + plinks->num_out;
+			first += plinks->num_out + plinks->num_in;
+		}
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+
+			if (media_link_is_outbound(entity, link))
+				position[base + j] =
+					cursor[(link->source - entity->pads) * 2]++;
+			else
+				position[base + j] =
+					cursor[(link->sink - entity->pads) * 2 + 1]++;
+		}
+	}
+
+	/* Move the links and update the twin pointers. */
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+		unsigned int base = entity->links - media->links;
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+			struct media_link *dest = &sorted[position[base + j]];
+
+			*dest = *link;
+			dest->twin = &media->links[position[link->twin - media->links]];
+		}
+	}
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+		unsigned int base = entity->links - media->links;
+
+		memcpy(entity->links, &sorted[base],
+		       entity->num_links * sizeof(*entity->links));
+	}
+
+	free(sorted);
+	free(position);
+	free(cursor);
+	return 0;
+}
+
+/*
+ * Entities and links are first enumerated into temporary arrays of kernel
+ * descriptors, which are then used to size the graph allocation. Entities are
+ * enumerated one at a time along with their pads and links, which lets
+ * media_device_enumerate_stream() report them before the graph is built.
+ */
+struct media_enum {
+	struct media_entity_desc *entities;
+	unsigned int num_entities;
+	unsigned int max_entities;
+	struct media_pad_desc *pads;
+	unsigned int num_pads;
+	unsigned int max_pads;
+	struct media_link_desc *links;
+	unsigned int num_links;
+	unsigned int max_links;
+};
+
+static void media_enum_cleanup(struct media_enum *e)
+{
+	free(e->entities);
+	free(e->pads);
+	free(e->links);
+}
+
+static int media_enum_grow(void **array, unsigned int *max, unsigned int count,
+			   size_t size)
+{
+	unsigned int num = *max ? *max : 16;
+	void *tmp;
+
+	if (count <= *max)
+		return 0;
+
+	while (num < count)
+		num *= 2;
+
+	tmp = realloc(*array, num * size);
+	if (tmp == NULL)
+		return -ENOMEM;
+
+	*array = tmp;
+	*max = num;
+	return 0;
+}
+
+/*
+ * Enumerate the entity following the last enumerated one, with its pads and
+ * links. Return 1 when an entity has been added, 0 when all entities have been
+ * enumerated or a negative error code otherwise.
+ */
+static int media_enum_entity(struct media_device *media, struct media_enum *e)
+{
+	struct media_entity_desc desc;
+	struct media_links_enum ulinks;
+	int ret;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.id = e->num_entities ? e->entities[e->num_entities - 1].id : 0;
+	desc.id |= MEDIA_ENT_ID_FLAG_NEXT;
+
+	ret = ioctl(media->fd, MEDIA_IOC_ENUM_ENTITIES, &desc);
+	if (ret < 0)
+		return errno != EINVAL ? -errno : 0;
+
+	if (media_enum_grow((void **)&e->entities, &e->max_entities,
+			    e->num_entities + 1, sizeof(*e->entities)) < 0 ||
+	    media_enum_grow((void **)&e->pads, &e->max_pads,
+			    e->num_pads + desc.pads, sizeof(*e->pads)) < 0 ||
+	    media_enum_grow((void **)&e->links, &e->max_links,
+			    e->num_links + desc.links, sizeof(*e->links)) < 0)
+		return -ENOMEM;
+
+	memset(&ulinks, 0, sizeof(ulinks));
+	ulinks.entity = desc.id;
+	ulinks.pads = desc.pads ? &e->pads[e->num_pads] : NULL;
+	ulinks.links = desc.links ? &e->links[e->num_links] : NULL;
+
+	if (ioctl(media->fd, MEDIA_IOC_ENUM_LINKS, &ulinks) < 0) {
+		ret = -errno;
+		media_dbg(media,
+			  "%s: Unable to enumerate pads and links (%s).\n",
+			  __func__, strerror(errno));
+		return ret;
+	}
+
+	e->entities[e->num_entities++] = desc;
+	e->num_pads += desc.pads;
+	e->num_links += desc.links;
+	return 1;
+}
+
+static int media_build_graph(struct media_device *media, struct media_enum *e)
+{
+	struct media_pad_desc *pads = e->pads;
+	struct media_link_desc *link;
+	unsigned int i, j;
+	int ret = 0;
+
+	/* Each link is stored twice, in its source and sink entities. */
+	ret = media_device_alloc_graph(media, e->num_entities, e->num_pads,
+				       e->num_links * 2);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < e->num_entities; ++i)
+		media->entities[i].info = e->entities[i];
+
+	ret = media_device_index_entities(media);
+	if (ret < 0)
+		return ret;
+
+	/* Count the inbound and outbound links of every entity. */
+	for (i = 0, link = e->links; i < e->num_entities; ++i) {
+		for (j = 0; j < e->entities[i].links; ++j, ++link) {
+			struct media_entity *source;
+			struct media_entity *sink;
+
+			source = media_get_entity_by_id(media, link->source.entity);
+			sink = media_get_entity_by_id(media, link->sink.entity);
+
+			if (source == NULL || sink == NULL ||
+			    link->source.index >= source->info.pads ||
+			    link->sink.index >= sink->info.pads) {
+				media_dbg(media,
+					  "WARNING entity %u link %u from %u/%u to %u/%u is invalid!\n",
+					  e->entities[i].id, j,
+					  link->source.entity,
+					  link->source.index,
+					  link->sink.entity,
+					  link->sink.index);
+				/* Mark the link as invalid. */
+				link->source.entity = 0;
+				ret = -EINVAL;
+				continue;
+			}
+
+			source->max_links++;
+			sink->max_links++;
+		}
+	}
+
+	media_device_init_graph(media);
+
+	for (i = 0; i < e->num_entities; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->info.pads; ++j, ++pads) {
+			entity->pads[j].index = pads->index;
+			entity->pads[j].flags = pads->flags;
+		}
+	}
+
+	for (i = 0, link = e->links; i < e->num_links; ++i, ++link) {
+		struct media_entity *source;
+		struct media_entity *sink;
+
+		if (link->source.entity == 0)
+			continue;
+
+		source = media_get_entity_by_id(media, link->source.entity);
+		sink = media_get_entity_by_id(media, link->sink.entity);
+
+		media_device_add_link(&source->pads[link->source.index],
+				      &sink->pads[link->sink.index], link->flags);
+	}
+
+	if (media_device_sort_links(media) < 0)
+		return -ENOMEM;
+
+	return ret;
+}
+
+#ifdef HAVE_LIBUDEV
+
+#include <libudev.h>
+
+/*
+ * libudev entry points. When built with dlopen support libudev is only loaded
+ * the first time a udev context is needed, tools that never resolve device
+ * names don't pay for loading it.
+ */
+struct media_udev_lib {
+	struct udev *(*new)(void);
+	struct udev *(*ref)(struct udev *udev);
+	struct udev *(*unref)(struct udev *udev);
+	struct udev_device *(*device_new_from_devnum)(struct udev *udev,
+						      char type, dev_t devnum);
+	const char *(*device_get_devnode)(struct udev_device *device);
+	struct udev_device *(*device_unref)(struct udev_device *device);
+};
+
+#ifdef HAVE_LIBUDEV_DLOPEN
+
+#include <dlfcn.h>
+
+static struct media_udev_lib udev_lib;
+
+/* Must be called with media_udev_lock held. */
+static int media_udev_load(void)
+{
+	static const char * const symbols[] = {
+		"udev_new",
+		"udev_ref",
+		"udev_unref",
+		"udev_device_new_from_devnum",
+		"udev_device_get_devnode",
+		"udev_device_unref",
+	};
+	static void *handle;
+	void **entry = (void **)&udev_lib;
+	unsigned int i;
+
+	if (handle)
+		return 0;
+
+	handle = dlopen("libudev.so.1", RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL)
+		return -ENOTSUP;
+
+	for (i = 0; i < ARRAY_SIZE(symbols); ++i) {
+		entry[i] = dlsym(handle, symbols[i]);
+		if (entry[i] == NULL) {
+			dlclose(handle);
+			handle = NULL;
+			return -ENOTSUP;
+		}
+	}
+
+	return 0;
+}
+
+#else	/* HAVE_LIBUDEV_DLOPEN */
+
+static const struct media_udev_lib udev_lib = {
+	.new = udev_new,
+	.ref = udev_ref,
+	.unref = udev_unref,
+	.device_new_from_devnum = udev_device_new_from_devnum,
+	.device_get_devnode = udev_device_get_devnode,
+	.device_unref = udev_device_unref,
+};
+
+static inline int media_udev_load(void) { return 0; }
+
+#endif	/* HAVE_LIBUDEV_DLOPEN */
+
+/*
+ * libudev objects can't be used concurrently from multiple threads. All udev
+ * accesses, for the global context and for contexts supplied by the
+ * application, are serialized by media_udev_lock.
+ */
+static pthread_mutex_t media_udev_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct udev *media_udev_global;
+static bool media_udev_failed;
+
+static void __attribute__((destructor)) media_udev_cleanup(void)
+{
+	if (media_udev_global)
+		udev_lib.unref(media_udev_global);
+}
+
+int media_device_set_udev(struct media_device *media, struct udev *udev)
+{
+	int ret;
+
+	pthread_mutex_lock(&media_udev_lock);
+
+	ret = media_udev_load();
+	if (ret == 0) {
+		if (media->udev)
+			udev_lib.unref(media->udev);
+		media->udev = udev ? udev_lib.ref(udev) : NULL;
+	}
+
+	pthread_mutex_unlock(&media_udev_lock);
+	return ret;
+}
+
+static void media_udev_release(struct media_device *media)
+{
+	if (media->udev == NULL)
+		return;
+
+	pthread_mutex_lock(&media_udev_lock);
+	udev_lib.unref(media->udev);
+	pthread_mutex_unlock(&media_udev_lock);
+}
+
+/*
+ * Return the udev context of the media device, or the global context created
+ * on first use. Must be called with media_udev_lock held.
+ */
+static struct udev *media_udev_get(struct media_device *media)
+{
+	if (media->udev)
+		return media->udev;
+
+	if (media_udev_global || media_udev_failed)
+		return media_udev_global;
+
+	if (media_udev_load() == 0)
+		media_udev_global = udev_lib.new();
+
+	if (media_udev_global == NULL) {
+		media_dbg(media, "Can't get udev context\n");
+		media_udev_failed = true;
+	}
+
+	return media_udev_global;
+}
+
+static int media_get_devname_udev(struct media_entity *entity)
+{
+	struct udev_device *device;
+	struct udev *udev;
+	dev_t devnum;
+	const char *p;
 	int ret = -ENODEV;
 
-	if (udev == NULL)
-		return -EINVAL;
+	pthread_mutex_lock(&media_udev_lock);
+
+	udev = media_udev_get(entity->media);
+	if (udev == NULL) {
+		ret = -EINVAL;
+		goto done;
+	}
 
 	devnum = makedev(entity->info.v4l.major, entity->info.v4l.minor);
 	media_dbg(entity->media, "looking up device: %u:%u\n",
 		  major(devnum), minor(devnum));
-	device = udev_device_new_from_devnum(udev, 'c', devnum);
+	device = udev_lib.device_new_from_devnum(udev, 'c', devnum);
 	if (device) {
-		p = udev_device_get_devnode(device);
+		p = udev_lib.device_get_devnode(device);
 		if (p) {
 			strncpy(entity->devname, p, sizeof(entity->devname));
 			entity->devname[sizeof(entity->devname) - 1] = '\0';
@@ -436,142 +1841,511 @@ static int media_get_devname_udev(struct udev *udev,
 		ret = 0;
 	}
 
-	udev_device_unref(device);
+	udev_lib.device_unref(device);
+
+done:
+	pthread_mutex_unlock(&media_udev_lock);
+	return ret;
+}
+
+#else	/* HAVE_LIBUDEV */
+
+int media_device_set_udev(struct media_device *media __attribute__((unused)),
+			  struct udev *udev __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
+static inline void
+media_udev_release(struct media_device *media __attribute__((unused))) { }
+
+static inline int
+media_get_devname_udev(struct media_entity *entity __attribute__((unused)))
+{
+	return -ENOTSUP;
+}
+
+#endif	/* HAVE_LIBUDEV */
+
+static int media_get_devname_sysfs(struct media_entity *entity)
+{
+	struct stat devstat;
+	char devname[32];
+	char sysname[32];
+	char target[1024];
+	char *p;
+	int ret;
+
+	sprintf(sysname, "/sys/dev/char/%u:%u", entity->info.v4l.major,
+		entity->info.v4l.minor);
+	ret = readlink(sysname, target, sizeof(target));
+	if (ret < 0)
+		return -errno;
+
+	target[ret] = '\0';
+	p = strrchr(target, '/');
+	if (p == NULL)
+		return -EINVAL;
+
+	sprintf(devname, "/dev/%s", p + 1);
+	ret = stat(devname, &devstat);
+	if (ret < 0)
+		return -errno;
+
+	/* Sanity check: udev might have reordered the device nodes.
+	 * Make sure the major/minor match. We should really use
+	 * libudev.
+	 */
+	if (major(devstat.st_rdev) == entity->info.v4l.major &&
+	    minor(devstat.st_rdev) == entity->info.v4l.minor)
+		strcpy(entity->devname, devname);
+
+	return 0;
+}
+
+#ifndef HAVE_LIBUDEV
+
+/*
+ * Device nodes table, built from a single scan of /dev when udev isn't
+ * available. Resolving an entity through sysfs costs a readlink() and a stat()
+ * with full path walks, while the scan reads the directory once and stats the
+ * character devices relative to it.
+ */
+struct media_devnode {
+	dev_t devnum;
+	/* Room for the name in the entity devname with a /dev/ prefix. */
+	char name[27];
+	bool kernel_name;
+};
+
+#define MEDIA_DEVNAME_SCAN_MIN		8
+
+/* Prefixes of the device nodes that entities found in /dev can refer to. */
+static const char * const media_devnode_prefixes[] = {
+	"fb",
+	"radio",
+	"swradio",
+	"v4l-subdev",
+	"v4l-touch",
+	"vbi",
+	"video",
+};
+
+/*
+ * Return 0 if the name isn't a candidate device node, 1 if it is, and 2 if it
+ * also follows the kernel naming scheme of a prefix followed by a number.
+ */
+static int media_devnode_match(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(media_devnode_prefixes); ++i) {
+		size_t len = strlen(media_devnode_prefixes[i]);
+		const char *p = name + len;
+
+		if (strncmp(name, media_devnode_prefixes[i], len))
+			continue;
+
+		if (*p == '\0')
+			return 1;
+
+		while (isdigit((unsigned char)*p))
+			p++;
+
+		return *p == '\0' ? 2 : 1;
+	}
+
+	return 0;
+}
+
+static int media_devnode_cmp(const void *a, const void *b)
+{
+	const struct media_devnode *na = a;
+	const struct media_devnode *nb = b;
+
+	if (na->devnum != nb->devnum)
+		return na->devnum < nb->devnum ? -1 : 1;
+
+	if (na->kernel_name != nb->kernel_name)
+		return na->kernel_name ? -1 : 1;
+
+	return strcmp(na->name, nb->name);
+}
+
+/*
+ * Scan /dev for the character devices whose name matches one of
+ * media_devnode_prefixes. The directory is read first, and the scan is aborted
+ * with -E2BIG if stating the candidates would take more than max_stats calls.
+ */
+static int media_scan_devnodes(unsigned int max_stats,
+			       struct media_devnode **pnodes,
+			       unsigned int *pcount)
+{
+	struct media_devnode *nodes = NULL;
+	unsigned int count = 0;
+	unsigned int max = 0;
+	unsigned int i, j;
+	struct dirent *ent;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir("/dev");
+	if (dir == NULL)
+		return -errno;
+
+	while ((ent = readdir(dir)) != NULL) {
+		int match;
+
+		if (ent->d_type != DT_CHR && ent->d_type != DT_UNKNOWN)
+			continue;
+
+		if (strlen(ent->d_name) >= sizeof(nodes->name))
+			continue;
+
+		match = media_devnode_match(ent->d_name);
+		if (!match)
+			continue;
+
+		if (count == max_stats) {
+			ret = -E2BIG;
+			goto done;
+		}
+
+		if (count == max) {
+			struct media_devnode *tmp;
+
+			max = max ? max * 2 : 64;
+			tmp = realloc(nodes, max * sizeof(*nodes));
+			if (tmp == NULL) {
+				ret = -ENOMEM;
+				goto done;
+			}
+
+			nodes = tmp;
+		}
+
+		strcpy(nodes[count].name, ent->d_name);
+		nodes[count].kernel_name = match == 2;
+		count++;
+	}
+
+	for (i = 0, j = 0; i < count; ++i) {
+		struct stat devstat;
+
+		if (fstatat(dirfd(dir), nodes[i].name, &devstat,
+			    AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISCHR(devstat.st_mode))
+			continue;
+
+		nodes[j] = nodes[i];
+		nodes[j].devnum = devstat.st_rdev;
+		j++;
+	}
+
+	count = j;
+
+	/*
+	 * Sort by device number, and pick the kernel name first among aliases,
+	 * as the sysfs lookup does. Other aliases are sorted by name.
+	 */
+	qsort(nodes, count, sizeof(*nodes), media_devnode_cmp);
+
+done:
+	closedir(dir);
+
+	if (ret < 0) {
+		free(nodes);
+		return ret;
+	}
+
+	*pnodes = nodes;
+	*pcount = count;
+	return 0;
+}
+
+static const struct media_devnode *
+media_find_devnode(const struct media_devnode *nodes, unsigned int count,
+		   dev_t devnum)
+{
+	unsigned int lower = 0;
+	unsigned int upper = count;
+
+	/* Find the first node with the device number. */
+	while (lower < upper) {
+		unsigned int middle = (lower + upper) / 2;
+
+		if (nodes[middle].devnum < devnum)
+			lower = middle + 1;
+		else
+			upper = middle;
+	}
+
+	return lower < count && nodes[lower].devnum == devnum
+	     ? &nodes[lower] : NULL;
+}
+
+/*
+ * Resolve the device names of the entities from a scan of /dev. The major and
+ * minor numbers match by construction. Entities without a matching device node
+ * in /dev, for instance when renamed by a udev rule, are resolved through
+ * sysfs.
+ */
+static int media_resolve_devnames_scan(struct media_device *media,
+				       struct media_entity **entities,
+				       unsigned int num_entities)
+{
+	struct media_devnode *nodes = NULL;
+	unsigned int count = 0;
+	unsigned int i;
+	int ret;
+
+	/* Don't scan if the sysfs lookups would be cheaper. */
+	ret = media_scan_devnodes(num_entities * 2, &nodes, &count);
+	if (ret < 0) {
+		media_dbg(media, "Not resolving device names from /dev (%s)\n",
+			  strerror(-ret));
+		return ret;
+	}
+
+	media_dbg(media, "Found %u character devices in /dev\n", count);
+
+	for (i = 0; i < num_entities; ++i) {
+		struct media_entity *entity = entities[i];
+		const struct media_devnode *node;
+
+		node = media_find_devnode(nodes, count,
+					  makedev(entity->info.v4l.major,
+						  entity->info.v4l.minor));
+		if (node)
+			sprintf(entity->devname, "/dev/%s", node->name);
+		else
+			media_get_devname_sysfs(entity);
+
+		entity->devname_pending = false;
+	}
+
+	free(nodes);
+	return 0;
+}
+
+#endif	/* HAVE_LIBUDEV */
+
+#define MEDIA_DEVNAME_WORKERS		4
+#define MEDIA_DEVNAME_PER_WORKER	8
+
+struct media_devname_worker {
+	pthread_t thread;
+	bool started;
+	struct media_device *media;
+	struct media_entity **entities;
+	unsigned int first;
+	unsigned int count;
+	unsigned int stride;
+};
+
+static void *media_devname_worker(void *arg)
+{
+	struct media_devname_worker *worker = arg;
+	unsigned int i;
+
+	for (i = worker->first; i < worker->count; i += worker->stride) {
+		struct media_entity *entity = worker->entities[i];
+
+		entity->devname_pending = false;
+
+		/* Try to get the device name via udev */
+		if (!media_get_devname_udev(entity))
+			continue;
+
+		/* Fall back to get the device name via sysfs */
+		media_get_devname_sysfs(entity);
+	}
 
-	return ret;
+	return NULL;
 }
 
-#else	/* HAVE_LIBUDEV */
+/*
+ * Resolve the device names of the entities. The sysfs lookups are spread over a
+ * small pool of worker threads, each entity being resolved by a single worker.
+ * udev lookups are serialized by media_udev_lock and are performed from the
+ * calling thread.
+ */
+static void media_resolve_devnames(struct media_device *media,
+				   struct media_entity **entities,
+				   unsigned int num_entities)
+{
+	struct media_devname_worker workers[MEDIA_DEVNAME_WORKERS];
+	unsigned int num_workers;
+	unsigned int i;
 
-struct udev;
+#ifdef HAVE_LIBUDEV
+	/* Workers would only contend for media_udev_lock. */
+	num_workers = num_entities ? 1 : 0;
+#else
+	/* Without udev, scan /dev once when resolving many entities. */
+	if (num_entities >= MEDIA_DEVNAME_SCAN_MIN &&
+	    media_resolve_devnames_scan(media, entities, num_entities) == 0)
+		return;
 
-static inline int media_udev_open(struct udev **udev) { return 0; }
+	/* Threads are only worth it for large graphs. */
+	num_workers = (num_entities + MEDIA_DEVNAME_PER_WORKER - 1)
+		    / MEDIA_DEVNAME_PER_WORKER;
+	if (num_workers > MEDIA_DEVNAME_WORKERS)
+		num_workers = MEDIA_DEVNAME_WORKERS;
+#endif
+
+	for (i = 0; i < num_workers; ++i) {
+		workers[i].media = media;
+		workers[i].entities = entities;
+		workers[i].first = i;
+		workers[i].count = num_entities;
+		workers[i].stride = num_workers;
+		workers[i].started = num_workers > 1 &&
+				     !pthread_create(&workers[i].thread, NULL,
+						     media_devname_worker,
+						     &workers[i]);
+	}
 
-static inline void media_udev_close(struct udev *udev) { }
+	/* Resolve the names from the calling thread if a worker failed to
+	 * start.
+	 */
+	for (i = 0; i < num_workers; ++i) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		else
+			media_devname_worker(&workers[i]);
+	}
+}
 
-static inline int media_get_devname_udev(struct udev *udev,
-		struct media_entity *entity)
+int media_device_prefetch_devnames(struct media_device *media,
+				   struct media_entity **entities,
+				   unsigned int count)
 {
-	return -ENOTSUP;
-}
+	struct media_entity **pending;
+	unsigned int num_pending = 0;
+	unsigned int i;
 
-#endif	/* HAVE_LIBUDEV */
+	if (entities == NULL)
+		count = media->entities_count;
 
-static int media_get_devname_sysfs(struct media_entity *entity)
-{
-	struct stat devstat;
-	char devname[32];
-	char sysname[32];
-	char target[1024];
-	char *p;
-	int ret;
+	for (i = 0; i < count; ++i) {
+		struct media_entity *entity = entities ? entities[i]
+					    : &media->entities[i];
 
-	sprintf(sysname, "/sys/dev/char/%u:%u", entity->info.v4l.major,
-		entity->info.v4l.minor);
-	ret = readlink(sysname, target, sizeof(target));
-	if (ret < 0)
-		return -errno;
+		if (entity->devname_pending)
+			num_pending++;
+	}
 
-	target[ret] = '\0';
-	p = strrchr(target, '/');
-	if (p == NULL)
-		return -EINVAL;
+	if (num_pending == 0)
+		return 0;
 
-	sprintf(devname, "/dev/%s", p + 1);
-	ret = stat(devname, &devstat);
-	if (ret < 0)
-		return -errno;
+	pending = calloc(num_pending, sizeof(*pending));
+	if (pending == NULL)
+		return -ENOMEM;
 
-	/* Sanity check: udev might have reordered the device nodes.
-	 * Make sure the major/minor match. We should really use
-	 * libudev.
-	 */
-	if (major(devstat.st_rdev) == entity->info.v4l.major &&
-	    minor(devstat.st_rdev) == entity->info.v4l.minor)
-		strcpy(entity->devname, devname);
+	for (i = 0, num_pending = 0; i < count; ++i) {
+		struct media_entity *entity = entities ? entities[i]
+					    : &media->entities[i];
+
+		if (entity->devname_pending)
+			pending[num_pending++] = entity;
+	}
+
+	media_resolve_devnames(media, pending, num_pending);
 
+	free(pending);
 	return 0;
 }
 
-static int media_enum_entities(struct media_device *media)
+void media_device_set_lazy_devnames(struct media_device *media, int enable)
 {
-	struct media_entity *entity;
-	struct udev *udev;
-	unsigned int size;
-	__u32 id;
-	int ret;
+	media->lazy_devnames = enable;
+}
 
-	ret = media_udev_open(&udev);
-	if (ret < 0)
-		media_dbg(media, "Can't get udev context\n");
+/*
+ * Mark the device names of all devnode and subdev entities for resolution, and
+ * resolve them unless lazy resolution is enabled. The topology cache stores
+ * device names, they're always resolved when the cache is written.
+ */
+static void media_enum_devnames(struct media_device *media)
+{
+	unsigned int i;
 
-	for (id = 0, ret = 0; ; id = entity->info.id) {
-		size = (media->entities_count + 1) * sizeof(*media->entities);
-		media->entities = realloc(media->entities, size);
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
 
-		entity = &media->entities[media->entities_count];
-		memset(entity, 0, sizeof(*entity));
-		entity->fd = -1;
-		entity->info.id = id | MEDIA_ENT_ID_FLAG_NEXT;
-		entity->media = media;
+		/* Find the corresponding device name. */
+		if (media_entity_type(entity) != MEDIA_ENT_T_DEVNODE &&
+		    media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+			continue;
 
-		ret = ioctl(media->fd, MEDIA_IOC_ENUM_ENTITIES, &entity->info);
-		if (ret < 0) {
-			ret = errno != EINVAL ? -errno : 0;
-			break;
-		}
+		entity->devname_pending = true;
+	}
 
-		/* Number of links (for outbound links) plus number of pads (for
-		 * inbound links) is a good safe initial estimate of the total
-		 * number of links.
-		 */
-		entity->max_links = entity->info.pads + entity->info.links;
+	if (media->lazy_devnames && !media->cache_dir) {
+		media_dbg(media, "Deferring device name resolution\n");
+		return;
+	}
 
-		entity->pads = malloc(entity->info.pads * sizeof(*entity->pads));
-		entity->links = malloc(entity->max_links * sizeof(*entity->links));
-		if (entity->pads == NULL || entity->links == NULL) {
-			ret = -ENOMEM;
-			break;
-		}
+	media_device_prefetch_devnames(media, NULL, 0);
+}
 
-		media->entities_count++;
+/*
+ * Report an entity of a graph loaded from the topology cache, with kernel
+ * descriptors for its pads and outbound links.
+ */
+static int media_enum_report_entity(struct media_entity *entity,
+				    media_entity_enum_t callback, void *priv)
+{
+	struct media_pad_desc *pads;
+	struct media_link_desc *links;
+	unsigned int num_links = 0;
+	unsigned int i;
+	int ret;
 
-		if (entity->info.flags & MEDIA_ENT_FL_DEFAULT) {
-			switch (entity->info.type) {
-			case MEDIA_ENT_T_DEVNODE_V4L:
-				media->def.v4l = entity;
-				break;
-			case MEDIA_ENT_T_DEVNODE_FB:
-				media->def.fb = entity;
-				break;
-			case MEDIA_ENT_T_DEVNODE_ALSA:
-				media->def.alsa = entity;
-				break;
-			case MEDIA_ENT_T_DEVNODE_DVB:
-				media->def.dvb = entity;
-				break;
-			}
-		}
+	pads = calloc(entity->info.pads ? entity->info.pads : 1, sizeof(*pads));
+	links = calloc(entity->num_links ? entity->num_links : 1, sizeof(*links));
+	if (pads == NULL || links == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
 
-		/* Find the corresponding device name. */
-		if (media_entity_type(entity) != MEDIA_ENT_T_DEVNODE &&
-		    media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
-			continue;
+	for (i = 0; i < entity->info.pads; ++i) {
+		pads[i].entity = entity->info.id;
+		pads[i].index = entity->pads[i].index;
+		pads[i].flags = entity->pads[i].flags;
+	}
 
-		/* Try to get the device name via udev */
-		if (!media_get_devname_udev(udev, entity))
+	for (i = 0; i < entity->num_links; ++i) {
+		struct media_link *link = &entity->links[i];
+		struct media_link_desc *desc = &links[num_links];
+
+		if (link->source->entity != entity)
 			continue;
 
-		/* Fall back to get the device name via sysfs */
-		media_get_devname_sysfs(entity);
+		desc->source.entity = entity->info.id;
+		desc->source.index = link->source->index;
+		desc->source.flags = link->source->flags;
+		desc->sink.entity = link->sink->entity->info.id;
+		desc->sink.index = link->sink->index;
+		desc->sink.flags = link->sink->flags;
+		desc->flags = link->flags;
+		num_links++;
 	}
 
-	media_udev_close(udev);
+	ret = callback(priv, &entity->info, pads, links);
+
+done:
+	free(pads);
+	free(links);
 	return ret;
 }
 
-int media_device_enumerate(struct media_device *media)
+int media_device_enumerate_stream(struct media_device *media,
+				  media_entity_enum_t callback, void *priv)
 {
+	struct media_enum e;
+	unsigned int i;
 	int ret;
 
 	if (media->entities)
@@ -581,6 +2355,8 @@ int media_device_enumerate(struct media_device *media)
 	if (ret < 0)
 		return ret;
 
+	memset(&e, 0, sizeof(e));
+
 	ret = ioctl(media->fd, MEDIA_IOC_DEVICE_INFO, &media->info);
 	if (ret < 0) {
 		ret = -errno;
@@ -590,34 +2366,71 @@ int media_device_enumerate(struct media_device *media)
 		goto done;
 	}
 
-	media_dbg(media, "Enumerating entities\n");
+	if (media->cache_dir && media_cache_load(media) == 0) {
+		media_dbg(media, "Found %u entities\n", media->entities_count);
+		ret = media_device_index_entities(media);
+		if (ret < 0 || callback == NULL)
+			goto done;
+
+		for (i = 0; i < media->entities_count; ++i) {
+			ret = media_enum_report_entity(&media->entities[i],
+						       callback, priv);
+			if (ret)
+				break;
+		}
 
-	ret = media_enum_entities(media);
-	if (ret < 0) {
-		media_dbg(media,
-			  "%s: Unable to enumerate entities for device %s (%s)\n",
-			  __func__, media->devnode, strerror(-ret));
 		goto done;
 	}
 
-	media_dbg(media, "Found %u entities\n", media->entities_count);
-	media_dbg(media, "Enumerating pads and links\n");
+	media_dbg(media, "Enumerating entities, pads and links\n");
+
+	while ((ret = media_enum_entity(media, &e)) > 0) {
+		const struct media_entity_desc *desc;
+
+		if (callback == NULL)
+			continue;
+
+		desc = &e.entities[e.num_entities - 1];
+		ret = callback(priv, desc, &e.pads[e.num_pads - desc->pads],
+			       &e.links[e.num_links - desc->links]);
+		if (ret) {
+			media_dbg(media, "Enumeration stopped after %u entities\n",
+				  e.num_entities);
+			goto done;
+		}
+	}
 
-	ret = media_enum_links(media);
 	if (ret < 0) {
 		media_dbg(media,
-			  "%s: Unable to enumerate pads and linksfor device %s\n",
-			  __func__, media->devnode);
+			  "%s: Unable to enumerate entities, pads and links for device %s (%s)\n",
+			  __func__, media->devnode, strerror(-ret));
 		goto done;
 	}
 
+	media_dbg(media, "Found %u entities\n", e.num_entities);
+
+	ret = media_build_graph(media, &e);
+	if (ret < 0)
+		goto done;
+
+	media_enum_devnames(media);
+
+	if (media->cache_dir)
+		media_cache_store(media, e.links);
+
 	ret = 0;
 
 done:
+	media_enum_cleanup(&e);
 	media_device_close(media);
 	return ret;
 }
 
+int media_device_enumerate(struct media_device *media)
+{
+	return media_device_enumerate_stream(media, NULL, NULL);
+}
+
 /* -----------------------------------------------------------------------------
  * Create/destroy
  */
@@ -691,24 +2504,56 @@ struct media_device *media_device_ref(struct media_device *media)
 	return media;
 }
 
-void media_device_unref(struct media_device *media)
+void media_device_free_entities(struct media_device *media)
 {
 	unsigned int i;
 
-	media->refcount--;
-	if (media->refcount > 0)
-		return;
-
 	for (i = 0; i < media->entities_count; ++i) {
 		struct media_entity *entity = &media->entities[i];
 
-		free(entity->pads);
-		free(entity->links);
 		if (entity->fd != -1)
 			close(entity->fd);
+		free(entity->cache);
+		free(entity->modes);
 	}
 
-	free(media->entities);
+	/* The entities array lives in the graph allocation unless it has been
+	 * reallocated by media_device_add_entity().
+	 */
+	if ((void *)media->entities != media->graph)
+		free(media->entities);
+	free(media->graph);
+
+	media->graph = NULL;
+	media->entities = NULL;
+	media->entities_count = 0;
+	media->pads = NULL;
+	media->pads_count = 0;
+	media->links = NULL;
+	media->links_count = 0;
+	media->pad_links = NULL;
+
+	media_device_clear_index(media);
+	memset(&media->def, 0, sizeof(media->def));
+	media->modes_loaded = false;
+
+	/* Staged links point to the freed graph. */
+	media->setup.count = 0;
+	free(media->setup.slot);
+	media->setup.slot = NULL;
+}
+
+void media_device_unref(struct media_device *media)
+{
+	media->refcount--;
+	if (media->refcount > 0)
+		return;
+
+	media_links_abort(media);
+	media_device_free_entities(media);
+	media_udev_release(media);
+	free(media->setup.staged);
+	free(media->cache_dir);
 	free(media->devnode);
 	free(media);
 }
@@ -717,16 +2562,54 @@ int media_device_add_entity(struct media_device *media,
 			    const struct media_entity_desc *desc,
 			    const char *devnode)
 {
+	struct media_entity **defaults[] = {
+		&media->def.v4l, &media->def.fb, &media->def.alsa,
+		&media->def.dvb,
+	};
+	unsigned int def_index[ARRAY_SIZE(defaults)];
 	struct media_entity **defent = NULL;
 	struct media_entity *entity;
 	unsigned int size;
+	unsigned int i, j;
+
+	/* Record the default entities by index while the entities array is
+	 * still valid, it may be moved or freed below.
+	 */
+	for (i = 0; i < ARRAY_SIZE(defaults); ++i)
+		def_index[i] = *defaults[i] ? *defaults[i] - media->entities
+			     : media->entities_count;
 
 	size = (media->entities_count + 1) * sizeof(*media->entities);
-	entity = realloc(media->entities, size);
+
+	/* The entities array can't be resized in place when it lives in the
+	 * graph allocation, move it to a separate allocation.
+	 */
+	if ((void *)media->entities == media->graph) {
+		entity = malloc(size);
+		if (entity && media->entities_count)
+			memcpy(entity, media->entities,
+			       media->entities_count * sizeof(*entity));
+	} else {
+		entity = realloc(media->entities, size);
+	}
+
 	if (entity == NULL)
 		return -ENOMEM;
 
+	/* Update pointers to the entities as the array has moved. */
+	for (i = 0; i < ARRAY_SIZE(defaults); ++i)
+		*defaults[i] = def_index[i] < media->entities_count
+			     ? &entity[def_index[i]] : NULL;
+
 	media->entities = entity;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		entity = &media->entities[i];
+
+		for (j = 0; j < entity->info.pads; ++j)
+			entity->pads[j].entity = entity;
+	}
+
 	media->entities_count++;
 
 	entity = &media->entities[media->entities_count - 1];
@@ -767,14 +2650,14 @@ int media_device_add_entity(struct media_device *media,
 			*defent = entity;
 	}
 
-	return 0;
+	return media_device_index_entity(media);
 }
 
-struct media_pad *media_parse_pad(struct media_device *media,
-				  const char *p, char **endp)
+struct media_entity *media_parse_entity(struct media_device *media,
+					 const char *p, char **endp)
 {
-	unsigned int entity_id, pad;
 	struct media_entity *entity;
+	unsigned int entity_id;
 	char *end;
 
 	/* endp can be NULL. To avoid spreading NULL checks across the function,
@@ -812,6 +2695,29 @@ struct media_pad *media_parse_pad(struct media_device *media,
 	}
 	for (; isspace(*end); ++end);
 
+	*endp = end;
+	return entity;
+}
+
+struct media_pad *media_parse_pad(struct media_device *media,
+				  const char *p, char **endp)
+{
+	struct media_entity *entity;
+	unsigned int pad;
+	char *end;
+
+	/* endp can be NULL. To avoid spreading NULL checks across the function,
+	 * set endp to &end in that case.
+	 */
+	if (endp == NULL)
+		endp = &end;
+
+	entity = media_parse_entity(media, p, &end);
+	if (entity == NULL) {
+		*endp = end;
+		return NULL;
+	}
+
 	if (*end != ':') {
 		media_dbg(media, "Expected ':'\n", *end);
 		*endp = end;
@@ -841,7 +2747,6 @@ struct media_link *media_parse_link(struct media_device *media,
 	struct media_link *link;
 	struct media_pad *source;
 	struct media_pad *sink;
-	unsigned int i;
 	char *end;
 
 	source = media_parse_pad(media, p, &end);
@@ -866,12 +2771,9 @@ struct media_link *media_parse_link(struct media_device *media,
 
 	*endp = end;
 
-	for (i = 0; i < source->entity->num_links; i++) {
-		link = &source->entity->links[i];
-
-		if (link->source == source && link->sink == sink)
-			return link;
-	}
+	link = media_pad_find_link(source, sink);
+	if (link != NULL)
+		return link;
 
 	media_dbg(media, "No link between \"%s\":%d and \"%s\":%d\n",
 			source->entity->info.name, source->index,
@@ -879,11 +2781,11 @@ struct media_link *media_parse_link(struct media_device *media,
 	return NULL;
 }
 
-int media_parse_setup_link(struct media_device *media,
-			   const char *p, char **endp)
+static struct media_link *media_parse_link_setup(struct media_device *media,
+						const char *p, __u32 *flags,
+						char **endp)
 {
 	struct media_link *link;
-	__u32 flags;
 	char *end;
 
 	link = media_parse_link(media, p, &end);
@@ -891,27 +2793,43 @@ int media_parse_setup_link(struct media_device *media,
 		media_dbg(media,
 			  "%s: Unable to parse link\n", __func__);
 		*endp = end;
-		return -EINVAL;
+		return NULL;
 	}
 
 	p = end;
 	if (*p++ != '[') {
 		media_dbg(media, "Unable to parse link flags: expected '['.\n");
 		*endp = (char *)p - 1;
-		return -EINVAL;
+		return NULL;
 	}
 
-	flags = strtoul(p, &end, 10);
+	*flags = strtoul(p, &end, 10);
 	for (p = end; isspace(*p); p++);
 	if (*p++ != ']') {
 		media_dbg(media, "Unable to parse link flags: expected ']'.\n");
 		*endp = (char *)p - 1;
-		return -EINVAL;
+		return NULL;
 	}
 
 	for (; isspace(*p); p++);
 	*endp = (char *)p;
 
+	return link;
+}
+
+int media_parse_setup_link(struct media_device *media,
+			   const char *p, char **endp)
+{
+	struct media_link *link;
+	__u32 flags;
+
+	link = media_parse_link_setup(media, p, &flags, endp);
+	if (link == NULL)
+		return -EINVAL;
+
+	if (media->setup.active)
+		return media_links_stage(media, link->source, link->sink, flags);
+
 	media_dbg(media,
 		  "Setting up link %u:%u -> %u:%u [%u]\n",
 		  link->source->entity->info.id, link->source->index,
@@ -943,15 +2861,113 @@ int media_parse_setup_links(struct media_device *media, const char *p)
 	char *end;
 	int ret;
 
+	ret = media_links_begin(media);
+	if (ret < 0)
+		return ret;
+
 	do {
 		ret = media_parse_setup_link(media, p, &end);
 		if (ret < 0) {
 			media_print_streampos(media, p, end);
+			media_links_abort(media);
 			return ret;
 		}
 
 		p = end + 1;
 	} while (*end == ',');
 
-	return *end ? -EINVAL : 0;
+	if (*end) {
+		media_links_abort(media);
+		return -EINVAL;
+	}
+
+	return media_links_commit(media, NULL, NULL);
+}
+
+int media_parse_links(struct media_device *media, const char *p,
+		      struct media_link_setup **plinks,
+		      unsigned int *pnum_links)
+{
+	struct media_link_setup *links = NULL;
+	unsigned int num_links = 0;
+	unsigned int max_links = 0;
+	char *end;
+
+	do {
+		struct media_link_setup *setup;
+
+		if (num_links == max_links) {
+			max_links = max_links ? max_links * 2 : 8;
+			setup = realloc(links, max_links * sizeof(*links));
+			if (setup == NULL) {
+				free(links);
+				return -ENOMEM;
+			}
+
+			links = setup;
+		}
+
+		setup = &links[num_links];
+		setup->link = media_parse_link_setup(media, p, &setup->flags,
+						     &end);
+		if (setup->link == NULL) {
+			media_print_streampos(media, p, end);
+			free(links);
+			return -EINVAL;
+		}
+
+		num_links++;
+		p = end + 1;
+	} while (*end == ',');
+
+	if (*end) {
+		free(links);
+		return -EINVAL;
+	}
+
+	*plinks = links;
+	*pnum_links = num_links;
+	return 0;
+}
+
+int media_reconcile_links(struct media_device *media, const char *p)
+{
+	char *end;
+	int ret;
+
+	ret = media_links_begin(media);
+	if (ret < 0)
+		return ret;
+
+	/* Links not listed in the string must end up disabled. Stage all
+	 * enabled links as disabled first, parsing the string then overrides
+	 * the staged flags of the listed links.
+	 */
+	ret = media_links_stage_disable_all(media);
+	if (ret < 0)
+		goto error;
+
+	if (*p == '\0')
+		return media_links_commit(media, NULL, NULL);
+
+	do {
+		ret = media_parse_setup_link(media, p, &end);
+		if (ret < 0) {
+			media_print_streampos(media, p, end);
+			goto error;
+		}
+
+		p = end + 1;
+	} while (*end == ',');
+
+	if (*end) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	return media_links_commit(media, NULL, NULL);
+
+error:
+	media_links_abort(media);
+	return ret;
 }
@@ -42,6 +42,11 @@ struct media_pad {
 struct media_device;
 struct media_entity;
 
+struct media_link_setup {
+	struct media_link *link;
+	__u32 flags;
+};
+
 /**
  * @brief Create a new media device.
  * @param devnode - device node path.
@@ -146,6 +151,71 @@ void media_debug_set_handler(
 	struct media_device *media, void (*debug_handler)(void *, ...),
 	void *debug_priv);
 
+/**
+ * @brief Enable the persistent topology cache.
+ * @param media - device instance.
+ * @param path - cache directory, or NULL to disable the cache.
+ *
+ * When the cache is enabled media_device_enumerate() looks for a snapshot of
+ * the topology in the @a path directory, keyed by the media device driver,
+ * serial number, bus information, hardware revision and driver version. On a
+ * cache hit the entity descriptors are read back from the kernel and compared
+ * with the snapshot, and only the state of links that can be modified is read
+ * back. Pads, links and device node names are loaded from the snapshot. When
+ * the snapshot doesn't match the device, or on a cache miss, the device is
+ * enumerated through the media controller API and the snapshot is written to
+ * the cache.
+ *
+ * Device node names are not verified when loading the cache. The cache
+ * directory should thus not persist across reboots, a directory on a tmpfs
+ * such as /run is recommended.
+ *
+ * The cache is disabled by default. This function must be called before
+ * media_device_enumerate().
+ *
+ * @return Zero on success or -ENOMEM if memory cannot be allocated.
+ */
+int media_device_set_cache(struct media_device *media, const char *path);
+
+/**
+ * @brief Enable lazy resolution of device node names
+ * @param media - device instance.
+ * @param enable - whether to defer device node name resolution.
+ *
+ * Device node names are looked up through udev or sysfs for all entities when
+ * enumerating the device by default. When lazy resolution is enabled the name
+ * of an entity is only looked up the first time it is needed, by
+ * media_entity_get_devname() or when opening the entity device node. Names can
+ * be resolved in bulk with media_device_prefetch_devnames().
+ *
+ * Names are always resolved at enumeration time when the topology cache is
+ * written (see media_device_set_cache()). Lazy resolution is disabled by
+ * default. This function must be called before media_device_enumerate().
+ */
+void media_device_set_lazy_devnames(struct media_device *media, int enable);
+
+struct udev;
+
+/**
+ * @brief Set the udev context used to resolve device node names
+ * @param media - device instance.
+ * @param udev - udev context, or NULL to use the library context.
+ *
+ * Device node names are resolved through a udev context created by the library
+ * the first time it is needed and shared by all media devices. Applications
+ * that already use libudev can supply their own context instead. A reference
+ * to @a udev is held until the media device is released or another context is
+ * set.
+ *
+ * libudev objects can't be used concurrently from multiple threads. The
+ * library serializes its accesses to @a udev, the application must not use the
+ * context concurrently with calls to the library that resolve device names.
+ *
+ * @return Zero on success, or -ENOTSUP if the library has been built without
+ * libudev support or if libudev can't be loaded.
+ */
+int media_device_set_udev(struct media_device *media, struct udev *udev);
+
 /**
  * @brief Enumerate the device topology
  * @param media - device instance.
@@ -157,6 +227,47 @@ void media_debug_set_handler(
  */
 int media_device_enumerate(struct media_device *media);
 
+/**
+ * @brief Entity enumeration callback
+ * @param priv - private data passed to media_device_enumerate_stream().
+ * @param info - kernel descriptor of the enumerated entity.
+ * @param pads - kernel descriptors of the entity pads.
+ * @param links - kernel descriptors of the entity outbound links.
+ *
+ * The @a pads and @a links arrays contain respectively info->pads and
+ * info->links descriptors. Links to entities that haven't been enumerated yet
+ * refer to them by ID only. The descriptors are only valid during the call.
+ *
+ * @return Zero to continue the enumeration, or any other value to stop it.
+ */
+typedef int (*media_entity_enum_t)(void *priv,
+				   const struct media_entity_desc *info,
+				   const struct media_pad_desc *pads,
+				   const struct media_link_desc *links);
+
+/**
+ * @brief Enumerate the device topology, reporting entities as they're found
+ * @param media - device instance.
+ * @param callback - function called for every entity.
+ * @param priv - private data passed to the callback.
+ *
+ * Enumerate the media device as media_device_enumerate() does, calling
+ * @a callback for every entity as soon as the entity and its links have been
+ * enumerated. The callback receives the kernel descriptors only, the graph
+ * entities not being available yet. The device node name of an entity can be
+ * resolved with media_device_get_devname().
+ *
+ * The enumeration stops when the callback returns a non-zero value. The graph
+ * isn't built in that case, except when loaded from the cache, and the media
+ * device needs to be enumerated again before its contents can be accessed.
+ * The callback may be NULL.
+ *
+ * @return Zero when the enumeration completes, the value returned by the
+ * callback when it stops the enumeration, or a negative error code on failure.
+ */
+int media_device_enumerate_stream(struct media_device *media,
+				  media_entity_enum_t callback, void *priv);
+
 /**
  * @brief Locate the pad at the other end of a link.
  * @param pad - sink pad at one end of the link.
@@ -170,6 +281,61 @@ int media_device_enumerate(struct media_device *media);
  */
 struct media_pad *media_entity_remote_source(struct media_pad *pad);
 
+/**
+ * @brief Locate the pads at the other end of the enabled links of a source pad.
+ * @param pad - source pad at one end of the links.
+ * @param sinks - array to be filled with the connected sink pads.
+ * @param max_sinks - size of the @a sinks array.
+ *
+ * Locate the sink pads connected to @a pad through enabled links and store
+ * them in the @a sinks array. At most @a max_sinks pads are stored, @a sinks
+ * can be NULL if @a max_sinks is zero to only count the connected pads.
+ *
+ * @return The number of connected sink pads, which can be larger than
+ * @a max_sinks. Return 0 if @a pad is not a source pad.
+ */
+unsigned int media_entity_remote_sinks(struct media_pad *pad,
+				       struct media_pad **sinks,
+				       unsigned int max_sinks);
+
+/**
+ * @brief Get the number of links connected to a pad
+ * @param pad - media pad.
+ *
+ * @return The number of links that originate from or arrive at @a pad
+ */
+unsigned int media_pad_get_links_count(struct media_pad *pad);
+
+/**
+ * @brief Get a pad link
+ * @param pad - media pad.
+ * @param index - link index.
+ *
+ * This function returns a pointer to the link object identified by its index
+ * among the links connected to @a pad. Links originating from the pad are
+ * listed before links arriving at the pad. If the link index is out of bounds
+ * it will return NULL.
+ *
+ * @return A pointer to the link
+ */
+struct media_link *media_pad_get_link(struct media_pad *pad, unsigned int index);
+
+/**
+ * @brief Get the enabled links connected to a pad
+ * @param pad - media pad.
+ * @param links - array to be filled with the enabled links.
+ * @param max_links - size of the @a links array.
+ *
+ * Store the enabled links that originate from or arrive at @a pad in the
+ * @a links array. At most @a max_links links are stored, @a links can be NULL
+ * if @a max_links is zero to only count the enabled links.
+ *
+ * @return The number of enabled links, which can be larger than @a max_links
+ */
+unsigned int media_pad_get_enabled_links(struct media_pad *pad,
+					 struct media_link **links,
+					 unsigned int max_links);
+
 /**
  * @brief Get information about a media entity
  * @param entity - media entity.
@@ -230,6 +396,41 @@ const struct media_link *media_entity_get_link(struct media_entity *entity,
  */
 const char *media_entity_get_devname(struct media_entity *entity);
 
+/**
+ * @brief Get the device node name for an entity descriptor
+ * @param media - device instance.
+ * @param info - kernel descriptor of the entity.
+ * @param devname - buffer to store the device node name.
+ * @param size - size of the @a devname buffer.
+ *
+ * Resolve the device node name of the entity described by @a info, as
+ * media_entity_get_devname() does. This function is meant for entities
+ * reported by media_device_enumerate_stream() before the graph is built.
+ *
+ * @return 0 on success, -ENODEV if the entity has no associated device node,
+ * or -ENOSPC if the name doesn't fit in @a devname.
+ */
+int media_device_get_devname(struct media_device *media,
+			     const struct media_entity_desc *info,
+			     char *devname, size_t size);
+
+/**
+ * @brief Resolve device node names in bulk
+ * @param media - device instance.
+ * @param entities - array of entities, or NULL for all entities.
+ * @param count - number of entries in the @a entities array.
+ *
+ * Resolve the device node names of @a entities that haven't been resolved yet
+ * when lazy resolution is enabled with media_device_set_lazy_devnames(). When
+ * libmediactl is built without libudev, the lookups are shared among a pool of
+ * worker threads.
+ *
+ * @return 0 on success, or -ENOMEM if memory cannot be allocated.
+ */
+int media_device_prefetch_devnames(struct media_device *media,
+				   struct media_entity **entities,
+				   unsigned int count);
+
 /**
  * @brief Get the type of an entity.
  * @param entity - the entity.
@@ -361,12 +562,173 @@ int media_setup_link(struct media_device *media,
  * @param media - media device.
  *
  * Disable all links in the media device. This function is usually used after
- * opening a media device to reset all links to a known state.
+ * opening a media device to reset all links to a known state. Only the links
+ * currently enabled are configured.
  *
  * @return 0 on success, or a negative error code on failure.
  */
 int media_reset_links(struct media_device *media);
 
+enum media_reset_scope {
+	MEDIA_RESET_COMPONENT,
+	MEDIA_RESET_DOWNSTREAM,
+};
+
+/**
+ * @brief Reset the links of a part of the graph to the disabled state.
+ * @param media - media device.
+ * @param entity - entity the reset starts from.
+ * @param scope - part of the graph to reset.
+ *
+ * Disable the enabled links of the entities reachable from @a entity through
+ * enabled links. With MEDIA_RESET_COMPONENT enabled links are followed in both
+ * directions, resetting the whole pipeline @a entity is part of. With
+ * MEDIA_RESET_DOWNSTREAM enabled links are only followed from source to sink,
+ * and only the links originating from @a entity and the entities downstream
+ * of it are disabled. Immutable links are followed but never disabled.
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int media_reset_links_from(struct media_device *media,
+			   struct media_entity *entity,
+			   enum media_reset_scope scope);
+
+/**
+ * @brief Find a route between a source pad and an entity.
+ * @param media - media device.
+ * @param source - source pad at the route origin.
+ * @param sink - entity at the route target.
+ * @param changes - link changes needed to set up the route (return).
+ * @param num_changes - number of link changes (return).
+ *
+ * Search the in-memory graph for the route from @a source to any sink pad of
+ * @a sink that requires enabling the smallest number of links. Enabled and
+ * immutable links are preferred, and links arriving at a sink pad that has an
+ * enabled immutable link are never used. No ioctl is issued.
+ *
+ * The link changes needed to set up the route are returned in a newly allocated
+ * @a changes array that the caller must free. Enabled links that conflict with
+ * the route, arriving at the same sink pads as links to be enabled, are
+ * disabled first. The route links to be enabled follow, from the route origin
+ * to its target. The array is empty (and NULL) if the route is already set up.
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -EINVAL: @a source is not a source pad
+ *	   -ENOENT: no route exists
+ *	   -ENOMEM: out of memory
+ */
+int media_find_route(struct media_device *media, struct media_pad *source,
+		     struct media_entity *sink, struct media_link_setup **changes,
+		     unsigned int *num_changes);
+
+/**
+ * @brief Set up a route between a source pad and an entity.
+ * @param media - media device.
+ * @param source - source pad at the route origin.
+ * @param sink - entity at the route target.
+ *
+ * Find the route from @a source to @a sink with media_find_route() and apply
+ * the link changes in a single link setup transaction.
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int media_setup_route(struct media_device *media, struct media_pad *source,
+		      struct media_entity *sink);
+
+/**
+ * @brief Link setup result callback.
+ * @param priv - private data passed to media_links_commit().
+ * @param link - link that has been staged.
+ * @param flags - flags requested for the link.
+ * @param result - setup result.
+ *
+ * @a result is 0 when the link has been configured, 1 when the link was already
+ * in the requested state and has been skipped, or a negative error code when
+ * configuring the link failed.
+ */
+typedef void (*media_link_result_t)(void *priv, struct media_link *link,
+				    __u32 flags, int result);
+
+/**
+ * @brief Start a link setup transaction.
+ * @param media - media device.
+ *
+ * Start staging link changes with media_links_stage(). The changes are applied
+ * by media_links_commit() or discarded by media_links_abort(), which both end
+ * the transaction. Only one transaction can be active at a time on a media
+ * device.
+ *
+ * While a transaction is active, media_parse_setup_link() stages links instead
+ * of configuring them immediately.
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -EBUSY: a transaction is already active
+ */
+int media_links_begin(struct media_device *media);
+
+/**
+ * @brief Stage a link change in the current transaction.
+ * @param media - media device.
+ * @param source - source pad at the link origin.
+ * @param sink - sink pad at the link target.
+ * @param flags - configuration flags.
+ *
+ * Locate the link between @a source and @a sink and record the requested
+ * @a flags. Staging the same link again replaces the previously requested
+ * flags. No ioctl is issued until the transaction is committed.
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -EINVAL: no transaction is active
+ *	   -ENOENT: link not found
+ *	   -ENOMEM: out of memory
+ */
+int media_links_stage(struct media_device *media, struct media_pad *source,
+		      struct media_pad *sink, __u32 flags);
+
+/**
+ * @brief Apply the staged link changes and end the transaction.
+ * @param media - media device.
+ * @param result - per-link result callback (optional).
+ * @param priv - private data passed to the @a result callback.
+ *
+ * Compare the staged flags with the current link flags and configure the links
+ * whose MEDIA_LNK_FL_ENABLED flag changes. Links to be disabled are configured
+ * before links to be enabled, links already in the requested state are
+ * skipped. The media device is opened once for all the links that need to be
+ * configured.
+ *
+ * The @a result callback, if not NULL, is called for every staged link in the
+ * order the links are processed. Processing stops at the first failure, the
+ * links already configured are then restored to their previous state in
+ * reverse order. Restoring a link can fail in turn, in which case the graph is
+ * left partially configured and the link flags reflect the hardware state.
+ *
+ * @return 0 on success, or the error code of the first failed link setup or
+ * of the failure to open the media device.
+ */
+int media_links_commit(struct media_device *media, media_link_result_t result,
+		       void *priv);
+
+/**
+ * @brief Discard the staged link changes and end the transaction.
+ * @param media - media device.
+ */
+void media_links_abort(struct media_device *media);
+
+/**
+ * @brief Parse string to an entity on the media device.
+ * @param media - media device.
+ * @param p - input string
+ * @param endp - pointer to string where parsing ended
+ *
+ * Parse NULL terminated string describing an entity, either as a numeric
+ * identifier or as a quoted name, and return its struct media_entity instance.
+ *
+ * @return Pointer to struct media_entity on success, NULL on failure.
+ */
+struct media_entity *media_parse_entity(struct media_device *media,
+					const char *p, char **endp);
+
 /**
  * @brief Parse string to a pad on the media device.
  * @param media - media device.
@@ -401,7 +763,8 @@ struct media_link *media_parse_link(struct media_device *media,
  * @param p - input string
  *
  * Parse NULL terminated string p describing a link and its configuration
- * and configure the link.
+ * and configure the link. If a link setup transaction is active the link is
+ * staged instead, see media_links_begin().
  *
  * @return 0 on success, or a negative error code on failure.
  */
@@ -414,10 +777,27 @@ int media_parse_setup_link(struct media_device *media,
  * @param p - input string
  *
  * Parse NULL terminated string p describing link(s) separated by
- * commas (,) and configure the link(s).
+ * commas (,) and configure the link(s). All links are parsed before any of them
+ * is configured, and links already in the requested state are skipped.
  *
  * @return 0 on success, or a negative error code on failure.
  */
 int media_parse_setup_links(struct media_device *media, const char *p);
 
+/**
+ * @brief Parse string to the complete set of links and apply the changes.
+ * @param media - media device.
+ * @param p - input string
+ *
+ * Parse NULL terminated string p describing link(s) separated by commas (,),
+ * using the same syntax as media_parse_setup_links(), as the complete desired
+ * link configuration. Listed links are configured with the given flags, all
+ * other links that are not immutable are disabled. Only the links whose state
+ * changes are configured, disabled links first. An empty string disables all
+ * links.
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int media_reconcile_links(struct media_device *media, const char *p);
+
 #endif
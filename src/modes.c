@@ -0,0 +1,452 @@
+/*
+ * V4L2 subdev interface library - supported modes
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/v4l2-subdev.h>
+
+#include "mediactl.h"
+#include "mediactl-priv.h"
+#include "tools.h"
+#include "v4l2subdev.h"
+
+struct v4l2_subdev_modes {
+	struct v4l2_subdev_mode *modes;
+	unsigned int count;
+	unsigned int max;
+};
+
+static int v4l2_subdev_modes_add(struct v4l2_subdev_modes *modes,
+				 const struct v4l2_subdev_mode *mode)
+{
+	if (modes->count == modes->max) {
+		struct v4l2_subdev_mode *tmp;
+		unsigned int max = modes->max ? modes->max * 2 : 16;
+
+		tmp = realloc(modes->modes, max * sizeof(*tmp));
+		if (tmp == NULL)
+			return -ENOMEM;
+
+		modes->modes = tmp;
+		modes->max = max;
+	}
+
+	modes->modes[modes->count++] = *mode;
+	return 0;
+}
+
+/*
+ * Enumerate the frame intervals of a frame size and add one mode per interval,
+ * or a single mode with a zero interval if the subdev doesn't report any.
+ */
+static int v4l2_subdev_enum_intervals(struct media_entity *entity,
+				      struct v4l2_subdev_mode *mode,
+				      struct v4l2_subdev_modes *modes)
+{
+	struct v4l2_subdev_frame_interval_enum ival;
+	unsigned int index;
+	int ret;
+
+	for (index = 0; ; ++index) {
+		memset(&ival, 0, sizeof(ival));
+		ival.index = index;
+		ival.pad = mode->pad;
+		ival.code = mode->code;
+		ival.width = mode->max_width;
+		ival.height = mode->max_height;
+
+		ret = ioctl(entity->fd, VIDIOC_SUBDEV_ENUM_FRAME_INTERVAL, &ival);
+		if (ret < 0)
+			break;
+
+		mode->interval = ival.interval;
+		ret = v4l2_subdev_modes_add(modes, mode);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (errno != EINVAL && errno != ENOTTY)
+		return -errno;
+
+	if (index > 0)
+		return 0;
+
+	memset(&mode->interval, 0, sizeof(mode->interval));
+	return v4l2_subdev_modes_add(modes, mode);
+}
+
+static int v4l2_subdev_enum_sizes(struct media_entity *entity,
+				  struct v4l2_subdev_mode *mode,
+				  struct v4l2_subdev_modes *modes)
+{
+	struct v4l2_subdev_frame_size_enum fse;
+	unsigned int index;
+	int ret;
+
+	for (index = 0; ; ++index) {
+		memset(&fse, 0, sizeof(fse));
+		fse.index = index;
+		fse.pad = mode->pad;
+		fse.code = mode->code;
+
+		ret = ioctl(entity->fd, VIDIOC_SUBDEV_ENUM_FRAME_SIZE, &fse);
+		if (ret < 0)
+			break;
+
+		mode->min_width = fse.min_width;
+		mode->min_height = fse.min_height;
+		mode->max_width = fse.max_width;
+		mode->max_height = fse.max_height;
+
+		ret = v4l2_subdev_enum_intervals(entity, mode, modes);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (errno != EINVAL && errno != ENOTTY)
+		return -errno;
+
+	if (index > 0)
+		return 0;
+
+	mode->min_width = mode->min_height = 0;
+	mode->max_width = mode->max_height = 0;
+	memset(&mode->interval, 0, sizeof(mode->interval));
+	return v4l2_subdev_modes_add(modes, mode);
+}
+
+int v4l2_subdev_enum_modes(struct media_entity *entity)
+{
+	struct v4l2_subdev_mbus_code_enum mbus;
+	struct v4l2_subdev_modes modes = { NULL, 0, 0 };
+	struct v4l2_subdev_mode mode;
+	unsigned int pad;
+	unsigned int index;
+	int ret;
+
+	if (media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+		return -EINVAL;
+
+	ret = v4l2_subdev_open(entity);
+	if (ret < 0)
+		return ret;
+
+	for (pad = 0; pad < entity->info.pads; ++pad) {
+		for (index = 0; ; ++index) {
+			memset(&mbus, 0, sizeof(mbus));
+			mbus.pad = pad;
+			mbus.index = index;
+
+			ret = ioctl(entity->fd, VIDIOC_SUBDEV_ENUM_MBUS_CODE,
+				    &mbus);
+			if (ret < 0) {
+				ret = errno == EINVAL || errno == ENOTTY
+				    ? 0 : -errno;
+				break;
+			}
+
+			memset(&mode, 0, sizeof(mode));
+			mode.pad = pad;
+			mode.code = mbus.code;
+
+			ret = v4l2_subdev_enum_sizes(entity, &mode, &modes);
+			if (ret < 0)
+				break;
+		}
+
+		if (ret < 0) {
+			media_dbg(entity->media,
+				  "%s: Unable to enumerate modes of %s/%u (%d)\n",
+				  __func__, entity->info.name, pad, ret);
+			free(modes.modes);
+			return ret;
+		}
+	}
+
+	free(entity->modes);
+	entity->modes = modes.modes;
+	entity->num_modes = modes.count;
+	entity->modes_valid = true;
+
+	media_dbg(entity->media, "%s: %u mode(s)\n", entity->info.name,
+		  modes.count);
+
+	return modes.count;
+}
+
+/* -----------------------------------------------------------------------------
+ * Persistence
+ */
+
+/*
+ * The modes cache file is stored next to the topology cache, and has the same
+ * validity constraints:
+ *
+ *	struct v4l2_subdev_modes_header	header
+ *	struct v4l2_subdev_modes_entity	entities[header.num_entities]
+ *	struct v4l2_subdev_mode		modes[header.num_modes]
+ *
+ * Entities are stored in the order of the media device entities array, modes
+ * in entity order.
+ */
+
+#define V4L2_SUBDEV_MODES_MAGIC		"MCTLMODE"
+#define V4L2_SUBDEV_MODES_VERSION	1
+
+struct v4l2_subdev_modes_header {
+	char magic[8];
+	__u32 version;
+	__u32 size;
+	__u32 checksum;
+	__u32 num_entities;
+	__u32 num_modes;
+};
+
+struct v4l2_subdev_modes_entity {
+	__u32 id;
+	__u32 valid;
+	__u32 num_modes;
+};
+
+static int v4l2_subdev_parse_modes(struct media_device *media,
+				   const void *data, size_t size)
+{
+	const struct v4l2_subdev_modes_header *header = data;
+	const struct v4l2_subdev_modes_entity *entities;
+	const struct v4l2_subdev_mode *modes;
+	unsigned int num_modes = 0;
+	unsigned int i;
+
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, V4L2_SUBDEV_MODES_MAGIC,
+		   sizeof(header->magic)) ||
+	    header->version != V4L2_SUBDEV_MODES_VERSION ||
+	    header->num_entities != media->entities_count ||
+	    header->num_modes > size / sizeof(*modes) ||
+	    header->size != size ||
+	    size != sizeof(*header)
+		  + header->num_entities * sizeof(*entities)
+		  + header->num_modes * sizeof(*modes) ||
+	    header->checksum != media_cache_checksum(header + 1,
+						     size - sizeof(*header)))
+		return -EINVAL;
+
+	entities = (const void *)(header + 1);
+	modes = (const void *)(entities + header->num_entities);
+
+	for (i = 0; i < header->num_entities; ++i) {
+		if (entities[i].id != media->entities[i].info.id)
+			return -ESTALE;
+		num_modes += entities[i].num_modes;
+	}
+
+	if (num_modes != header->num_modes)
+		return -EINVAL;
+
+	for (i = 0; i < header->num_entities; ++i) {
+		struct media_entity *entity = &media->entities[i];
+		unsigned int count = entities[i].num_modes;
+
+		if (entities[i].valid && !entity->modes_valid) {
+			entity->modes = malloc((count ? count : 1) *
+					       sizeof(*entity->modes));
+			if (entity->modes == NULL)
+				return -ENOMEM;
+
+			memcpy(entity->modes, modes, count * sizeof(*modes));
+			entity->num_modes = count;
+			entity->modes_valid = true;
+		}
+
+		modes += count;
+	}
+
+	return 0;
+}
+
+static int v4l2_subdev_load_modes(struct media_device *media)
+{
+	struct stat st;
+	void *data;
+	char *path;
+	int ret;
+	int fd;
+
+	path = media_cache_path(media, "modes");
+	if (path == NULL)
+		return -ENOMEM;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		media_dbg(media, "No modes cache at %s\n", path);
+		free(path);
+		return ret;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		free(path);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		free(path);
+		return -errno;
+	}
+
+	ret = v4l2_subdev_parse_modes(media, data, st.st_size);
+	if (ret < 0)
+		media_dbg(media, "Ignoring %s modes cache %s\n",
+			  ret == -ESTALE ? "stale" : "invalid", path);
+	else
+		media_dbg(media, "Loaded modes from cache %s\n", path);
+
+	munmap(data, st.st_size);
+	free(path);
+	return ret;
+}
+
+static int v4l2_subdev_store_modes(struct media_device *media)
+{
+	struct v4l2_subdev_modes_header *header;
+	struct v4l2_subdev_modes_entity *entities;
+	struct v4l2_subdev_mode *modes;
+	unsigned int num_modes = 0;
+	unsigned int i;
+	char *path = NULL;
+	size_t size;
+	void *data;
+	int ret;
+
+	for (i = 0; i < media->entities_count; ++i)
+		num_modes += media->entities[i].num_modes;
+
+	size = sizeof(*header) + media->entities_count * sizeof(*entities)
+	     + num_modes * sizeof(*modes);
+
+	data = calloc(1, size);
+	if (data == NULL)
+		return -ENOMEM;
+
+	header = data;
+	entities = (void *)(header + 1);
+	modes = (void *)(entities + media->entities_count);
+
+	memcpy(header->magic, V4L2_SUBDEV_MODES_MAGIC, sizeof(header->magic));
+	header->version = V4L2_SUBDEV_MODES_VERSION;
+	header->size = size;
+	header->num_entities = media->entities_count;
+	header->num_modes = num_modes;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		entities[i].id = entity->info.id;
+		entities[i].valid = entity->modes_valid;
+		entities[i].num_modes = entity->num_modes;
+
+		memcpy(modes, entity->modes,
+		       entity->num_modes * sizeof(*modes));
+		modes += entity->num_modes;
+	}
+
+	header->checksum = media_cache_checksum(header + 1,
+						size - sizeof(*header));
+
+	path = media_cache_path(media, "modes");
+	if (path == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	ret = media_cache_write(media, path, data, size);
+	if (ret < 0)
+		goto done;
+
+	media_dbg(media, "Stored modes in cache %s\n", path);
+
+done:
+	free(path);
+	free(data);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Query
+ */
+
+int v4l2_subdev_get_modes(struct media_entity *entity, unsigned int pad,
+			  const struct v4l2_subdev_mode **modes,
+			  unsigned int *num_modes)
+{
+	struct media_device *media = entity->media;
+	unsigned int first;
+	unsigned int last;
+	int ret;
+
+	if (pad >= entity->info.pads)
+		return -EINVAL;
+
+	if (!entity->modes_valid && media->cache_dir && !media->modes_loaded) {
+		media->modes_loaded = true;
+		v4l2_subdev_load_modes(media);
+	}
+
+	if (!entity->modes_valid) {
+		ret = v4l2_subdev_enum_modes(entity);
+		if (ret < 0)
+			return ret;
+
+		if (media->cache_dir)
+			v4l2_subdev_store_modes(media);
+	}
+
+	/* Modes are sorted by pad. */
+	for (first = 0; first < entity->num_modes; ++first) {
+		if (entity->modes[first].pad == pad)
+			break;
+	}
+
+	for (last = first; last < entity->num_modes; ++last) {
+		if (entity->modes[last].pad != pad)
+			break;
+	}
+
+	*modes = entity->modes + first;
+	*num_modes = last - first;
+	return 0;
+}
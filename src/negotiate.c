@@ -0,0 +1,430 @@
+/*
+ * V4L2 subdev interface library - format negotiation
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mediactl.h"
+#include "mediactl-priv.h"
+#include "tools.h"
+#include "v4l2subdev.h"
+
+/*
+ * The pipeline is the chain of subdevs connected by enabled links upstream of
+ * the output entity. Hop 0 is the sensor and has no sink pad, the last hop
+ * feeds the output entity.
+ */
+struct v4l2_subdev_hop {
+	struct media_pad *sink;
+	struct media_pad *source;
+};
+
+struct v4l2_subdev_candidate {
+	const struct v4l2_subdev_mode *mode;
+	__u32 width;
+	__u32 height;
+	unsigned long long cost;
+};
+
+/* Return the remote pad of the enabled link arriving at a sink pad. */
+static struct media_pad *v4l2_subdev_remote(struct media_pad *sink)
+{
+	struct media_entity *entity = sink->entity;
+	unsigned int i;
+
+	for (i = 0; i < entity->num_links; ++i) {
+		struct media_link *link = &entity->links[i];
+
+		if (link->sink == sink && link->flags & MEDIA_LNK_FL_ENABLED)
+			return link->source;
+	}
+
+	return NULL;
+}
+
+static int v4l2_subdev_find_chain(struct media_entity *output,
+				  struct v4l2_subdev_hop **phops,
+				  unsigned int *pnum_hops)
+{
+	struct media_device *media = output->media;
+	struct v4l2_subdev_hop *hops;
+	struct media_pad *source = NULL;
+	unsigned int num_hops = 0;
+	unsigned int i;
+
+	for (i = 0; i < output->info.pads && source == NULL; ++i) {
+		if (output->pads[i].flags & MEDIA_PAD_FL_SINK)
+			source = v4l2_subdev_remote(&output->pads[i]);
+	}
+
+	hops = calloc(media->entities_count, sizeof(*hops));
+	if (hops == NULL)
+		return -ENOMEM;
+
+	/* Walk upstream, storing the hops from the output to the sensor. */
+	while (source) {
+		struct media_entity *entity = source->entity;
+		struct media_pad *sink = NULL;
+
+		if (media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV ||
+		    num_hops == media->entities_count)
+			break;
+
+		hops[num_hops].source = source;
+		source = NULL;
+
+		for (i = 0; i < entity->info.pads && source == NULL; ++i) {
+			if (!(entity->pads[i].flags & MEDIA_PAD_FL_SINK))
+				continue;
+
+			source = v4l2_subdev_remote(&entity->pads[i]);
+			if (source)
+				sink = &entity->pads[i];
+		}
+
+		hops[num_hops++].sink = sink;
+	}
+
+	if (num_hops == 0 || source != NULL) {
+		media_dbg(media, "No subdev pipeline upstream of %s\n",
+			  output->info.name);
+		free(hops);
+		return -EINVAL;
+	}
+
+	/* Reverse the hops to start at the sensor. */
+	for (i = 0; i < num_hops / 2; ++i) {
+		struct v4l2_subdev_hop hop = hops[i];
+
+		hops[i] = hops[num_hops - 1 - i];
+		hops[num_hops - 1 - i] = hop;
+	}
+
+	*phops = hops;
+	*pnum_hops = num_hops;
+	return 0;
+}
+
+static bool v4l2_subdev_pad_supports(struct media_pad *pad, __u32 code)
+{
+	const struct v4l2_subdev_mode *modes;
+	unsigned int num_modes;
+	unsigned int i;
+
+	/* Pads that don't enumerate their codes can't be used for pruning. */
+	if (v4l2_subdev_get_modes(pad->entity, pad->index, &modes,
+				  &num_modes) < 0 || num_modes == 0)
+		return true;
+
+	for (i = 0; i < num_modes; ++i) {
+		if (modes[i].code == code)
+			return true;
+	}
+
+	return false;
+}
+
+static int v4l2_subdev_candidate_cmp(const void *a, const void *b)
+{
+	const struct v4l2_subdev_candidate *ca = a;
+	const struct v4l2_subdev_candidate *cb = b;
+
+	if (ca->cost != cb->cost)
+		return ca->cost < cb->cost ? -1 : 1;
+
+	return (int)(ca->mode - cb->mode);
+}
+
+/*
+ * Build the list of sensor modes that can meet the target, sorted by increasing
+ * pixel rate. The sensor size is the smallest size supported by the mode that
+ * is at least as large as the target, as the pipeline is assumed not to
+ * upscale.
+ */
+static int v4l2_subdev_candidates(struct v4l2_subdev_hop *hops,
+				  unsigned int num_hops,
+				  const struct v4l2_subdev_target *target,
+				  struct v4l2_subdev_candidate **pcands,
+				  unsigned int *pnum_cands)
+{
+	const struct v4l2_mbus_framefmt *format = &target->format;
+	const struct v4l2_fract *interval = &target->interval;
+	const struct v4l2_subdev_mode *modes;
+	struct v4l2_subdev_candidate *cands;
+	struct media_pad *sensor = hops[0].source;
+	unsigned int num_modes;
+	unsigned int num_cands = 0;
+	unsigned int i;
+	int ret;
+
+	ret = v4l2_subdev_get_modes(sensor->entity, sensor->index, &modes,
+				    &num_modes);
+	if (ret < 0)
+		return ret;
+
+	cands = calloc(num_modes ? num_modes : 1, sizeof(*cands));
+	if (cands == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < num_modes; ++i) {
+		const struct v4l2_subdev_mode *mode = &modes[i];
+		struct v4l2_subdev_candidate *cand = &cands[num_cands];
+		__u32 num = 1, den = 1;
+
+		/* A frame interval longer than the target is too slow. */
+		if (interval->numerator && mode->interval.denominator &&
+		    (unsigned long long)mode->interval.numerator * interval->denominator >
+		    (unsigned long long)interval->numerator * mode->interval.denominator)
+			continue;
+
+		if (mode->max_width) {
+			cand->width = format->width > mode->min_width
+				    ? format->width : mode->min_width;
+			cand->height = format->height > mode->min_height
+				     ? format->height : mode->min_height;
+			if (cand->width > mode->max_width ||
+			    cand->height > mode->max_height)
+				continue;
+		} else {
+			cand->width = format->width;
+			cand->height = format->height;
+		}
+
+		/* Without processing subdevs the sensor must match exactly. */
+		if (num_hops == 1) {
+			if ((format->code && mode->code != format->code) ||
+			    cand->width != format->width ||
+			    cand->height != format->height)
+				continue;
+		} else if (!v4l2_subdev_pad_supports(hops[1].sink,
+						     mode->code)) {
+			continue;
+		}
+
+		if (mode->interval.denominator) {
+			num = mode->interval.numerator;
+			den = mode->interval.denominator;
+		} else if (interval->denominator) {
+			num = interval->numerator;
+			den = interval->denominator;
+		}
+
+		cand->mode = mode;
+		cand->cost = (unsigned long long)cand->width * cand->height *
+			     den / (num ? num : 1);
+		num_cands++;
+	}
+
+	qsort(cands, num_cands, sizeof(*cands), v4l2_subdev_candidate_cmp);
+
+	*pcands = cands;
+	*pnum_cands = num_cands;
+	return 0;
+}
+
+static bool v4l2_subdev_format_match(const struct v4l2_mbus_framefmt *a,
+				     const struct v4l2_mbus_framefmt *b)
+{
+	return a->code == b->code && a->width == b->width &&
+	       a->height == b->height;
+}
+
+/*
+ * Configure the pipeline for a candidate. Return 0 if the output format
+ * matches the target, -EPIPE if a driver adjusted a format, or another
+ * negative error code.
+ */
+static int v4l2_subdev_apply_candidate(struct v4l2_subdev_hop *hops,
+				       unsigned int num_hops,
+				       const struct v4l2_subdev_target *target,
+				       const struct v4l2_subdev_candidate *cand,
+				       enum v4l2_subdev_format_whence which)
+{
+	struct v4l2_mbus_framefmt request;
+	struct v4l2_mbus_framefmt format;
+	struct v4l2_subdev_hop *hop;
+	unsigned int i;
+	int ret;
+
+	memset(&request, 0, sizeof(request));
+	request.code = cand->mode->code;
+	request.width = cand->width;
+	request.height = cand->height;
+
+	hop = &hops[0];
+	format = request;
+	ret = v4l2_subdev_set_format(hop->source->entity, &format,
+				     hop->source->index, which);
+	if (ret < 0)
+		return ret;
+	if (!v4l2_subdev_format_match(&format, &request))
+		return -EPIPE;
+
+	if (which == V4L2_SUBDEV_FORMAT_ACTIVE &&
+	    cand->mode->interval.denominator) {
+		struct v4l2_fract interval = cand->mode->interval;
+
+		ret = v4l2_subdev_set_frame_interval(hop->source->entity,
+						     &interval);
+		if (ret < 0 && ret != -ENOTTY)
+			return ret;
+	}
+
+	for (i = 1; i < num_hops; ++i) {
+		hop = &hops[i];
+
+		/* The sink format must match the upstream source format. */
+		request = format;
+		ret = v4l2_subdev_set_format(hop->sink->entity, &format,
+					     hop->sink->index, which);
+		if (ret < 0)
+			return ret;
+		if (!v4l2_subdev_format_match(&format, &request))
+			return -EPIPE;
+
+		if (i < num_hops - 1) {
+			ret = v4l2_subdev_get_format(hop->source->entity,
+						     &format,
+						     hop->source->index, which);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+
+		/* Scale on the last hop, either by setting the source format
+		 * directly, or through the sink compose rectangle for subdevs
+		 * that derive the source size from it.
+		 */
+		request = target->format;
+		if (request.code == 0)
+			request.code = format.code;
+
+		format = request;
+		ret = v4l2_subdev_set_format(hop->source->entity, &format,
+					     hop->source->index, which);
+		if (ret < 0)
+			return ret;
+		if (v4l2_subdev_format_match(&format, &request))
+			return 0;
+
+		if (format.width != request.width ||
+		    format.height != request.height) {
+			struct v4l2_rect compose = {
+				0, 0, request.width, request.height
+			};
+
+			ret = v4l2_subdev_set_selection(hop->sink->entity,
+							&compose,
+							hop->sink->index,
+							V4L2_SEL_TGT_COMPOSE,
+							which);
+			if (ret < 0)
+				return -EPIPE;
+
+			format = request;
+			ret = v4l2_subdev_set_format(hop->source->entity,
+						     &format,
+						     hop->source->index, which);
+			if (ret < 0)
+				return ret;
+		}
+
+		return v4l2_subdev_format_match(&format, &request) ? 0 : -EPIPE;
+	}
+
+	/* Single hop, the sensor output has been checked already. */
+	return 0;
+}
+
+int v4l2_subdev_negotiate(struct media_entity *output,
+			  const struct v4l2_subdev_target *target,
+			  struct v4l2_subdev_mode *result)
+{
+	struct media_device *media = output->media;
+	struct v4l2_subdev_candidate *cands = NULL;
+	struct v4l2_subdev_hop *hops = NULL;
+	unsigned int num_cands;
+	unsigned int num_hops;
+	unsigned int i;
+	int ret;
+
+	ret = v4l2_subdev_find_chain(output, &hops, &num_hops);
+	if (ret < 0)
+		return ret;
+
+	ret = v4l2_subdev_candidates(hops, num_hops, target, &cands,
+				     &num_cands);
+	if (ret < 0)
+		goto done;
+
+	media_dbg(media, "%u candidate sensor mode(s) for %s\n", num_cands,
+		  output->info.name);
+
+	/* Validate candidates on the TRY formats, and only apply the first
+	 * valid one to the hardware. The subdevs are kept open meanwhile as
+	 * closing them would lose their TRY state.
+	 */
+	v4l2_subdev_hold_pool(media);
+
+	for (i = 0; i < num_cands; ++i) {
+		const struct v4l2_subdev_candidate *cand = &cands[i];
+
+		ret = v4l2_subdev_apply_candidate(hops, num_hops, target, cand,
+						  V4L2_SUBDEV_FORMAT_TRY);
+		media_dbg(media, "Candidate %s %ux%u: %s (%d)\n",
+			  v4l2_subdev_pixelcode_to_string(cand->mode->code),
+			  cand->width, cand->height,
+			  ret ? "rejected" : "accepted", ret);
+		if (ret != -EPIPE && ret != -EINVAL)
+			break;
+	}
+
+	v4l2_subdev_release_pool(media);
+
+	if (i < num_cands && ret < 0)
+		goto done;
+
+	if (i == num_cands) {
+		ret = -ERANGE;
+		goto done;
+	}
+
+	ret = v4l2_subdev_apply_candidate(hops, num_hops, target, &cands[i],
+					  V4L2_SUBDEV_FORMAT_ACTIVE);
+	if (ret < 0)
+		goto done;
+
+	if (result) {
+		*result = *cands[i].mode;
+		result->min_width = result->max_width = cands[i].width;
+		result->min_height = result->max_height = cands[i].height;
+	}
+
+done:
+	free(cands);
+	free(hops);
+	return ret;
+}
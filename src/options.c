@@ -36,15 +36,33 @@ static void usage(const char *argv0, int verbose)
 {
 	printf("%s [options] device\n", argv0);
 	printf("-d, --device dev	Media device name (default: %s)\n", MEDIA_DEVNAME_DEFAULT);
+	printf("    --cache dir		Cache the device topology in the given directory\n");
+	printf("    --dry-run		Print the changes of --route and -V instead of applying them\n");
+	printf("			and refuse other options that change the pipeline\n");
 	printf("-e, --entity name	Print the device name associated with the given entity\n");
 	printf("-V, --set-v4l2 v4l2	Comma-separated list of formats to setup\n");
 	printf("    --get-v4l2 pad	Print the active format on a given pad\n");
 	printf("-h, --help		Show verbose help and exit\n");
 	printf("-i, --interactive	Modify links interactively\n");
 	printf("-l, --links		Comma-separated list of links descriptors to setup\n");
+	printf("    --negotiate target	Configure the pipeline to output the target format\n");
+	printf("    --parallel		Apply -V to independent pipelines in parallel\n");
 	printf("-p, --print-topology	Print the device topology\n");
+	printf("    --profiles file	Load pipeline profiles from the given file\n");
+	printf("    --profile name	Switch to the given pipeline profile\n");
 	printf("    --print-dot		Print the device topology as a dot graph\n");
+	printf("    --print-modes	Print the modes supported by the subdevs\n");
+	printf("    --propagate		Propagate formats along enabled links after -V\n");
+	printf("    --route route	Enable the links needed to route a pad to an entity\n");
+	printf("    --reconcile		Treat -l and -V as the complete desired configuration and\n");
+	printf("			only apply the changes\n");
 	printf("-r, --reset		Reset all links to inactive\n");
+	printf("    --reset-from name	Reset the links of the pipeline containing the given entity\n");
+	printf("    --reset-downstream name\n");
+	printf("			Reset the links downstream of the given entity\n");
+	printf("    --skip-identical	Don't write formats, selections and frame intervals\n");
+	printf("			already set on the subdevs\n");
+	printf("    --validate		Check -r, -l and -V for consistency without applying them\n");
 	printf("-v, --verbose		Be verbose\n");
 
 	if (!verbose)
@@ -56,6 +74,9 @@ static void usage(const char *argv0, int verbose)
 	printf("\tpad             = entity ':' pad-number ;\n");
 	printf("\tentity          = entity-number | ( '\"' entity-name '\"' ) ;\n");
 	printf("\n");
+	printf("\troute           = pad '->' entity ;\n");
+	printf("\ttarget          = entity '[' v4l2-mbusfmt [ v4l2-interval ] ']' ;\n");
+	printf("\n");
 	printf("\tv4l2            = pad '[' v4l2-properties ']' ;\n");
 	printf("\tv4l2-properties = v4l2-property { ',' v4l2-property } ;\n");
 	printf("\tv4l2-property   = v4l2-mbusfmt | v4l2-crop | v4l2-interval\n");
@@ -82,9 +103,25 @@ static void usage(const char *argv0, int verbose)
 
 #define OPT_PRINT_DOT		256
 #define OPT_GET_FORMAT		257
+#define OPT_CACHE		258
+#define OPT_RESET_FROM		259
+#define OPT_RESET_DOWNSTREAM	260
+#define OPT_RECONCILE		261
+#define OPT_ROUTE		262
+#define OPT_DRY_RUN		263
+#define OPT_PROFILES		264
+#define OPT_PROFILE		265
+#define OPT_SKIP_IDENTICAL	266
+#define OPT_PROPAGATE		267
+#define OPT_VALIDATE		268
+#define OPT_PRINT_MODES		269
+#define OPT_NEGOTIATE		270
+#define OPT_PARALLEL		271
 
 static struct option opts[] = {
+	{"cache", 1, 0, OPT_CACHE},
 	{"device", 1, 0, 'd'},
+	{"dry-run", 0, 0, OPT_DRY_RUN},
 	{"entity", 1, 0, 'e'},
 	{"set-format", 1, 0, 'f'},
 	{"set-v4l2", 1, 0, 'V'},
@@ -93,9 +130,21 @@ static struct option opts[] = {
 	{"help", 0, 0, 'h'},
 	{"interactive", 0, 0, 'i'},
 	{"links", 1, 0, 'l'},
+	{"negotiate", 1, 0, OPT_NEGOTIATE},
+	{"parallel", 0, 0, OPT_PARALLEL},
 	{"print-dot", 0, 0, OPT_PRINT_DOT},
+	{"print-modes", 0, 0, OPT_PRINT_MODES},
 	{"print-topology", 0, 0, 'p'},
+	{"profile", 1, 0, OPT_PROFILE},
+	{"profiles", 1, 0, OPT_PROFILES},
+	{"propagate", 0, 0, OPT_PROPAGATE},
+	{"reconcile", 0, 0, OPT_RECONCILE},
+	{"route", 1, 0, OPT_ROUTE},
 	{"reset", 0, 0, 'r'},
+	{"reset-downstream", 1, 0, OPT_RESET_DOWNSTREAM},
+	{"reset-from", 1, 0, OPT_RESET_FROM},
+	{"skip-identical", 0, 0, OPT_SKIP_IDENTICAL},
+	{"validate", 0, 0, OPT_VALIDATE},
 	{"verbose", 0, 0, 'v'},
 };
 
@@ -161,6 +210,64 @@ int parse_cmdline(int argc, char **argv)
 			media_opts.pad = optarg;
 			break;
 
+		case OPT_CACHE:
+			media_opts.cache = optarg;
+			break;
+
+		case OPT_DRY_RUN:
+			media_opts.dry_run = 1;
+			break;
+
+		case OPT_ROUTE:
+			media_opts.route = optarg;
+			break;
+
+		case OPT_PROFILES:
+			media_opts.profiles = optarg;
+			break;
+
+		case OPT_PROFILE:
+			media_opts.profile = optarg;
+			break;
+
+		case OPT_RECONCILE:
+			media_opts.reconcile = 1;
+			break;
+
+		case OPT_RESET_FROM:
+			media_opts.reset_from = optarg;
+			media_opts.reset_downstream = 0;
+			break;
+
+		case OPT_RESET_DOWNSTREAM:
+			media_opts.reset_from = optarg;
+			media_opts.reset_downstream = 1;
+			break;
+
+		case OPT_NEGOTIATE:
+			media_opts.negotiate = optarg;
+			break;
+
+		case OPT_PARALLEL:
+			media_opts.parallel = 1;
+			break;
+
+		case OPT_PRINT_MODES:
+			media_opts.print_modes = 1;
+			break;
+
+		case OPT_PROPAGATE:
+			media_opts.propagate = 1;
+			break;
+
+		case OPT_SKIP_IDENTICAL:
+			media_opts.skip_identical = 1;
+			break;
+
+		case OPT_VALIDATE:
+			media_opts.validate = 1;
+			break;
+
 		default:
 			printf("Invalid option -%c\n", opt);
 			printf("Run %s -h for help.\n", argv[0]);
@@ -168,6 +275,18 @@ int parse_cmdline(int argc, char **argv)
 		}
 	}
 
+	/* --dry-run only covers --route and -V, refuse to apply the other
+	 * changes in the same invocation.
+	 */
+	if (media_opts.dry_run && !media_opts.validate &&
+	    (media_opts.reset || media_opts.reset_from || media_opts.links ||
+	     media_opts.profile || media_opts.negotiate ||
+	     media_opts.propagate || media_opts.interactive)) {
+		printf("--dry-run can only be combined with --route and -V\n");
+		printf("Use --validate to check -r and -l without applying them.\n");
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -25,15 +25,29 @@
 struct media_options
 {
 	const char *devname;
-	unsigned int interactive:1,
+	const char *cache;
+	unsigned int dry_run:1,
+		     interactive:1,
+		     parallel:1,
 		     print:1,
 		     print_dot:1,
+		     print_modes:1,
+		     propagate:1,
+		     reconcile:1,
 		     reset:1,
+		     reset_downstream:1,
+		     skip_identical:1,
+		     validate:1,
 		     verbose:1;
 	const char *entity;
 	const char *formats;
 	const char *links;
+	const char *negotiate;
 	const char *pad;
+	const char *reset_from;
+	const char *route;
+	const char *profiles;
+	const char *profile;
 };
 
 extern struct media_options media_opts;
@@ -0,0 +1,470 @@
+/*
+ * V4L2 subdev interface library - pipeline profiles
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mediactl.h"
+#include "mediactl-priv.h"
+#include "tools.h"
+#include "v4l2subdev.h"
+
+/*
+ * A profile is resolved once when added: links are stored as link handles with
+ * their requested flags, and formats as desired pad states. Applying a profile
+ * only walks these arrays.
+ */
+struct v4l2_subdev_profile {
+	char *name;
+	struct media_link_setup *links;
+	unsigned int num_links;
+	struct v4l2_subdev_pad_state *formats;
+	unsigned int num_formats;
+};
+
+struct v4l2_subdev_profiles {
+	struct media_device *media;
+	struct v4l2_subdev_profile *profiles;
+	unsigned int count;
+	struct v4l2_subdev_profile *active;
+};
+
+struct v4l2_subdev_profiles *
+v4l2_subdev_profiles_new(struct media_device *media)
+{
+	struct v4l2_subdev_profiles *profiles;
+
+	profiles = calloc(1, sizeof(*profiles));
+	if (profiles == NULL)
+		return NULL;
+
+	profiles->media = media;
+	return profiles;
+}
+
+void v4l2_subdev_profiles_free(struct v4l2_subdev_profiles *profiles)
+{
+	unsigned int i;
+
+	if (profiles == NULL)
+		return;
+
+	for (i = 0; i < profiles->count; ++i) {
+		free(profiles->profiles[i].name);
+		free(profiles->profiles[i].links);
+		free(profiles->profiles[i].formats);
+	}
+
+	free(profiles->profiles);
+	free(profiles);
+}
+
+static struct v4l2_subdev_profile *
+v4l2_subdev_profiles_find(struct v4l2_subdev_profiles *profiles,
+			  const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < profiles->count; ++i) {
+		if (strcmp(profiles->profiles[i].name, name) == 0)
+			return &profiles->profiles[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Merge the states of pads listed more than once, properties set by later
+ * entries replacing the earlier ones. Each pad then has a single state that
+ * fully describes its configuration in the profile.
+ */
+static void
+v4l2_subdev_profile_merge_states(struct v4l2_subdev_profile *profile)
+{
+	unsigned int count = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < profile->num_formats; ++i) {
+		struct v4l2_subdev_pad_state *state = &profile->formats[i];
+		struct v4l2_subdev_pad_state *merged = NULL;
+
+		for (j = 0; j < count; ++j) {
+			if (profile->formats[j].pad == state->pad) {
+				merged = &profile->formats[j];
+				break;
+			}
+		}
+
+		if (merged == NULL) {
+			profile->formats[count++] = *state;
+			continue;
+		}
+
+		if (state->format.width && state->format.height)
+			merged->format = state->format;
+		if (state->crop.left != -1)
+			merged->crop = state->crop;
+		if (state->compose.left != -1)
+			merged->compose = state->compose;
+		if (state->interval.numerator)
+			merged->interval = state->interval;
+	}
+
+	profile->num_formats = count;
+}
+
+int v4l2_subdev_profiles_add(struct v4l2_subdev_profiles *profiles,
+			     const char *name, const char *links,
+			     const char *formats)
+{
+	struct media_device *media = profiles->media;
+	struct v4l2_subdev_profile *profile;
+	struct v4l2_subdev_profile tmp;
+	int ret;
+
+	if (v4l2_subdev_profiles_find(profiles, name)) {
+		media_dbg(media, "Duplicate profile '%s'\n", name);
+		return -EEXIST;
+	}
+
+	memset(&tmp, 0, sizeof(tmp));
+
+	if (links && *links) {
+		ret = media_parse_links(media, links, &tmp.links, &tmp.num_links);
+		if (ret < 0) {
+			media_dbg(media, "Unable to parse links of profile '%s'\n",
+				  name);
+			goto error;
+		}
+	}
+
+	if (formats && *formats) {
+		ret = v4l2_subdev_parse_pad_states(media, formats, &tmp.formats,
+						   &tmp.num_formats);
+		if (ret < 0) {
+			media_dbg(media,
+				  "Unable to parse formats of profile '%s'\n",
+				  name);
+			goto error;
+		}
+
+		v4l2_subdev_profile_merge_states(&tmp);
+	}
+
+	tmp.name = strdup(name);
+	if (tmp.name == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	profile = realloc(profiles->profiles,
+			  (profiles->count + 1) * sizeof(*profile));
+	if (profile == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+
+	/* The active profile pointer must follow the array. */
+	if (profiles->active)
+		profiles->active = profile +
+				   (profiles->active - profiles->profiles);
+
+	profiles->profiles = profile;
+	profiles->profiles[profiles->count++] = tmp;
+
+	return 0;
+
+error:
+	free(tmp.name);
+	free(tmp.links);
+	free(tmp.formats);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Profile file
+ */
+
+static char *strtrim(char *str)
+{
+	char *end;
+
+	for (; isspace(*str); ++str);
+
+	end = str + strlen(str);
+	while (end > str && isspace(end[-1]))
+		--end;
+	*end = '\0';
+
+	return str;
+}
+
+/* Append a value to a comma-separated list. */
+static int strappend(char **list, const char *value)
+{
+	size_t len = *list ? strlen(*list) : 0;
+	char *str;
+
+	str = realloc(*list, len + strlen(value) + 2);
+	if (str == NULL)
+		return -ENOMEM;
+
+	if (len)
+		str[len++] = ',';
+	strcpy(str + len, value);
+
+	*list = str;
+	return 0;
+}
+
+int v4l2_subdev_profiles_load(struct v4l2_subdev_profiles *profiles,
+			      const char *filename)
+{
+	struct media_device *media = profiles->media;
+	char *section = NULL;
+	char *formats = NULL;
+	char *links = NULL;
+	unsigned int lineno = 0;
+	size_t size = 0;
+	char *line = NULL;
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(filename, "r");
+	if (file == NULL) {
+		ret = -errno;
+		media_dbg(media, "%s: Unable to open %s (%s)\n", __func__,
+			  filename, strerror(errno));
+		return ret;
+	}
+
+	while (1) {
+		ssize_t len;
+		char *value;
+		char *key;
+
+		len = getline(&line, &size, file);
+		lineno++;
+
+		if (len < 0 || line[strspn(line, " \t")] == '[') {
+			/* End of the previous section. */
+			if (section) {
+				ret = v4l2_subdev_profiles_add(profiles, section,
+							 links, formats);
+				free(section);
+				free(links);
+				free(formats);
+				section = links = formats = NULL;
+				if (ret < 0)
+					break;
+			}
+
+			if (len < 0)
+				break;
+		}
+
+		key = strtrim(line);
+		if (*key == '\0' || *key == '#' || *key == ';')
+			continue;
+
+		if (*key == '[') {
+			value = strchr(key, ']');
+			if (value == NULL || value[1] != '\0') {
+				media_dbg(media, "%s:%u: Expected ']'\n",
+					  filename, lineno);
+				ret = -EINVAL;
+				break;
+			}
+
+			*value = '\0';
+			section = strdup(strtrim(key + 1));
+			if (section == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			continue;
+		}
+
+		value = strchr(key, '=');
+		if (section == NULL || value == NULL) {
+			media_dbg(media, "%s:%u: Expected %s\n", filename,
+				  lineno, section ? "'='" : "'[profile]'");
+			ret = -EINVAL;
+			break;
+		}
+
+		*value++ = '\0';
+		key = strtrim(key);
+		value = strtrim(value);
+
+		if (strcmp(key, "links") == 0) {
+			ret = strappend(&links, value);
+		} else if (strcmp(key, "formats") == 0) {
+			ret = strappend(&formats, value);
+		} else {
+			media_dbg(media, "%s:%u: Unknown key '%s'\n", filename,
+				  lineno, key);
+			ret = -EINVAL;
+		}
+
+		if (ret < 0)
+			break;
+	}
+
+	free(section);
+	free(links);
+	free(formats);
+	free(line);
+	fclose(file);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Profile switching
+ */
+
+static void v4l2_subdev_profile_count_change(
+	void *priv, struct media_link *link __attribute__((unused)),
+	__u32 flags __attribute__((unused)), int result)
+{
+	unsigned int *changes = priv;
+
+	if (result == 0)
+		(*changes)++;
+}
+
+static bool
+v4l2_subdev_profile_has_state(struct v4l2_subdev_profile *profile,
+			      const struct v4l2_subdev_pad_state *state)
+{
+	unsigned int i;
+
+	if (profile == NULL)
+		return false;
+
+	for (i = 0; i < profile->num_formats; ++i) {
+		const struct v4l2_subdev_pad_state *other = &profile->formats[i];
+
+		if (other->pad != state->pad)
+			continue;
+
+		return other->format.code == state->format.code &&
+		       other->format.width == state->format.width &&
+		       other->format.height == state->format.height &&
+		       memcmp(&other->crop, &state->crop, sizeof(state->crop)) == 0 &&
+		       memcmp(&other->compose, &state->compose,
+			      sizeof(state->compose)) == 0 &&
+		       other->interval.numerator == state->interval.numerator &&
+		       other->interval.denominator == state->interval.denominator;
+	}
+
+	return false;
+}
+
+int v4l2_subdev_profiles_apply(struct v4l2_subdev_profiles *profiles,
+			       const char *name)
+{
+	struct media_device *media = profiles->media;
+	struct v4l2_subdev_profile *profile;
+	struct v4l2_subdev_profile *previous = profiles->active;
+	unsigned int changes = 0;
+	unsigned int i;
+	int ret;
+
+	profile = v4l2_subdev_profiles_find(profiles, name);
+	if (profile == NULL) {
+		media_dbg(media, "No profile '%s'\n", name);
+		return -ENOENT;
+	}
+
+	media_dbg(media, "Switching to profile '%s'\n", name);
+
+	/* The profile links are the complete set of links to be enabled, all
+	 * other links are disabled. Only links whose state changes are set up.
+	 */
+	profiles->active = NULL;
+
+	ret = media_links_begin(media);
+	if (ret < 0)
+		return ret;
+
+	ret = media_links_stage_disable_all(media);
+	if (ret < 0)
+		goto error;
+
+	for (i = 0; i < profile->num_links; ++i) {
+		struct media_link *link = profile->links[i].link;
+
+		ret = media_links_stage(media, link->source, link->sink,
+					profile->links[i].flags);
+		if (ret < 0)
+			goto error;
+	}
+
+	ret = media_links_commit(media, v4l2_subdev_profile_count_change,
+				 &changes);
+	if (ret < 0)
+		return ret;
+
+	/* Pad states identical in the previous profile are skipped without
+	 * touching the subdev, as long as nothing has changed in the pipeline
+	 * so far. After the first change, formats could have been modified by
+	 * the drivers as a side effect, and the remaining states are compared
+	 * with the values read back from the subdevs.
+	 */
+	for (i = 0; i < profile->num_formats; ++i) {
+		struct v4l2_subdev_pad_state state = profile->formats[i];
+
+		if (changes == 0 &&
+		    v4l2_subdev_profile_has_state(previous, &state)) {
+			media_dbg(media, "Pad %s/%u unchanged\n",
+				  state.pad->entity->info.name,
+				  state.pad->index);
+			continue;
+		}
+
+		ret = v4l2_subdev_reconcile_pad(&state);
+		if (ret < 0)
+			return ret;
+
+		changes += ret;
+	}
+
+	profiles->active = profile;
+	return 0;
+
+error:
+	media_links_abort(media);
+	return ret;
+}
+
+const char *
+v4l2_subdev_profiles_get_active(struct v4l2_subdev_profiles *profiles)
+{
+	return profiles->active ? profiles->active->name : NULL;
+}
@@ -26,6 +26,9 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,17 +36,63 @@
 #include <unistd.h>
 
 #include <linux/v4l2-subdev.h>
+#include <linux/videodev2.h>
 
 #include "mediactl.h"
 #include "mediactl-priv.h"
 #include "tools.h"
 #include "v4l2subdev.h"
 
+/*
+ * Close the least recently used subdevs until at most max file descriptors
+ * remain open, excluding the entity being opened.
+ */
+static void v4l2_subdev_trim_pool(struct media_device *media,
+				  struct media_entity *keep, unsigned int max)
+{
+	while (1) {
+		struct media_entity *lru = NULL;
+		unsigned int count = 0;
+		unsigned int i;
+
+		for (i = 0; i < media->entities_count; ++i) {
+			struct media_entity *entity = &media->entities[i];
+
+			if (entity->fd == -1 ||
+			    media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+				continue;
+
+			count++;
+			if (entity != keep &&
+			    (lru == NULL || entity->fd_serial < lru->fd_serial))
+				lru = entity;
+		}
+
+		if (count <= max || lru == NULL)
+			return;
+
+		media_dbg(media, "Closing least recently used subdev %s\n",
+			  lru->devname);
+		v4l2_subdev_close(lru);
+	}
+}
+
 int v4l2_subdev_open(struct media_entity *entity)
 {
+	struct media_device *media = entity->media;
+
+	/* Subdevs can be accessed concurrently, see
+	 * v4l2_subdev_parse_setup_formats_parallel().
+	 */
+	entity->fd_serial = __atomic_add_fetch(&media->fd_pool.serial, 1,
+					       __ATOMIC_RELAXED);
+
 	if (entity->fd != -1)
 		return 0;
 
+	/* Resolve the device node name if lazy resolution is enabled. */
+	media_entity_get_devname(entity);
+
 	entity->fd = open(entity->devname, O_RDWR);
 	if (entity->fd == -1) {
 		int ret = -errno;
@@ -53,6 +102,9 @@ int v4l2_subdev_open(struct media_entity *entity)
 		return ret;
 	}
 
+	if (media->fd_pool.max && !media->fd_pool.holds)
+		v4l2_subdev_trim_pool(media, entity, media->fd_pool.max);
+
 	return 0;
 }
 
@@ -60,15 +112,374 @@ void v4l2_subdev_close(struct media_entity *entity)
 {
 	close(entity->fd);
 	entity->fd = -1;
+
+	/* Events are not delivered while the subdev is closed. */
+	free(entity->cache);
+	entity->cache = NULL;
+}
+
+void v4l2_subdev_set_max_open(struct media_device *media, unsigned int max)
+{
+	media->fd_pool.max = max;
+	if (max && !media->fd_pool.holds)
+		v4l2_subdev_trim_pool(media, NULL, max);
+}
+
+void v4l2_subdev_hold_pool(struct media_device *media)
+{
+	media->fd_pool.holds++;
+}
+
+void v4l2_subdev_release_pool(struct media_device *media)
+{
+	if (--media->fd_pool.holds == 0 && media->fd_pool.max)
+		v4l2_subdev_trim_pool(media, NULL, media->fd_pool.max);
+}
+
+#define V4L2_SUBDEV_OPEN_WORKERS	8
+
+struct v4l2_subdev_opener {
+	pthread_t thread;
+	bool started;
+	struct media_entity **entities;
+	int *results;
+	unsigned int first;
+	unsigned int count;
+	unsigned int stride;
+};
+
+/*
+ * Workers only open device nodes and store the results, entities are updated
+ * and errors reported by the caller once all workers have completed.
+ */
+static void *v4l2_subdev_open_worker(void *arg)
+{
+	struct v4l2_subdev_opener *opener = arg;
+	unsigned int i;
+
+	for (i = opener->first; i < opener->count; i += opener->stride) {
+		int fd = open(opener->entities[i]->devname, O_RDWR);
+
+		opener->results[i] = fd == -1 ? -errno : fd;
+	}
+
+	return NULL;
+}
+
+int v4l2_subdev_open_entities(struct media_device *media,
+			      struct media_entity **entities,
+			      unsigned int count)
+{
+	struct v4l2_subdev_opener openers[V4L2_SUBDEV_OPEN_WORKERS];
+	struct media_entity **pending;
+	unsigned int num_pending = 0;
+	unsigned int num_workers;
+	unsigned int budget = ~0U;
+	bool *queued;
+	int *results;
+	unsigned int i;
+	int ret = 0;
+
+	if (entities == NULL)
+		count = media->entities_count;
+
+	pending = calloc(count ? count : 1, sizeof(*pending));
+	results = calloc(count ? count : 1, sizeof(*results));
+	queued = calloc(media->entities_count ? media->entities_count : 1,
+			sizeof(*queued));
+	if (pending == NULL || results == NULL || queued == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	/* Don't open more nodes than the pool can hold with the nodes already
+	 * open.
+	 */
+	if (media->fd_pool.max) {
+		budget = media->fd_pool.max;
+
+		for (i = 0; i < media->entities_count && budget; ++i) {
+			struct media_entity *entity = &media->entities[i];
+
+			if (entity->fd != -1 &&
+			    media_entity_type(entity) == MEDIA_ENT_T_V4L2_SUBDEV)
+				budget--;
+		}
+	}
+
+	for (i = 0; i < count && num_pending < budget; ++i) {
+		struct media_entity *entity = entities ? entities[i]
+					    : &media->entities[i];
+		unsigned int index = entity - media->entities;
+
+		if (entity->fd != -1 || queued[index] ||
+		    media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+			continue;
+
+		queued[index] = true;
+		pending[num_pending++] = entity;
+	}
+
+	ret = media_device_prefetch_devnames(media, pending, num_pending);
+	if (ret < 0)
+		goto done;
+
+	num_workers = num_pending < V4L2_SUBDEV_OPEN_WORKERS
+		    ? num_pending : V4L2_SUBDEV_OPEN_WORKERS;
+
+	/* A single node is opened from the calling thread. */
+	for (i = 0; i < num_workers; ++i) {
+		openers[i].entities = pending;
+		openers[i].results = results;
+		openers[i].first = i;
+		openers[i].count = num_pending;
+		openers[i].stride = num_workers;
+		openers[i].started = num_workers > 1 &&
+			!pthread_create(&openers[i].thread, NULL,
+					v4l2_subdev_open_worker, &openers[i]);
+	}
+
+	/* Open the nodes from the calling thread if a worker wasn't started. */
+	for (i = 0; i < num_workers; ++i) {
+		if (openers[i].started)
+			pthread_join(openers[i].thread, NULL);
+		else
+			v4l2_subdev_open_worker(&openers[i]);
+	}
+
+	for (i = 0; i < num_pending; ++i) {
+		struct media_entity *entity = pending[i];
+
+		if (results[i] < 0) {
+			media_dbg(media,
+				  "%s: Failed to open subdev device node %s\n",
+				  __func__, entity->devname);
+			if (ret == 0)
+				ret = results[i];
+			continue;
+		}
+
+		entity->fd = results[i];
+		entity->fd_serial = __atomic_add_fetch(&media->fd_pool.serial,
+						       1, __ATOMIC_RELAXED);
+	}
+
+done:
+	free(pending);
+	free(results);
+	free(queued);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Cache
+ */
+
+#ifndef V4L2_EVENT_SOURCE_CHANGE
+#define V4L2_EVENT_SOURCE_CHANGE		5
+#endif
+
+void v4l2_subdev_enable_cache(struct media_device *media, int enable)
+{
+	unsigned int i;
+
+	media->subdev_cache = enable;
+	if (enable)
+		return;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		free(media->entities[i].cache);
+		media->entities[i].cache = NULL;
+	}
+}
+
+void v4l2_subdev_invalidate_cache(struct media_entity *entity)
+{
+	struct v4l2_subdev_cache *cache = entity->cache;
+	unsigned int i;
+
+	if (cache == NULL)
+		return;
+
+	cache->interval_valid = false;
+	for (i = 0; i < entity->info.pads; ++i)
+		cache->pads[i].valid = 0;
+}
+
+int v4l2_subdev_handle_events(struct media_entity *entity)
+{
+	struct pollfd pfd;
+	struct v4l2_event event;
+	unsigned int count = 0;
+	int ret;
+
+	if (entity->fd == -1)
+		return 0;
+
+	pfd.fd = entity->fd;
+	pfd.events = POLLPRI;
+
+	ret = poll(&pfd, 1, 0);
+	if (ret < 0)
+		return -errno;
+	if (!(pfd.revents & POLLPRI))
+		return 0;
+
+	do {
+		memset(&event, 0, sizeof(event));
+		ret = ioctl(entity->fd, VIDIOC_DQEVENT, &event);
+		if (ret < 0)
+			break;
+
+		count++;
+	} while (event.pending);
+
+	media_dbg(entity->media, "%s: %u event(s), invalidating cache\n",
+		  entity->info.name, count);
+
+	v4l2_subdev_invalidate_cache(entity);
+	return count;
+}
+
+/*
+ * Return the cache of an entity for the given format whence, or NULL if caching
+ * is disabled or not applicable. TRY formats are stored in the file handle and
+ * are never cached. The cache is allocated on first use, and the subdev
+ * subscribed to source change events on all its pads.
+ */
+static struct v4l2_subdev_cache *v4l2_subdev_get_cache(
+	struct media_entity *entity, enum v4l2_subdev_format_whence which)
+{
+	struct v4l2_event_subscription sub;
+	struct v4l2_subdev_cache *cache;
+	unsigned int i;
+
+	if (!entity->media->subdev_cache || which != V4L2_SUBDEV_FORMAT_ACTIVE)
+		return NULL;
+
+	if (entity->cache)
+		return entity->cache;
+
+	if (v4l2_subdev_open(entity) < 0)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache) +
+		       entity->info.pads * sizeof(cache->pads[0]));
+	if (cache == NULL)
+		return NULL;
+
+	for (i = 0; i < entity->info.pads; ++i) {
+		memset(&sub, 0, sizeof(sub));
+		sub.type = V4L2_EVENT_SOURCE_CHANGE;
+		sub.id = i;
+
+		if (ioctl(entity->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+			break;
+	}
+
+	cache->subscribed = i == entity->info.pads;
+	if (!cache->subscribed)
+		media_dbg(entity->media,
+			  "%s: source change events not supported, cache must "
+			  "be invalidated explicitly\n", entity->info.name);
+
+	entity->cache = cache;
+	return cache;
+}
+
+static struct v4l2_subdev_pad_cache *v4l2_subdev_get_pad_cache(
+	struct media_entity *entity, unsigned int pad,
+	enum v4l2_subdev_format_whence which)
+{
+	struct v4l2_subdev_cache *cache;
+
+	if (pad >= entity->info.pads)
+		return NULL;
+
+	cache = v4l2_subdev_get_cache(entity, which);
+	return cache ? &cache->pads[pad] : NULL;
+}
+
+/* Return the cache slot of a selection target, or -1 if it isn't cached. */
+static int v4l2_subdev_cache_target(unsigned int target)
+{
+	switch (target) {
+	case V4L2_SEL_TGT_CROP:
+		return 0;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		return 1;
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		return 2;
+	case V4L2_SEL_TGT_COMPOSE:
+		return 3;
+	case V4L2_SEL_TGT_COMPOSE_DEFAULT:
+		return 4;
+	case V4L2_SEL_TGT_COMPOSE_BOUNDS:
+		return 5;
+	default:
+		return -1;
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Compare before write
+ */
+
+void v4l2_subdev_set_compare(struct media_device *media, int enable)
+{
+	media->compare.enabled = enable;
+}
+
+void v4l2_subdev_get_skip_counts(struct media_device *media,
+				 struct v4l2_subdev_skip_counts *counts)
+{
+	counts->format = media->compare.format;
+	counts->selection = media->compare.selection;
+	counts->interval = media->compare.interval;
+}
+
+static bool v4l2_subdev_compare_writes(struct media_entity *entity,
+				       enum v4l2_subdev_format_whence which,
+				       bool compare)
+{
+	return which == V4L2_SUBDEV_FORMAT_ACTIVE &&
+	       (compare || entity->media->compare.enabled);
+}
+
+/*
+ * Fields left to their default value (V4L2_FIELD_ANY and a zero colorspace)
+ * let the driver pick a value and match any current value.
+ */
+static bool v4l2_subdev_format_equal(const struct v4l2_mbus_framefmt *current,
+				     const struct v4l2_mbus_framefmt *format)
+{
+	return current->code == format->code &&
+	       current->width == format->width &&
+	       current->height == format->height &&
+	       (format->field == V4L2_FIELD_ANY ||
+		current->field == format->field) &&
+	       (format->colorspace == 0 ||
+		current->colorspace == format->colorspace);
 }
 
+/* -----------------------------------------------------------------------------
+ * Subdev operations
+ */
+
 int v4l2_subdev_get_format(struct media_entity *entity,
 	struct v4l2_mbus_framefmt *format, unsigned int pad,
 	enum v4l2_subdev_format_whence which)
 {
+	struct v4l2_subdev_pad_cache *cache;
 	struct v4l2_subdev_format fmt;
 	int ret;
 
+	cache = v4l2_subdev_get_pad_cache(entity, pad, which);
+	if (cache && cache->valid & V4L2_SUBDEV_CACHE_FORMAT) {
+		*format = cache->format;
+		return 0;
+	}
+
 	ret = v4l2_subdev_open(entity);
 	if (ret < 0)
 		return ret;
@@ -81,17 +492,35 @@ int v4l2_subdev_get_format(struct media_entity *entity,
 	if (ret < 0)
 		return -errno;
 
+	if (cache) {
+		cache->format = fmt.format;
+		cache->valid |= V4L2_SUBDEV_CACHE_FORMAT;
+	}
+
 	*format = fmt.format;
 	return 0;
 }
 
-int v4l2_subdev_set_format(struct media_entity *entity,
+static int __v4l2_subdev_set_format(struct media_entity *entity,
 	struct v4l2_mbus_framefmt *format, unsigned int pad,
-	enum v4l2_subdev_format_whence which)
+	enum v4l2_subdev_format_whence which, bool compare)
 {
+	struct v4l2_subdev_pad_cache *cache;
 	struct v4l2_subdev_format fmt;
 	int ret;
 
+	if (v4l2_subdev_compare_writes(entity, which, compare)) {
+		struct v4l2_mbus_framefmt current;
+
+		ret = v4l2_subdev_get_format(entity, &current, pad, which);
+		if (ret == 0 && v4l2_subdev_format_equal(&current, format)) {
+			__atomic_add_fetch(&entity->media->compare.format, 1,
+					   __ATOMIC_RELAXED);
+			*format = current;
+			return 0;
+		}
+	}
+
 	ret = v4l2_subdev_open(entity);
 	if (ret < 0)
 		return ret;
@@ -101,15 +530,58 @@ int v4l2_subdev_set_format(struct media_entity *entity,
 	fmt.which = which;
 	fmt.format = *format;
 
+	/* Drivers propagate formats inside the subdev and reset selection
+	 * rectangles, invalidate the whole entity.
+	 */
+	if (which == V4L2_SUBDEV_FORMAT_ACTIVE)
+		v4l2_subdev_invalidate_cache(entity);
+
 	ret = ioctl(entity->fd, VIDIOC_SUBDEV_S_FMT, &fmt);
 	if (ret < 0)
 		return -errno;
 
+	cache = v4l2_subdev_get_pad_cache(entity, pad, which);
+	if (cache) {
+		cache->format = fmt.format;
+		cache->valid |= V4L2_SUBDEV_CACHE_FORMAT;
+	}
+
 	*format = fmt.format;
-	return 0;
+	return 1;
 }
 
-int v4l2_subdev_get_selection(struct media_entity *entity,
+int v4l2_subdev_set_format(struct media_entity *entity,
+	struct v4l2_mbus_framefmt *format, unsigned int pad,
+	enum v4l2_subdev_format_whence which)
+{
+	int ret;
+
+	ret = __v4l2_subdev_set_format(entity, format, pad, which, false);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Capabilities are recorded from the result of the first ioctl that exercises
+ * them. Drivers return ENOTTY for unsupported ioctls only, any other result
+ * shows that the ioctl is implemented.
+ */
+static void v4l2_subdev_set_cap(struct media_entity *entity, unsigned int cap,
+				bool supported)
+{
+	entity->subdev_caps_valid |= cap;
+	if (supported)
+		entity->subdev_caps |= cap;
+	else
+		entity->subdev_caps &= ~cap;
+}
+
+static bool v4l2_subdev_lacks_cap(struct media_entity *entity,
+				  unsigned int cap)
+{
+	return entity->subdev_caps_valid & cap && !(entity->subdev_caps & cap);
+}
+
+static int __v4l2_subdev_get_selection(struct media_entity *entity,
 	struct v4l2_rect *rect, unsigned int pad, unsigned int target,
 	enum v4l2_subdev_format_whence which)
 {
@@ -123,34 +595,99 @@ int v4l2_subdev_get_selection(struct media_entity *entity,
 	if (ret < 0)
 		return ret;
 
-	memset(&u.sel, 0, sizeof(u.sel));
-	u.sel.pad = pad;
-	u.sel.target = target;
-	u.sel.which = which;
+	if (!v4l2_subdev_lacks_cap(entity, V4L2_SUBDEV_CAP_SELECTION)) {
+		memset(&u.sel, 0, sizeof(u.sel));
+		u.sel.pad = pad;
+		u.sel.target = target;
+		u.sel.which = which;
+
+		ret = ioctl(entity->fd, VIDIOC_SUBDEV_G_SELECTION, &u.sel);
+		if (ret >= 0) {
+			v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION,
+					    true);
+			*rect = u.sel.r;
+			return 0;
+		}
+		if (errno != ENOTTY) {
+			v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION,
+					    true);
+			return -errno;
+		}
 
-	ret = ioctl(entity->fd, VIDIOC_SUBDEV_G_SELECTION, &u.sel);
-	if (ret >= 0) {
-		*rect = u.sel.r;
-		return 0;
+		v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION, false);
 	}
-	if (errno != ENOTTY || target != V4L2_SEL_TGT_CROP)
-		return -errno;
+
+	if (target != V4L2_SEL_TGT_CROP ||
+	    v4l2_subdev_lacks_cap(entity, V4L2_SUBDEV_CAP_CROP))
+		return -ENOTTY;
 
 	memset(&u.crop, 0, sizeof(u.crop));
 	u.crop.pad = pad;
 	u.crop.which = which;
 
 	ret = ioctl(entity->fd, VIDIOC_SUBDEV_G_CROP, &u.crop);
-	if (ret < 0)
-		return -errno;
+	if (ret < 0) {
+		ret = -errno;
+		v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_CROP,
+				    ret != -ENOTTY);
+		return ret;
+	}
 
+	v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_CROP, true);
 	*rect = u.crop.rect;
 	return 0;
 }
 
-int v4l2_subdev_set_selection(struct media_entity *entity,
+int v4l2_subdev_get_selection(struct media_entity *entity,
 	struct v4l2_rect *rect, unsigned int pad, unsigned int target,
 	enum v4l2_subdev_format_whence which)
+{
+	struct v4l2_subdev_pad_cache *cache;
+	int slot;
+	int ret;
+
+	slot = v4l2_subdev_cache_target(target);
+	cache = slot >= 0 ? v4l2_subdev_get_pad_cache(entity, pad, which) : NULL;
+	if (cache && cache->valid & V4L2_SUBDEV_CACHE_SEL(slot)) {
+		if (cache->sel_ret[slot] == 0)
+			*rect = cache->sel[slot];
+		return cache->sel_ret[slot];
+	}
+
+	ret = __v4l2_subdev_get_selection(entity, rect, pad, target, which);
+
+	/* Unsupported targets are cached as well, other errors may be
+	 * transient.
+	 */
+	if (cache && (ret == 0 || ret == -ENOTTY || ret == -EINVAL)) {
+		cache->sel[slot] = *rect;
+		cache->sel_ret[slot] = ret;
+		cache->valid |= V4L2_SUBDEV_CACHE_SEL(slot);
+	}
+
+	return ret;
+}
+
+static void v4l2_subdev_cache_selection(struct media_entity *entity,
+	const struct v4l2_rect *rect, unsigned int pad, unsigned int target,
+	enum v4l2_subdev_format_whence which)
+{
+	struct v4l2_subdev_pad_cache *cache;
+	int slot;
+
+	slot = v4l2_subdev_cache_target(target);
+	cache = slot >= 0 ? v4l2_subdev_get_pad_cache(entity, pad, which) : NULL;
+	if (cache == NULL)
+		return;
+
+	cache->sel[slot] = *rect;
+	cache->sel_ret[slot] = 0;
+	cache->valid |= V4L2_SUBDEV_CACHE_SEL(slot);
+}
+
+static int __v4l2_subdev_set_selection(struct media_entity *entity,
+	struct v4l2_rect *rect, unsigned int pad, unsigned int target,
+	enum v4l2_subdev_format_whence which, bool compare)
 {
 	union {
 		struct v4l2_subdev_selection sel;
@@ -158,23 +695,58 @@ int v4l2_subdev_set_selection(struct media_entity *entity,
 	} u;
 	int ret;
 
+	if (v4l2_subdev_compare_writes(entity, which, compare)) {
+		struct v4l2_rect current;
+
+		ret = v4l2_subdev_get_selection(entity, &current, pad, target,
+						which);
+		if (ret == 0 && current.left == rect->left &&
+		    current.top == rect->top && current.width == rect->width &&
+		    current.height == rect->height) {
+			__atomic_add_fetch(&entity->media->compare.selection, 1,
+					   __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
 	ret = v4l2_subdev_open(entity);
 	if (ret < 0)
 		return ret;
 
-	memset(&u.sel, 0, sizeof(u.sel));
-	u.sel.pad = pad;
-	u.sel.target = target;
-	u.sel.which = which;
-	u.sel.r = *rect;
+	/* Selection rectangles are propagated inside the subdev, and the
+	 * source pad formats may be updated accordingly.
+	 */
+	if (which == V4L2_SUBDEV_FORMAT_ACTIVE)
+		v4l2_subdev_invalidate_cache(entity);
+
+	if (!v4l2_subdev_lacks_cap(entity, V4L2_SUBDEV_CAP_SELECTION)) {
+		memset(&u.sel, 0, sizeof(u.sel));
+		u.sel.pad = pad;
+		u.sel.target = target;
+		u.sel.which = which;
+		u.sel.r = *rect;
+
+		ret = ioctl(entity->fd, VIDIOC_SUBDEV_S_SELECTION, &u.sel);
+		if (ret >= 0) {
+			v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION,
+					    true);
+			*rect = u.sel.r;
+			v4l2_subdev_cache_selection(entity, rect, pad, target,
+						    which);
+			return 1;
+		}
+		if (errno != ENOTTY) {
+			v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION,
+					    true);
+			return -errno;
+		}
 
-	ret = ioctl(entity->fd, VIDIOC_SUBDEV_S_SELECTION, &u.sel);
-	if (ret >= 0) {
-		*rect = u.sel.r;
-		return 0;
+		v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION, false);
 	}
-	if (errno != ENOTTY || target != V4L2_SEL_TGT_CROP)
-		return -errno;
+
+	if (target != V4L2_SEL_TGT_CROP ||
+	    v4l2_subdev_lacks_cap(entity, V4L2_SUBDEV_CAP_CROP))
+		return -ENOTTY;
 
 	memset(&u.crop, 0, sizeof(u.crop));
 	u.crop.pad = pad;
@@ -182,19 +754,46 @@ int v4l2_subdev_set_selection(struct media_entity *entity,
 	u.crop.rect = *rect;
 
 	ret = ioctl(entity->fd, VIDIOC_SUBDEV_S_CROP, &u.crop);
-	if (ret < 0)
-		return -errno;
+	if (ret < 0) {
+		ret = -errno;
+		v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_CROP,
+				    ret != -ENOTTY);
+		return ret;
+	}
 
+	v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_CROP, true);
 	*rect = u.crop.rect;
-	return 0;
+	v4l2_subdev_cache_selection(entity, rect, pad, target, which);
+	return 1;
+}
+
+int v4l2_subdev_set_selection(struct media_entity *entity,
+	struct v4l2_rect *rect, unsigned int pad, unsigned int target,
+	enum v4l2_subdev_format_whence which)
+{
+	int ret;
+
+	ret = __v4l2_subdev_set_selection(entity, rect, pad, target, which,
+					  false);
+	return ret < 0 ? ret : 0;
 }
 
 int v4l2_subdev_get_frame_interval(struct media_entity *entity,
 				   struct v4l2_fract *interval)
 {
 	struct v4l2_subdev_frame_interval ival;
+	struct v4l2_subdev_cache *cache;
 	int ret;
 
+	cache = v4l2_subdev_get_cache(entity, V4L2_SUBDEV_FORMAT_ACTIVE);
+	if (cache && cache->interval_valid) {
+		*interval = cache->interval;
+		return 0;
+	}
+
+	if (v4l2_subdev_lacks_cap(entity, V4L2_SUBDEV_CAP_FRAME_INTERVAL))
+		return -ENOTTY;
+
 	ret = v4l2_subdev_open(entity);
 	if (ret < 0)
 		return ret;
@@ -202,19 +801,46 @@ int v4l2_subdev_get_frame_interval(struct media_entity *entity,
 	memset(&ival, 0, sizeof(ival));
 
 	ret = ioctl(entity->fd, VIDIOC_SUBDEV_G_FRAME_INTERVAL, &ival);
+	v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_FRAME_INTERVAL,
+			    ret >= 0 || errno != ENOTTY);
 	if (ret < 0)
 		return -errno;
 
+	if (cache) {
+		cache->interval = ival.interval;
+		cache->interval_valid = true;
+	}
+
 	*interval = ival.interval;
 	return 0;
 }
 
-int v4l2_subdev_set_frame_interval(struct media_entity *entity,
-				   struct v4l2_fract *interval)
+static int __v4l2_subdev_set_frame_interval(struct media_entity *entity,
+					    struct v4l2_fract *interval,
+					    bool compare)
 {
 	struct v4l2_subdev_frame_interval ival;
+	struct v4l2_subdev_cache *cache;
 	int ret;
 
+	/* Compare the intervals as fractions, 1/30 and 2/60 are identical. */
+	if (v4l2_subdev_compare_writes(entity, V4L2_SUBDEV_FORMAT_ACTIVE,
+				       compare)) {
+		struct v4l2_fract current;
+
+		ret = v4l2_subdev_get_frame_interval(entity, &current);
+		if (ret == 0 && current.denominator != 0 &&
+		    (unsigned long long)current.numerator * interval->denominator ==
+		    (unsigned long long)interval->numerator * current.denominator) {
+			__atomic_add_fetch(&entity->media->compare.interval, 1,
+					   __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	if (v4l2_subdev_lacks_cap(entity, V4L2_SUBDEV_CAP_FRAME_INTERVAL))
+		return -ENOTTY;
+
 	ret = v4l2_subdev_open(entity);
 	if (ret < 0)
 		return ret;
@@ -223,14 +849,63 @@ int v4l2_subdev_set_frame_interval(struct media_entity *entity,
 	ival.interval = *interval;
 
 	ret = ioctl(entity->fd, VIDIOC_SUBDEV_S_FRAME_INTERVAL, &ival);
+	v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_FRAME_INTERVAL,
+			    ret >= 0 || errno != ENOTTY);
 	if (ret < 0)
 		return -errno;
 
+	cache = v4l2_subdev_get_cache(entity, V4L2_SUBDEV_FORMAT_ACTIVE);
+	if (cache) {
+		cache->interval = ival.interval;
+		cache->interval_valid = true;
+	}
+
 	*interval = ival.interval;
-	return 0;
+	return 1;
 }
 
-static int v4l2_subdev_parse_format(struct media_device *media,
+int v4l2_subdev_set_frame_interval(struct media_entity *entity,
+				   struct v4l2_fract *interval)
+{
+	int ret;
+
+	ret = __v4l2_subdev_set_frame_interval(entity, interval, false);
+	return ret < 0 ? ret : 0;
+}
+
+unsigned int v4l2_subdev_get_caps(struct media_entity *entity,
+				  unsigned int mask)
+{
+	struct v4l2_fract interval;
+	struct v4l2_rect rect;
+
+	if (media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+		return 0;
+
+	/* Probe the missing capabilities through the regular accessors, the
+	 * results are then available from the subdev cache.
+	 */
+	if (mask & (V4L2_SUBDEV_CAP_SELECTION | V4L2_SUBDEV_CAP_CROP) &&
+	    (!(entity->subdev_caps_valid & V4L2_SUBDEV_CAP_SELECTION) ||
+	     (!(entity->subdev_caps & V4L2_SUBDEV_CAP_SELECTION) &&
+	      !(entity->subdev_caps_valid & V4L2_SUBDEV_CAP_CROP)))) {
+		if (entity->info.pads)
+			v4l2_subdev_get_selection(entity, &rect, 0,
+						  V4L2_SEL_TGT_CROP,
+						  V4L2_SUBDEV_FORMAT_ACTIVE);
+		else
+			v4l2_subdev_set_cap(entity, V4L2_SUBDEV_CAP_SELECTION |
+					    V4L2_SUBDEV_CAP_CROP, false);
+	}
+
+	if (mask & V4L2_SUBDEV_CAP_FRAME_INTERVAL &&
+	    !(entity->subdev_caps_valid & V4L2_SUBDEV_CAP_FRAME_INTERVAL))
+		v4l2_subdev_get_frame_interval(entity, &interval);
+
+	return entity->subdev_caps & mask;
+}
+
+static int v4l2_subdev_parse_format(struct media_device *media,
 				    struct v4l2_mbus_framefmt *format,
 				    const char *p, char **endp)
 {
@@ -451,8 +1126,14 @@ static struct media_pad *v4l2_subdev_parse_pad_format(
 	return pad;
 }
 
+/*
+ * Set a property unless it has been left unset by the parser. With compare set,
+ * or when compare before write is enabled, identical values are not written.
+ * Return 1 if the property has been written, 0 otherwise, or a negative error
+ * code.
+ */
 static int set_format(struct media_pad *pad,
-		      struct v4l2_mbus_framefmt *format)
+		      struct v4l2_mbus_framefmt *format, bool compare)
 {
 	int ret;
 
@@ -465,8 +1146,8 @@ static int set_format(struct media_pad *pad,
 		  format->width, format->height,
 		  pad->entity->info.name, pad->index);
 
-	ret = v4l2_subdev_set_format(pad->entity, format, pad->index,
-				     V4L2_SUBDEV_FORMAT_ACTIVE);
+	ret = __v4l2_subdev_set_format(pad->entity, format, pad->index,
+				       V4L2_SUBDEV_FORMAT_ACTIVE, compare);
 	if (ret < 0) {
 		media_dbg(pad->entity->media,
 			  "Unable to set format: %s (%d)\n",
@@ -475,15 +1156,15 @@ static int set_format(struct media_pad *pad,
 	}
 
 	media_dbg(pad->entity->media,
-		  "Format set: %s %ux%u\n",
+		  "Format %s: %s %ux%u\n", ret ? "set" : "already set",
 		  v4l2_subdev_pixelcode_to_string(format->code),
 		  format->width, format->height);
 
-	return 0;
+	return ret;
 }
 
 static int set_selection(struct media_pad *pad, unsigned int target,
-			 struct v4l2_rect *rect)
+			 struct v4l2_rect *rect, bool compare)
 {
 	int ret;
 
@@ -495,8 +1176,9 @@ static int set_selection(struct media_pad *pad, unsigned int target,
 		  target, rect->left, rect->top, rect->width, rect->height,
 		  pad->entity->info.name, pad->index);
 
-	ret = v4l2_subdev_set_selection(pad->entity, rect, pad->index,
-					target, V4L2_SUBDEV_FORMAT_ACTIVE);
+	ret = __v4l2_subdev_set_selection(pad->entity, rect, pad->index,
+					  target, V4L2_SUBDEV_FORMAT_ACTIVE,
+					  compare);
 	if (ret < 0) {
 		media_dbg(pad->entity->media,
 			  "Unable to set selection rectangle: %s (%d)\n",
@@ -505,14 +1187,15 @@ static int set_selection(struct media_pad *pad, unsigned int target,
 	}
 
 	media_dbg(pad->entity->media,
-		  "Selection rectangle set: (%u,%u)/%ux%u\n",
+		  "Selection rectangle %s: (%u,%u)/%ux%u\n",
+		  ret ? "set" : "already set",
 		  rect->left, rect->top, rect->width, rect->height);
 
-	return 0;
+	return ret;
 }
 
 static int set_frame_interval(struct media_entity *entity,
-			      struct v4l2_fract *interval)
+			      struct v4l2_fract *interval, bool compare)
 {
 	int ret;
 
@@ -524,7 +1207,7 @@ static int set_frame_interval(struct media_entity *entity,
 		  interval->numerator, interval->denominator,
 		  entity->info.name);
 
-	ret = v4l2_subdev_set_frame_interval(entity, interval);
+	ret = __v4l2_subdev_set_frame_interval(entity, interval, compare);
 	if (ret < 0) {
 		media_dbg(entity->media,
 			  "Unable to set frame interval: %s (%d)",
@@ -532,10 +1215,11 @@ static int set_frame_interval(struct media_entity *entity,
 		return ret;
 	}
 
-	media_dbg(entity->media, "Frame interval set: %u/%u\n",
+	media_dbg(entity->media, "Frame interval %s: %u/%u\n",
+		  ret ? "set" : "already set",
 		  interval->numerator, interval->denominator);
 
-	return 0;
+	return ret;
 }
 
 
@@ -560,26 +1244,26 @@ static int v4l2_subdev_parse_setup_format(struct media_device *media,
 	}
 
 	if (pad->flags & MEDIA_PAD_FL_SINK) {
-		ret = set_format(pad, &format);
+		ret = set_format(pad, &format, false);
 		if (ret < 0)
 			return ret;
 	}
 
-	ret = set_selection(pad, V4L2_SEL_TGT_CROP, &crop);
+	ret = set_selection(pad, V4L2_SEL_TGT_CROP, &crop, false);
 	if (ret < 0)
 		return ret;
 
-	ret = set_selection(pad, V4L2_SEL_TGT_COMPOSE, &compose);
+	ret = set_selection(pad, V4L2_SEL_TGT_COMPOSE, &compose, false);
 	if (ret < 0)
 		return ret;
 
 	if (pad->flags & MEDIA_PAD_FL_SOURCE) {
-		ret = set_format(pad, &format);
+		ret = set_format(pad, &format, false);
 		if (ret < 0)
 			return ret;
 	}
 
-	ret = set_frame_interval(pad->entity, &interval);
+	ret = set_frame_interval(pad->entity, &interval, false);
 	if (ret < 0)
 		return ret;
 
@@ -587,18 +1271,21 @@ static int v4l2_subdev_parse_setup_format(struct media_device *media,
 	/* If the pad is an output pad, automatically set the same format on
 	 * the remote subdev input pads, if any.
 	 */
-	if (pad->flags & MEDIA_PAD_FL_SOURCE) {
-		for (i = 0; i < pad->entity->num_links; ++i) {
-			struct media_link *link = &pad->entity->links[i];
+	if (pad->flags & MEDIA_PAD_FL_SOURCE && pad->entity->pad_links) {
+		struct media_pad_links *plinks =
+			&pad->entity->pad_links[pad - pad->entity->pads];
+		struct media_link *links = &pad->entity->links[plinks->first];
+
+		for (i = 0; i < plinks->num_out; ++i) {
+			struct media_link *link = &links[i];
 			struct v4l2_mbus_framefmt remote_format;
 
 			if (!(link->flags & MEDIA_LNK_FL_ENABLED))
 				continue;
 
-			if (link->source == pad &&
-			    link->sink->entity->info.type == MEDIA_ENT_T_V4L2_SUBDEV) {
+			if (link->sink->entity->info.type == MEDIA_ENT_T_V4L2_SUBDEV) {
 				remote_format = format;
-				set_format(link->sink, &remote_format);
+				set_format(link->sink, &remote_format, false);
 			}
 		}
 	}
@@ -623,6 +1310,899 @@ int v4l2_subdev_parse_setup_formats(struct media_device *media, const char *p)
 	return *end ? -EINVAL : 0;
 }
 
+/* -----------------------------------------------------------------------------
+ * Reconciliation
+ */
+
+static int v4l2_subdev_apply_pad_state(struct v4l2_subdev_pad_state *state,
+				       bool compare)
+{
+	struct media_pad *pad = state->pad;
+	struct media_pad_links *plinks;
+	struct media_link *links;
+	unsigned int changes = 0;
+	unsigned int i;
+	int ret;
+
+	/* Follow the same order as v4l2_subdev_parse_setup_format(). When
+	 * comparing, every property is compared with the current value right
+	 * before being set, as setting a property can modify the others.
+	 */
+	if (pad->flags & MEDIA_PAD_FL_SINK) {
+		ret = set_format(pad, &state->format, compare);
+		if (ret < 0)
+			return ret;
+		changes += ret;
+	}
+
+	ret = set_selection(pad, V4L2_SEL_TGT_CROP, &state->crop, compare);
+	if (ret < 0)
+		return ret;
+	changes += ret;
+
+	ret = set_selection(pad, V4L2_SEL_TGT_COMPOSE, &state->compose,
+			    compare);
+	if (ret < 0)
+		return ret;
+	changes += ret;
+
+	if (pad->flags & MEDIA_PAD_FL_SOURCE) {
+		ret = set_format(pad, &state->format, compare);
+		if (ret < 0)
+			return ret;
+		changes += ret;
+	}
+
+	ret = set_frame_interval(pad->entity, &state->interval, compare);
+	if (ret < 0)
+		return ret;
+	changes += ret;
+
+	if (!(pad->flags & MEDIA_PAD_FL_SOURCE) || pad->entity->pad_links == NULL)
+		return changes;
+
+	/* Propagate the source format to the remote subdev sink pads. */
+	plinks = &pad->entity->pad_links[pad - pad->entity->pads];
+	links = &pad->entity->links[plinks->first];
+
+	for (i = 0; i < plinks->num_out; ++i) {
+		struct media_link *link = &links[i];
+		struct v4l2_mbus_framefmt remote_format;
+
+		if (!(link->flags & MEDIA_LNK_FL_ENABLED))
+			continue;
+
+		if (link->sink->entity->info.type == MEDIA_ENT_T_V4L2_SUBDEV) {
+			remote_format = state->format;
+			if (set_format(link->sink, &remote_format, compare) > 0)
+				changes++;
+		}
+	}
+
+	return changes;
+}
+
+int v4l2_subdev_reconcile_pad(struct v4l2_subdev_pad_state *state)
+{
+	return v4l2_subdev_apply_pad_state(state, true);
+}
+
+int v4l2_subdev_parse_pad_states(struct media_device *media, const char *p,
+				 struct v4l2_subdev_pad_state **pstates,
+				 unsigned int *pnum_states)
+{
+	struct v4l2_subdev_pad_state *states = NULL;
+	unsigned int num_states = 0;
+	unsigned int max_states = 0;
+	char *end;
+	int ret = 0;
+
+	do {
+		struct v4l2_subdev_pad_state *state;
+
+		if (num_states == max_states) {
+			max_states = max_states ? max_states * 2 : 8;
+			state = realloc(states, max_states * sizeof(*states));
+			if (state == NULL) {
+				ret = -ENOMEM;
+				goto done;
+			}
+
+			states = state;
+		}
+
+		state = &states[num_states];
+		memset(&state->format, 0, sizeof(state->format));
+		state->crop.left = state->crop.top = -1;
+		state->crop.width = state->crop.height = -1;
+		state->compose = state->crop;
+		state->interval.numerator = 0;
+		state->interval.denominator = 0;
+
+		state->pad = v4l2_subdev_parse_pad_format(media, &state->format,
+							  &state->crop,
+							  &state->compose,
+							  &state->interval,
+							  p, &end);
+		if (state->pad == NULL) {
+			media_print_streampos(media, p, end);
+			media_dbg(media, "Unable to parse format\n");
+			ret = -EINVAL;
+			goto done;
+		}
+
+		num_states++;
+		p = end + 1;
+	} while (*end == ',');
+
+	if (*end)
+		ret = -EINVAL;
+
+done:
+	if (ret < 0) {
+		free(states);
+		return ret;
+	}
+
+	*pstates = states;
+	*pnum_states = num_states;
+	return 0;
+}
+
+int v4l2_subdev_reconcile_formats(struct media_device *media, const char *p)
+{
+	struct v4l2_subdev_pad_state *states;
+	unsigned int num_states;
+	unsigned int i;
+	int ret;
+
+	/* Parse the whole string first to avoid applying a partial
+	 * configuration.
+	 */
+	ret = v4l2_subdev_parse_pad_states(media, p, &states, &num_states);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < num_states; ++i) {
+		ret = v4l2_subdev_reconcile_pad(&states[i]);
+		if (ret < 0)
+			break;
+	}
+
+	free(states);
+	return ret < 0 ? ret : 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Parallel setup
+ */
+
+#define V4L2_SUBDEV_SETUP_WORKERS	8
+
+struct v4l2_subdev_setup_group {
+	struct v4l2_subdev_pad_state **states;
+	unsigned int num_states;
+	int ret;
+};
+
+struct v4l2_subdev_setup_worker {
+	pthread_t thread;
+	bool started;
+	struct v4l2_subdev_setup_group *groups;
+	unsigned int first;
+	unsigned int count;
+	unsigned int stride;
+	int *failed;
+};
+
+static unsigned int setup_find(unsigned int *parent, unsigned int index)
+{
+	while (parent[index] != index) {
+		parent[index] = parent[parent[index]];
+		index = parent[index];
+	}
+
+	return index;
+}
+
+/*
+ * Apply the groups assigned to the worker, each group in sequence. No new group
+ * is started once a group has failed in any worker.
+ */
+static void *setup_worker(void *arg)
+{
+	struct v4l2_subdev_setup_worker *worker = arg;
+	unsigned int i, j;
+
+	for (i = worker->first; i < worker->count; i += worker->stride) {
+		struct v4l2_subdev_setup_group *group = &worker->groups[i];
+
+		if (__atomic_load_n(worker->failed, __ATOMIC_ACQUIRE))
+			break;
+
+		for (j = 0; j < group->num_states; ++j) {
+			group->ret = v4l2_subdev_apply_pad_state(group->states[j],
+								 false);
+			if (group->ret < 0) {
+				__atomic_store_n(worker->failed, 1,
+						 __ATOMIC_RELEASE);
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Split the pad states in groups of entities connected through enabled links.
+ * Formats are only propagated along enabled links, groups are thus
+ * independent. Groups are ordered by their first pad state, and pad states
+ * keep their relative order inside a group.
+ */
+static int setup_split_groups(struct media_device *media,
+			      struct v4l2_subdev_pad_state *states,
+			      unsigned int num_states,
+			      struct v4l2_subdev_setup_group **pgroups,
+			      unsigned int *pnum_groups)
+{
+	struct v4l2_subdev_setup_group *groups;
+	struct v4l2_subdev_pad_state **ordered;
+	unsigned int num_groups = 0;
+	unsigned int *parent;
+	unsigned int *group_of;
+	unsigned int i, j;
+
+	parent = calloc(media->entities_count, sizeof(*parent));
+	group_of = calloc(media->entities_count, sizeof(*group_of));
+	groups = calloc(num_states, sizeof(*groups));
+	ordered = calloc(num_states, sizeof(*ordered));
+	if (parent == NULL || group_of == NULL || groups == NULL ||
+	    ordered == NULL) {
+		free(parent);
+		free(group_of);
+		free(groups);
+		free(ordered);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < media->entities_count; ++i) {
+		parent[i] = i;
+		group_of[i] = -1;
+	}
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+			unsigned int source, sink;
+
+			if (!(link->flags & MEDIA_LNK_FL_ENABLED))
+				continue;
+
+			source = setup_find(parent, link->source->entity -
+					    media->entities);
+			sink = setup_find(parent, link->sink->entity -
+					  media->entities);
+			if (source != sink)
+				parent[sink] = source;
+		}
+	}
+
+	/* Count the states of every group to lay them out contiguously. */
+	for (i = 0; i < num_states; ++i) {
+		unsigned int root = setup_find(parent, states[i].pad->entity -
+					       media->entities);
+
+		if (group_of[root] == (unsigned int)-1)
+			group_of[root] = num_groups++;
+
+		groups[group_of[root]].num_states++;
+	}
+
+	for (i = 0, j = 0; i < num_groups; ++i) {
+		groups[i].states = &ordered[j];
+		j += groups[i].num_states;
+		groups[i].num_states = 0;
+	}
+
+	for (i = 0; i < num_states; ++i) {
+		unsigned int root = setup_find(parent, states[i].pad->entity -
+					       media->entities);
+		struct v4l2_subdev_setup_group *group = &groups[group_of[root]];
+
+		group->states[group->num_states++] = &states[i];
+	}
+
+	free(parent);
+	free(group_of);
+
+	*pgroups = groups;
+	*pnum_groups = num_groups;
+	return 0;
+}
+
+int v4l2_subdev_parse_setup_formats_parallel(struct media_device *media,
+					     const char *p)
+{
+	struct v4l2_subdev_setup_worker workers[V4L2_SUBDEV_SETUP_WORKERS];
+	struct v4l2_subdev_setup_group *groups;
+	struct v4l2_subdev_pad_state *states;
+	struct media_entity **entities;
+	unsigned int num_entities = 0;
+	unsigned int num_workers;
+	unsigned int num_states;
+	unsigned int num_groups;
+	unsigned int i;
+	int failed = 0;
+	bool *listed;
+	int ret;
+
+	ret = v4l2_subdev_parse_pad_states(media, p, &states, &num_states);
+	if (ret < 0)
+		return ret;
+
+	ret = setup_split_groups(media, states, num_states, &groups,
+				 &num_groups);
+	if (ret < 0) {
+		free(states);
+		return ret;
+	}
+
+	/* Workers must not close each other's subdevs, bounded pools are
+	 * handled sequentially.
+	 */
+	num_workers = num_groups < V4L2_SUBDEV_SETUP_WORKERS
+		    ? num_groups : V4L2_SUBDEV_SETUP_WORKERS;
+	if (media->fd_pool.max)
+		num_workers = num_groups ? 1 : 0;
+
+	media_dbg(media, "Applying %u format(s) in %u group(s) on %u worker(s)\n",
+		  num_states, num_groups, num_workers);
+
+	/* Open the subdevs upfront, the errors are reported when applying the
+	 * formats.
+	 */
+	entities = calloc(num_states ? num_states : 1, sizeof(*entities));
+	listed = calloc(media->entities_count ? media->entities_count : 1,
+			sizeof(*listed));
+	if (entities && listed) {
+		for (i = 0; i < num_states; ++i) {
+			struct media_entity *entity = states[i].pad->entity;
+			unsigned int index = entity - media->entities;
+
+			if (listed[index])
+				continue;
+
+			listed[index] = true;
+			entities[num_entities++] = entity;
+		}
+
+		v4l2_subdev_open_entities(media, entities, num_entities);
+	}
+	free(entities);
+	free(listed);
+
+	for (i = 0; i < num_workers; ++i) {
+		workers[i].groups = groups;
+		workers[i].first = i;
+		workers[i].count = num_groups;
+		workers[i].stride = num_workers;
+		workers[i].failed = &failed;
+		workers[i].started = num_workers > 1 &&
+				     !pthread_create(&workers[i].thread, NULL,
+						     setup_worker, &workers[i]);
+	}
+
+	for (i = 0; i < num_workers; ++i) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		else
+			setup_worker(&workers[i]);
+	}
+
+	/* Report the error of the first failed group for determinism. */
+	for (i = 0; i < num_groups; ++i) {
+		if (groups[i].ret < 0) {
+			ret = groups[i].ret;
+			break;
+		}
+	}
+
+	/* The pad state pointers of all groups share a single array. */
+	free(groups[0].states);
+	free(groups);
+	free(states);
+	return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * Two-phase setup
+ */
+
+struct v4l2_subdev_try {
+	struct media_device *media;
+	v4l2_subdev_validate_error_t report;
+	void *priv;
+	unsigned int adjusted;
+	bool *seeded;
+};
+
+static void try_report(struct v4l2_subdev_try *try, struct media_pad *pad,
+		       const char *fmt, ...)
+{
+	char message[160];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+
+	media_dbg(try->media, "%s/%u: %s\n", pad->entity->info.name,
+		  pad->index, message);
+
+	if (try->report)
+		try->report(try->priv, pad, message);
+}
+
+/*
+ * TRY formats are initialized by the kernel to default values when the subdev
+ * is opened. Copy the ACTIVE formats and rectangles of the entity to the TRY
+ * state, sink pads first, to try the configuration against the current state.
+ */
+static void try_seed(struct v4l2_subdev_try *try, struct media_entity *entity)
+{
+	static const unsigned int targets[] = {
+		V4L2_SEL_TGT_CROP, V4L2_SEL_TGT_COMPOSE,
+	};
+	unsigned int index = entity - try->media->entities;
+	unsigned int flags;
+	unsigned int i, j;
+
+	if (try->seeded[index])
+		return;
+
+	try->seeded[index] = true;
+
+	for (flags = MEDIA_PAD_FL_SINK; flags; ) {
+		for (i = 0; i < entity->info.pads; ++i) {
+			struct v4l2_mbus_framefmt format;
+			struct v4l2_rect rect;
+
+			if (!(entity->pads[i].flags & flags))
+				continue;
+
+			if (v4l2_subdev_get_format(entity, &format, i,
+						   V4L2_SUBDEV_FORMAT_ACTIVE) == 0)
+				v4l2_subdev_set_format(entity, &format, i,
+						       V4L2_SUBDEV_FORMAT_TRY);
+
+			for (j = 0; j < ARRAY_SIZE(targets); ++j) {
+				if (v4l2_subdev_get_selection(entity, &rect, i,
+						targets[j],
+						V4L2_SUBDEV_FORMAT_ACTIVE) == 0)
+					v4l2_subdev_set_selection(entity, &rect, i,
+						targets[j],
+						V4L2_SUBDEV_FORMAT_TRY);
+			}
+		}
+
+		flags = flags == MEDIA_PAD_FL_SINK ? MEDIA_PAD_FL_SOURCE : 0;
+	}
+}
+
+static int try_format(struct v4l2_subdev_try *try, struct media_pad *pad,
+		      const struct v4l2_mbus_framefmt *request)
+{
+	struct v4l2_mbus_framefmt format = *request;
+	int ret;
+
+	if (request->width == 0 || request->height == 0)
+		return 0;
+
+	try_seed(try, pad->entity);
+
+	ret = v4l2_subdev_set_format(pad->entity, &format, pad->index,
+				     V4L2_SUBDEV_FORMAT_TRY);
+	if (ret < 0) {
+		try_report(try, pad, "unable to try format: %s (%d)",
+			   strerror(-ret), ret);
+		return ret;
+	}
+
+	if (format.code != request->code || format.width != request->width ||
+	    format.height != request->height) {
+		try->adjusted++;
+		try_report(try, pad, "format %s/%ux%u adjusted to %s/%ux%u",
+			   v4l2_subdev_pixelcode_to_string(request->code),
+			   request->width, request->height,
+			   v4l2_subdev_pixelcode_to_string(format.code),
+			   format.width, format.height);
+	}
+
+	return 0;
+}
+
+static int try_selection(struct v4l2_subdev_try *try, struct media_pad *pad,
+			 unsigned int target, const struct v4l2_rect *request)
+{
+	struct v4l2_rect rect = *request;
+	int ret;
+
+	if (request->left == -1 || request->top == -1)
+		return 0;
+
+	try_seed(try, pad->entity);
+
+	ret = v4l2_subdev_set_selection(pad->entity, &rect, pad->index, target,
+					V4L2_SUBDEV_FORMAT_TRY);
+	if (ret < 0) {
+		try_report(try, pad, "unable to try selection target %u: %s (%d)",
+			   target, strerror(-ret), ret);
+		return ret;
+	}
+
+	if (memcmp(&rect, request, sizeof(rect))) {
+		try->adjusted++;
+		try_report(try, pad,
+			   "selection target %u (%d,%d)/%ux%u adjusted to (%d,%d)/%ux%u",
+			   target, request->left, request->top, request->width,
+			   request->height, rect.left, rect.top, rect.width,
+			   rect.height);
+	}
+
+	return 0;
+}
+
+/* Try a pad state in the order of v4l2_subdev_parse_setup_format(). */
+static int try_pad(struct v4l2_subdev_try *try,
+		   struct v4l2_subdev_pad_state *state)
+{
+	struct media_pad *pad = state->pad;
+	struct media_pad_links *plinks;
+	struct media_link *links;
+	unsigned int i;
+	int ret;
+
+	if (pad->flags & MEDIA_PAD_FL_SINK) {
+		ret = try_format(try, pad, &state->format);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = try_selection(try, pad, V4L2_SEL_TGT_CROP, &state->crop);
+	if (ret < 0)
+		return ret;
+
+	ret = try_selection(try, pad, V4L2_SEL_TGT_COMPOSE, &state->compose);
+	if (ret < 0)
+		return ret;
+
+	if (pad->flags & MEDIA_PAD_FL_SOURCE) {
+		ret = try_format(try, pad, &state->format);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!(pad->flags & MEDIA_PAD_FL_SOURCE) || pad->entity->pad_links == NULL)
+		return 0;
+
+	plinks = &pad->entity->pad_links[pad - pad->entity->pads];
+	links = &pad->entity->links[plinks->first];
+
+	for (i = 0; i < plinks->num_out; ++i) {
+		struct media_link *link = &links[i];
+
+		if (!(link->flags & MEDIA_LNK_FL_ENABLED) ||
+		    link->sink->entity->info.type != MEDIA_ENT_T_V4L2_SUBDEV)
+			continue;
+
+		/* Errors on remote pads are ignored when committing, only
+		 * report them.
+		 */
+		try_format(try, link->sink, &state->format);
+	}
+
+	return 0;
+}
+
+int v4l2_subdev_try_setup_formats(struct media_device *media, const char *p,
+				  unsigned int flags,
+				  v4l2_subdev_validate_error_t report,
+				  void *priv)
+{
+	struct v4l2_subdev_pad_state *states;
+	struct v4l2_subdev_try try;
+	unsigned int num_states;
+	unsigned int i;
+	int ret;
+
+	memset(&try, 0, sizeof(try));
+	try.media = media;
+	try.report = report;
+	try.priv = priv;
+
+	ret = v4l2_subdev_parse_pad_states(media, p, &states, &num_states);
+	if (ret < 0)
+		return ret;
+
+	try.seeded = calloc(media->entities_count, sizeof(*try.seeded));
+	if (try.seeded == NULL) {
+		free(states);
+		return -ENOMEM;
+	}
+
+	/* Closing a subdev would lose its TRY state, keep the subdevs open
+	 * until all pad states have been tried. Frame intervals have no TRY
+	 * state and are only set when committing.
+	 */
+	v4l2_subdev_hold_pool(media);
+
+	for (i = 0; i < num_states; ++i) {
+		ret = try_pad(&try, &states[i]);
+		if (ret < 0)
+			break;
+	}
+
+	v4l2_subdev_release_pool(media);
+
+	free(try.seeded);
+	free(states);
+
+	if (ret < 0)
+		return ret;
+
+	media_dbg(media, "Formats tried, %u adjustment(s)\n", try.adjusted);
+
+	if (flags & V4L2_SUBDEV_TRY_ONLY)
+		return try.adjusted;
+
+	if (flags & V4L2_SUBDEV_TRY_STRICT && try.adjusted)
+		return -EPIPE;
+
+	ret = v4l2_subdev_parse_setup_formats(media, p);
+	return ret < 0 ? ret : (int)try.adjusted;
+}
+
+int v4l2_subdev_parse_negotiate(struct media_device *media, const char *p,
+				struct v4l2_subdev_mode *result)
+{
+	struct v4l2_subdev_target target;
+	struct media_entity *entity;
+	char *end;
+	int ret;
+
+	memset(&target, 0, sizeof(target));
+
+	entity = media_parse_entity(media, p, &end);
+	if (entity == NULL)
+		return -EINVAL;
+
+	for (p = end; isspace(*p); ++p);
+	if (*p++ != '[') {
+		media_dbg(media, "Expected '['\n");
+		return -EINVAL;
+	}
+
+	for (; isspace(*p); ++p);
+	strhazit("fmt:", &p);
+
+	ret = v4l2_subdev_parse_format(media, &target.format, p, &end);
+	if (ret < 0)
+		return ret;
+
+	for (p = end; isspace(*p); ++p);
+	if (*p == '@') {
+		ret = v4l2_subdev_parse_frame_interval(media, &target.interval,
+						       ++p, &end);
+		if (ret < 0)
+			return ret;
+
+		for (p = end; isspace(*p); ++p);
+	}
+
+	if (*p != ']' || p[1] != '\0') {
+		media_dbg(media, "Expected ']'\n");
+		return -EINVAL;
+	}
+
+	return v4l2_subdev_negotiate(entity, &target, result);
+}
+
+/* -----------------------------------------------------------------------------
+ * Format propagation
+ */
+
+static bool v4l2_subdev_is_subdev(struct media_entity *entity)
+{
+	return media_entity_type(entity) == MEDIA_ENT_T_V4L2_SUBDEV;
+}
+
+/*
+ * Set the format of the remote source pad on all sink pads of the entity that
+ * are linked to a reached entity. Return 0 on success or a negative error code
+ * with *stop set to the failing pad. A format adjusted by the driver is
+ * reported as -EPIPE.
+ */
+static int v4l2_subdev_propagate_sinks(struct media_entity *entity,
+				       const bool *reached,
+				       struct media_pad **stop)
+{
+	struct media_device *media = entity->media;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < entity->num_links; ++i) {
+		struct media_link *link = &entity->links[i];
+		struct v4l2_mbus_framefmt format;
+		struct v4l2_mbus_framefmt request;
+		struct media_entity *source = link->source->entity;
+
+		if (link->sink->entity != entity ||
+		    !(link->flags & MEDIA_LNK_FL_ENABLED) ||
+		    !reached[source - media->entities])
+			continue;
+
+		ret = v4l2_subdev_get_format(source, &request,
+					     link->source->index,
+					     V4L2_SUBDEV_FORMAT_ACTIVE);
+		if (ret < 0) {
+			*stop = link->source;
+			return ret;
+		}
+
+		format = request;
+		ret = set_format(link->sink, &format, true);
+		if (ret < 0) {
+			*stop = link->sink;
+			return ret;
+		}
+
+		if (format.code != request.code ||
+		    format.width != request.width ||
+		    format.height != request.height) {
+			media_dbg(media,
+				  "Format adjusted on pad %s/%u: %s %ux%u -> %s %ux%u\n",
+				  entity->info.name, link->sink->index,
+				  v4l2_subdev_pixelcode_to_string(request.code),
+				  request.width, request.height,
+				  v4l2_subdev_pixelcode_to_string(format.code),
+				  format.width, format.height);
+			*stop = link->sink;
+			return -EPIPE;
+		}
+	}
+
+	return 0;
+}
+
+int v4l2_subdev_propagate_formats(struct media_device *media,
+				  struct media_entity *start,
+				  struct media_pad **stop)
+{
+	unsigned int *pending = NULL;
+	unsigned int *queue = NULL;
+	bool *reached = NULL;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	unsigned int count = 0;
+	unsigned int i, j;
+	struct media_pad *dummy;
+	int ret = 0;
+
+	if (stop == NULL)
+		stop = &dummy;
+	*stop = NULL;
+
+	pending = calloc(media->entities_count, sizeof(*pending));
+	queue = calloc(media->entities_count, sizeof(*queue));
+	reached = calloc(media->entities_count, sizeof(*reached));
+	if (pending == NULL || queue == NULL || reached == NULL) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	/* Find the subdevs downstream of the start entity, or all subdevs. The
+	 * queue is used as a work list.
+	 */
+	if (start) {
+		reached[start - media->entities] = true;
+		queue[tail++] = start - media->entities;
+
+		while (head < tail) {
+			struct media_entity *entity = &media->entities[queue[head++]];
+
+			for (j = 0; j < entity->num_links; ++j) {
+				struct media_link *link = &entity->links[j];
+				struct media_entity *sink = link->sink->entity;
+
+				if (link->source->entity != entity ||
+				    !(link->flags & MEDIA_LNK_FL_ENABLED) ||
+				    !v4l2_subdev_is_subdev(sink) ||
+				    reached[sink - media->entities])
+					continue;
+
+				reached[sink - media->entities] = true;
+				queue[tail++] = sink - media->entities;
+			}
+		}
+	} else {
+		for (i = 0; i < media->entities_count; ++i)
+			reached[i] = v4l2_subdev_is_subdev(&media->entities[i]);
+	}
+
+	/* Count the enabled links from reached entities arriving at every
+	 * reached entity, and process entities in topological order starting
+	 * with the ones without such links.
+	 */
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		if (!reached[i])
+			continue;
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+			struct media_entity *sink = link->sink->entity;
+
+			if (link->source->entity == entity &&
+			    link->flags & MEDIA_LNK_FL_ENABLED &&
+			    reached[sink - media->entities])
+				pending[sink - media->entities]++;
+		}
+	}
+
+	head = tail = 0;
+	for (i = 0; i < media->entities_count; ++i) {
+		if (reached[i] && pending[i] == 0)
+			queue[tail++] = i;
+	}
+
+	while (head < tail) {
+		struct media_entity *entity = &media->entities[queue[head++]];
+
+		/* Sink pad formats are set first, source pad formats are then
+		 * computed by the driver from the sink formats and selection
+		 * rectangles and read back when propagating to the next hop.
+		 */
+		ret = v4l2_subdev_propagate_sinks(entity, reached, stop);
+		if (ret < 0)
+			goto done;
+
+		count++;
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+			unsigned int next = link->sink->entity - media->entities;
+
+			if (link->source->entity != entity ||
+			    !(link->flags & MEDIA_LNK_FL_ENABLED) ||
+			    !reached[next])
+				continue;
+
+			if (--pending[next] == 0)
+				queue[tail++] = next;
+		}
+	}
+
+	/* Entities part of a loop are never ready to be processed. */
+	for (i = 0, j = 0; i < media->entities_count; ++i)
+		j += reached[i];
+
+	if (count != j) {
+		media_dbg(media, "Loop in the pipeline, %u entities not configured\n",
+			  j - count);
+		ret = -ELOOP;
+	}
+
+done:
+	free(pending);
+	free(queue);
+	free(reached);
+	return ret;
+}
+
 static struct {
 	const char *name;
 	enum v4l2_mbus_pixelcode code;
@@ -24,7 +24,9 @@
 
 #include <linux/v4l2-subdev.h>
 
+struct media_device;
 struct media_entity;
+struct v4l2_subdev_profiles;
 
 /**
  * @brief Open a sub-device.
@@ -46,6 +48,124 @@ int v4l2_subdev_open(struct media_entity *entity);
  */
 void v4l2_subdev_close(struct media_entity *entity);
 
+/**
+ * @brief Open a set of sub-devices concurrently.
+ * @param media - media device.
+ * @param entities - array of entities to open, or NULL for all entities.
+ * @param count - number of entries in the @a entities array.
+ *
+ * Open the V4L2 subdev device nodes associated with @a entities from a set of
+ * worker threads. Opening device nodes can be slow when it powers devices up,
+ * opening them in parallel lets the drivers overlap the delays. Entities that
+ * are not sub-devices or that are already open are skipped, and entities listed
+ * more than once are opened once. When the number of open file descriptors is
+ * bounded with v4l2_subdev_set_max_open(), only the first entities that fit in
+ * the limit along with the sub-devices already open are opened.
+ *
+ * @return 0 on success, or a negative error code if any device node failed to
+ * open. The other device nodes are opened regardless.
+ */
+int v4l2_subdev_open_entities(struct media_device *media,
+			      struct media_entity **entities,
+			      unsigned int count);
+
+/**
+ * @brief Bound the number of open sub-devices.
+ * @param media - media device.
+ * @param max - maximum number of open sub-devices, or 0 for no limit.
+ *
+ * Sub-device nodes are kept open once used until they're closed explicitly or
+ * the media device is released. When @a max is not zero, opening a sub-device
+ * beyond the limit closes the least recently used one first. A sub-device is
+ * considered used by every library call that accesses it.
+ *
+ * Closing a sub-device releases its TRY state and its state cache (see
+ * v4l2_subdev_enable_cache()). Operations that rely on the TRY state, such as
+ * v4l2_subdev_try_setup_formats() and v4l2_subdev_negotiate(), thus keep all
+ * sub-devices they access open until their TRY phase completes, exceeding the
+ * limit temporarily.
+ */
+void v4l2_subdev_set_max_open(struct media_device *media, unsigned int max);
+
+/**
+ * @brief Enable or disable the sub-device state cache.
+ * @param media - media device.
+ * @param enable - non-zero to enable the cache, zero to disable it.
+ *
+ * When the cache is enabled, the ACTIVE format, selection rectangles and frame
+ * interval retrieved from or set on the sub-devices of @a media are stored in
+ * the entities, and later calls to v4l2_subdev_get_format(),
+ * v4l2_subdev_get_selection() and v4l2_subdev_get_frame_interval() return the
+ * cached values without accessing the sub-device. TRY values are never cached.
+ *
+ * Sub-devices are subscribed to source change events when their cache is
+ * created. Applications are responsible for calling v4l2_subdev_handle_events()
+ * or v4l2_subdev_invalidate_cache() when the sub-device state can be modified
+ * outside of the library. Disabling the cache frees all cached values.
+ */
+void v4l2_subdev_enable_cache(struct media_device *media, int enable);
+
+/**
+ * @brief Invalidate the cached state of a sub-device.
+ * @param entity - sub-device media entity.
+ *
+ * Drop all values cached for @a entity. The next get calls will query the
+ * sub-device.
+ */
+void v4l2_subdev_invalidate_cache(struct media_entity *entity);
+
+/**
+ * @brief Process pending sub-device events.
+ * @param entity - sub-device media entity.
+ *
+ * Dequeue all events pending on the @a entity sub-device without blocking, and
+ * invalidate its cache if any event was pending. This function is meant to be
+ * called when the sub-device file descriptor is reported readable for
+ * exceptional conditions (POLLPRI).
+ *
+ * @return The number of dequeued events, or a negative error code on failure.
+ */
+int v4l2_subdev_handle_events(struct media_entity *entity);
+
+/*
+ * Number of writes skipped by the compare before write mode, see
+ * v4l2_subdev_set_compare().
+ */
+struct v4l2_subdev_skip_counts {
+	unsigned int format;
+	unsigned int selection;
+	unsigned int interval;
+};
+
+/**
+ * @brief Enable or disable compare before write.
+ * @param media - media device.
+ * @param enable - non-zero to enable compare before write, zero to disable it.
+ *
+ * When compare before write is enabled, v4l2_subdev_set_format(),
+ * v4l2_subdev_set_selection() and v4l2_subdev_set_frame_interval() read the
+ * current ACTIVE value first, and skip the write if it is identical to the
+ * requested value. The current value is taken from the sub-device state cache
+ * when enabled (see v4l2_subdev_enable_cache()), or read from the sub-device
+ * otherwise. Skipped writes succeed and return the current value.
+ *
+ * Drivers can perform side effects when a value is set, such as resetting
+ * selection rectangles when the format is set. Those side effects are skipped
+ * along with the write.
+ */
+void v4l2_subdev_set_compare(struct media_device *media, int enable);
+
+/**
+ * @brief Retrieve the number of skipped writes.
+ * @param media - media device.
+ * @param counts - skip counts to be filled.
+ *
+ * Fill @a counts with the number of writes skipped for @a media since it has
+ * been created, by compare before write or by v4l2_subdev_reconcile_formats().
+ */
+void v4l2_subdev_get_skip_counts(struct media_device *media,
+				 struct v4l2_subdev_skip_counts *counts);
+
 /**
  * @brief Retrieve the format on a pad.
  * @param entity - subdev-device media entity.
@@ -165,6 +285,30 @@ int v4l2_subdev_get_frame_interval(struct media_entity *entity,
 int v4l2_subdev_set_frame_interval(struct media_entity *entity,
 	struct v4l2_fract *interval);
 
+/* The sub-device supports the selection API. */
+#define V4L2_SUBDEV_CAP_SELECTION	(1 << 0)
+/* The sub-device supports the legacy crop API only. */
+#define V4L2_SUBDEV_CAP_CROP		(1 << 1)
+/* The sub-device supports frame intervals. */
+#define V4L2_SUBDEV_CAP_FRAME_INTERVAL	(1 << 2)
+
+/**
+ * @brief Retrieve the capabilities of a sub-device.
+ * @param entity - subdev-device media entity.
+ * @param mask - capabilities to retrieve (V4L2_SUBDEV_CAP_*).
+ *
+ * Capabilities are recorded the first time the corresponding ioctls are
+ * issued, and calls to unsupported ioctls then fail with -ENOTTY without
+ * reaching the driver. Selection rectangles other than the crop rectangle are
+ * only available with V4L2_SUBDEV_CAP_SELECTION. Capabilities in @a mask
+ * not known yet are probed by this function.
+ *
+ * @return The supported capabilities in @a mask, 0 for entities that are not
+ * sub-devices.
+ */
+unsigned int v4l2_subdev_get_caps(struct media_entity *entity,
+				  unsigned int mask);
+
 /**
  * @brief Parse a string and apply format, crop and frame interval settings.
  * @param media - media device.
@@ -181,6 +325,340 @@ int v4l2_subdev_set_frame_interval(struct media_entity *entity,
  */
 int v4l2_subdev_parse_setup_formats(struct media_device *media, const char *p);
 
+/**
+ * @brief Parse string to a desired format configuration and apply the changes.
+ * @param media - media device.
+ * @param p - input string
+ *
+ * Parse string @a p, using the same syntax as
+ * v4l2_subdev_parse_setup_formats(), as the desired format, crop, compose and
+ * frame interval configuration of subdev pads. Every property is read back
+ * from the subdev and only set when it differs from the desired value.
+ * Formats set on source pads are propagated to the connected subdev sink pads
+ * in the same way.
+ *
+ * The whole string is parsed before any property is applied.
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int v4l2_subdev_reconcile_formats(struct media_device *media, const char *p);
+
+/**
+ * @brief Parse a string and apply formats to independent pipelines in parallel.
+ * @param media - media device.
+ * @param p - input string
+ *
+ * Parse string @a p, in the syntax of v4l2_subdev_parse_setup_formats(), and
+ * apply the formats. The pad formats are split into groups of entities
+ * connected through enabled links. Groups don't influence each other and are
+ * applied concurrently from worker threads, the pad formats of a group being
+ * applied in the order of @a p. The resulting configuration is identical to
+ * the one of v4l2_subdev_parse_setup_formats().
+ *
+ * Unlike v4l2_subdev_parse_setup_formats(), the whole string is parsed before
+ * applying any format. When a group fails, no new group is started, but groups
+ * already being applied by other workers are completed. Groups are applied
+ * sequentially when the number of open sub-devices is bounded, see
+ * v4l2_subdev_set_max_open().
+ *
+ * @return 0 on success, or the error of the first group, in the order of
+ * @a p, that failed.
+ */
+int v4l2_subdev_parse_setup_formats_parallel(struct media_device *media,
+					     const char *p);
+
+/**
+ * @brief Propagate formats along enabled links.
+ * @param media - media device.
+ * @param start - entity to propagate the formats from, or NULL.
+ * @param stop - pad at which propagation stopped, can be NULL.
+ *
+ * Walk the sub-devices connected by enabled links in topological order, and
+ * set the ACTIVE format of every sink pad to the format of the remote source
+ * pad. Source pad formats are not set, they are read back from the drivers
+ * which compute them from the sink pad formats and selection rectangles.
+ * Formats already set on sink pads are not written again, preserving the
+ * selection rectangles configured on them.
+ *
+ * When @a start is NULL propagation starts at all sub-devices without enabled
+ * incoming links from other sub-devices, usually the sensors. Otherwise only
+ * the sub-devices downstream of @a start are configured.
+ *
+ * Propagation stops on the first error or format adjusted by a driver, in
+ * which case @a stop is set to the pad being configured.
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -EPIPE: a driver adjusted the format of a sink pad
+ *	   -ELOOP: enabled links form a loop
+ *	   - error codes returned by the format ioctls
+ */
+int v4l2_subdev_propagate_formats(struct media_device *media,
+				  struct media_entity *start,
+				  struct media_pad **stop);
+
+/*
+ * Mode supported by a sub-device pad: a media bus code, a frame size range and
+ * a frame interval. Frame sizes and intervals are zero when the sub-device
+ * doesn't enumerate them.
+ */
+struct v4l2_subdev_mode {
+	__u32 pad;
+	__u32 code;
+	__u32 min_width;
+	__u32 min_height;
+	__u32 max_width;
+	__u32 max_height;
+	struct v4l2_fract interval;
+};
+
+/**
+ * @brief Enumerate the modes supported by a sub-device.
+ * @param entity - sub-device media entity.
+ *
+ * Enumerate the media bus codes, frame sizes and frame intervals supported on
+ * all pads of @a entity, and store them in the entity, replacing the previously
+ * enumerated modes. One mode is stored for every combination of code, frame
+ * size and frame interval.
+ *
+ * @return The number of modes on success, or a negative error code on failure.
+ */
+int v4l2_subdev_enum_modes(struct media_entity *entity);
+
+/**
+ * @brief Retrieve the modes supported on a pad.
+ * @param entity - sub-device media entity.
+ * @param pad - pad number.
+ * @param modes - pointer to the modes array.
+ * @param num_modes - number of modes in the array.
+ *
+ * Retrieve the modes supported on the @a entity @a pad. Modes are enumerated
+ * once with v4l2_subdev_enum_modes() and stored in the entity. When the
+ * topology cache is enabled (see media_device_set_cache()), modes are also
+ * stored in the cache directory and loaded from there on the next run.
+ *
+ * The @a modes array is owned by the entity, and is valid until the modes are
+ * enumerated again or the media device is freed.
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int v4l2_subdev_get_modes(struct media_entity *entity, unsigned int pad,
+			  const struct v4l2_subdev_mode **modes,
+			  unsigned int *num_modes);
+
+/*
+ * Negotiation target: the format to be output to a video node, with a zero
+ * code to accept any code, and the maximum frame interval, zero to accept any
+ * frame rate.
+ */
+struct v4l2_subdev_target {
+	struct v4l2_mbus_framefmt format;
+	struct v4l2_fract interval;
+};
+
+/**
+ * @brief Configure a pipeline to output a target format.
+ * @param output - entity at the end of the pipeline, usually a video node.
+ * @param target - target format and frame interval.
+ * @param result - sensor mode selected by the negotiation, can be NULL.
+ *
+ * Find the chain of sub-devices connected by enabled links upstream of
+ * @a output, and select the sensor mode that can produce the @a target format
+ * with the lowest pixel rate. Sensor modes are pruned using the modes supported
+ * by the sensor and the first processing sub-device (see
+ * v4l2_subdev_get_modes()), assuming that the pipeline can scale down but not
+ * up.
+ *
+ * Candidate modes are validated on the TRY formats, propagating the sensor
+ * format to the last sub-device, which scales to the target size through its
+ * source pad format or its sink compose rectangle. The first valid candidate is
+ * then applied to the ACTIVE formats, and its frame interval set on the sensor.
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -EINVAL: no sub-device pipeline upstream of @a output
+ *	   -ERANGE: no sensor mode meets the target
+ *	   - error codes returned by the format ioctls
+ */
+int v4l2_subdev_negotiate(struct media_entity *output,
+			  const struct v4l2_subdev_target *target,
+			  struct v4l2_subdev_mode *result);
+
+/**
+ * @brief Parse a negotiation target and configure the pipeline.
+ * @param media - media device.
+ * @param p - target description.
+ * @param result - sensor mode selected by the negotiation, can be NULL.
+ *
+ * Parse the @a p target description, in the form
+ * entity '[' v4l2-mbusfmt [ v4l2-interval ] ']', and configure the pipeline
+ * with v4l2_subdev_negotiate().
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int v4l2_subdev_parse_negotiate(struct media_device *media, const char *p,
+				struct v4l2_subdev_mode *result);
+
+/* Validate the configuration from a state with all links reset. */
+#define V4L2_SUBDEV_VALIDATE_RESET	(1 << 0)
+
+typedef void (*v4l2_subdev_validate_error_t)(void *priv,
+					     struct media_pad *pad,
+					     const char *message);
+
+/**
+ * @brief Validate a pipeline configuration offline.
+ * @param media - media device.
+ * @param links - comma-separated list of link descriptors, or NULL.
+ * @param formats - comma-separated list of format descriptors, or NULL.
+ * @param flags - validation flags (V4L2_SUBDEV_VALIDATE_*).
+ * @param error - function called for every error found, or NULL.
+ * @param priv - private data passed to the @a error function.
+ *
+ * Check whether applying @a links and @a formats, in the syntax of
+ * media_parse_setup_links() and v4l2_subdev_parse_setup_formats(), would
+ * result in a consistent pipeline. The configuration is applied to a model of
+ * the enumerated graph only, no ioctl is issued.
+ *
+ * The following errors are reported:
+ * - immutable links whose state would change
+ * - sink pads with more than one enabled link
+ * - formats differing across an enabled link between two subdevs
+ * - crop rectangles not contained in the sink pad format
+ *
+ * Formats not set by @a formats, either explicitly or through propagation to
+ * the remote sink pads of a source pad, are taken from the sub-device state
+ * cache when available (see v4l2_subdev_enable_cache()) and are otherwise not
+ * checked.
+ *
+ * @return The number of errors found, or a negative error code if the
+ * configuration can't be parsed.
+ */
+int v4l2_subdev_validate_pipeline(struct media_device *media,
+				  const char *links, const char *formats,
+				  unsigned int flags,
+				  v4l2_subdev_validate_error_t error, void *priv);
+
+/* Stop after the TRY phase, don't commit the formats. */
+#define V4L2_SUBDEV_TRY_ONLY		(1 << 0)
+/* Don't commit the formats if the driver adjusted any of them. */
+#define V4L2_SUBDEV_TRY_STRICT		(1 << 1)
+
+/**
+ * @brief Try formats on a pipeline before applying them.
+ * @param media - media device.
+ * @param p - comma-separated list of format descriptors.
+ * @param flags - setup flags (V4L2_SUBDEV_TRY_*).
+ * @param report - function called for every adjustment or error, or NULL.
+ * @param priv - private data passed to the @a report function.
+ *
+ * Apply all formats and selection rectangles of @a p, in the syntax of
+ * v4l2_subdev_parse_setup_formats(), to the TRY state of the sub-devices, and
+ * report every value adjusted by the drivers. The TRY state of each sub-device
+ * is initialized from its ACTIVE state first. When the TRY phase succeeds, and
+ * unless disallowed by @a flags, the formats are then applied to the ACTIVE
+ * state with v4l2_subdev_parse_setup_formats().
+ *
+ * Frame intervals have no TRY state and are only applied when committing.
+ *
+ * @return The number of adjustments on success, -EPIPE if formats were
+ * adjusted with V4L2_SUBDEV_TRY_STRICT, or another negative error code on
+ * failure. The ACTIVE state is left untouched when the TRY phase fails.
+ */
+int v4l2_subdev_try_setup_formats(struct media_device *media, const char *p,
+				  unsigned int flags,
+				  v4l2_subdev_validate_error_t report,
+				  void *priv);
+
+/**
+ * @brief Create a set of pipeline profiles.
+ * @param media - media device.
+ *
+ * A pipeline profile is a named configuration made of the complete set of
+ * enabled links and of the formats of subdev pads. Profiles are resolved to
+ * link and pad handles of @a media when added, the media device must thus be
+ * enumerated first, and must not be enumerated again while the profiles are
+ * in use.
+ *
+ * @return A pointer to the new profile set, or NULL if memory can't be
+ * allocated.
+ */
+struct v4l2_subdev_profiles *
+v4l2_subdev_profiles_new(struct media_device *media);
+
+/**
+ * @brief Free a set of pipeline profiles.
+ * @param profiles - profile set.
+ */
+void v4l2_subdev_profiles_free(struct v4l2_subdev_profiles *profiles);
+
+/**
+ * @brief Add a pipeline profile.
+ * @param profiles - profile set.
+ * @param name - profile name.
+ * @param links - links to be enabled, in media_parse_setup_links() syntax.
+ * @param formats - pad formats, in v4l2_subdev_parse_setup_formats() syntax.
+ *
+ * Parse the @a links and @a formats strings and store the resolved profile in
+ * the set. Both strings can be NULL or empty. Formats listed for the same pad
+ * are merged, later properties replacing earlier ones.
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -EEXIST: a profile with the same name already exists
+ *	   -EINVAL: the links or formats can't be parsed
+ *	   -ENOMEM: out of memory
+ */
+int v4l2_subdev_profiles_add(struct v4l2_subdev_profiles *profiles,
+			     const char *name, const char *links,
+			     const char *formats);
+
+/**
+ * @brief Load pipeline profiles from a file.
+ * @param profiles - profile set.
+ * @param filename - profile file name.
+ *
+ * Profiles are stored in an INI-like file, with one section per profile named
+ * after the profile. Sections contain 'links' and 'formats' keys, whose values
+ * use the v4l2_subdev_profiles_add() syntax. Keys can be repeated, values are
+ * then concatenated. Empty lines and lines starting with '#' or ';' are
+ * ignored.
+ *
+ *	[preview]
+ *	links = "sensor":0->"ccdc":0[1], "ccdc":1->"ccdc output":0[1]
+ *	formats = "sensor":0[fmt:SGRBG10/1280x720]
+ *
+ * @return 0 on success, or a negative error code on failure.
+ */
+int v4l2_subdev_profiles_load(struct v4l2_subdev_profiles *profiles,
+			      const char *filename);
+
+/**
+ * @brief Switch to a pipeline profile.
+ * @param profiles - profile set.
+ * @param name - profile name.
+ *
+ * Configure the pipeline according to profile @a name. The profile links are
+ * the complete set of enabled links, all other links that are not immutable
+ * are disabled, and only links whose state changes are set up. Pad states
+ * identical to the ones of the currently active profile are skipped without
+ * any ioctl as long as no link or property has changed. Other pad states are
+ * reconciled as by v4l2_subdev_reconcile_formats().
+ *
+ * @return 0 on success, or a negative error code on failure:
+ *	   -ENOENT: no profile named @a name
+ *	   - error codes returned by the link and format ioctls
+ */
+int v4l2_subdev_profiles_apply(struct v4l2_subdev_profiles *profiles,
+			       const char *name);
+
+/**
+ * @brief Get the name of the active profile.
+ * @param profiles - profile set.
+ *
+ * @return The name of the last profile successfully applied, or NULL if no
+ * profile has been applied or the last switch failed.
+ */
+const char *
+v4l2_subdev_profiles_get_active(struct v4l2_subdev_profiles *profiles);
+
 /**
  * @brief Convert media bus pixel code to string.
  * @param code - input string
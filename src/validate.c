@@ -0,0 +1,344 @@
+/*
+ * V4L2 subdev interface library - offline pipeline validation
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mediactl.h"
+#include "mediactl-priv.h"
+#include "tools.h"
+#include "v4l2subdev.h"
+
+/*
+ * The validator models the pipeline state that would result from applying the
+ * configuration: the flags of every link, stored for the copy of the link in
+ * the source entity, and the format and crop rectangle of every pad when known.
+ * Nothing is read from or written to the devices.
+ */
+struct media_validator {
+	struct media_device *media;
+	v4l2_subdev_validate_error_t error;
+	void *priv;
+	unsigned int errors;
+
+	unsigned int *link_base;
+	__u32 *link_flags;
+
+	unsigned int *pad_base;
+	struct v4l2_subdev_pad_state *pads;
+};
+
+static void media_validate_error(struct media_validator *v,
+				 struct media_pad *pad, const char *fmt, ...)
+{
+	char message[160];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+
+	media_dbg(v->media, "%s/%u: %s\n", pad->entity->info.name, pad->index,
+		  message);
+
+	v->errors++;
+	if (v->error)
+		v->error(v->priv, pad, message);
+}
+
+static __u32 *media_validate_link_flags(struct media_validator *v,
+					struct media_link *link)
+{
+	struct media_entity *source = link->source->entity;
+
+	/* Use the copy of the link stored in the source entity. */
+	if (link < source->links || link >= source->links + source->num_links)
+		link = link->twin;
+
+	return &v->link_flags[v->link_base[source - v->media->entities] +
+			      (link - source->links)];
+}
+
+static struct v4l2_subdev_pad_state *
+media_validate_pad(struct media_validator *v, struct media_pad *pad)
+{
+	struct media_entity *entity = pad->entity;
+
+	return &v->pads[v->pad_base[entity - v->media->entities] + pad->index];
+}
+
+static int media_validate_init(struct media_validator *v, unsigned int flags)
+{
+	struct media_device *media = v->media;
+	unsigned int num_links = 0;
+	unsigned int num_pads = 0;
+	unsigned int i, j;
+
+	v->link_base = calloc(media->entities_count, sizeof(*v->link_base));
+	v->pad_base = calloc(media->entities_count, sizeof(*v->pad_base));
+	if (v->link_base == NULL || v->pad_base == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		v->link_base[i] = num_links;
+		v->pad_base[i] = num_pads;
+		num_links += media->entities[i].num_links;
+		num_pads += media->entities[i].info.pads;
+	}
+
+	v->link_flags = calloc(num_links ? num_links : 1,
+			       sizeof(*v->link_flags));
+	v->pads = calloc(num_pads ? num_pads : 1, sizeof(*v->pads));
+	if (v->link_flags == NULL || v->pads == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+		__u32 *link_flags = &v->link_flags[v->link_base[i]];
+		struct v4l2_subdev_pad_state *pads = &v->pads[v->pad_base[i]];
+
+		for (j = 0; j < entity->num_links; ++j) {
+			link_flags[j] = entity->links[j].flags;
+
+			if (flags & V4L2_SUBDEV_VALIDATE_RESET &&
+			    !(link_flags[j] & MEDIA_LNK_FL_IMMUTABLE))
+				link_flags[j] &= ~MEDIA_LNK_FL_ENABLED;
+		}
+
+		/* Formats are unknown unless present in the subdev cache. */
+		for (j = 0; j < entity->info.pads; ++j) {
+			struct v4l2_subdev_pad_state *state = &pads[j];
+
+			state->pad = &entity->pads[j];
+			state->crop.left = -1;
+			state->compose.left = -1;
+
+			if (entity->cache &&
+			    entity->cache->pads[j].valid & V4L2_SUBDEV_CACHE_FORMAT)
+				state->format = entity->cache->pads[j].format;
+		}
+	}
+
+	return 0;
+}
+
+static int media_validate_apply_links(struct media_validator *v,
+				      const char *p)
+{
+	struct media_link_setup *setups;
+	unsigned int num_setups;
+	unsigned int i;
+	int ret;
+
+	ret = media_parse_links(v->media, p, &setups, &num_setups);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < num_setups; ++i) {
+		struct media_link *link = setups[i].link;
+		__u32 *flags = media_validate_link_flags(v, link);
+
+		if ((*flags ^ setups[i].flags) & MEDIA_LNK_FL_ENABLED &&
+		    *flags & MEDIA_LNK_FL_IMMUTABLE) {
+			media_validate_error(v, link->sink,
+				"immutable link from \"%s\":%u can't be %s",
+				link->source->entity->info.name,
+				link->source->index,
+				*flags & MEDIA_LNK_FL_ENABLED ?
+				"disabled" : "enabled");
+			continue;
+		}
+
+		*flags = (*flags & ~MEDIA_LNK_FL_ENABLED) |
+			 (setups[i].flags & MEDIA_LNK_FL_ENABLED);
+	}
+
+	free(setups);
+	return 0;
+}
+
+/*
+ * Record the formats and rectangles of the configuration, propagating source
+ * formats to the remote sink pads as v4l2_subdev_parse_setup_formats() does.
+ */
+static int media_validate_apply_formats(struct media_validator *v,
+					const char *p)
+{
+	struct v4l2_subdev_pad_state *states;
+	unsigned int num_states;
+	unsigned int i, j;
+	int ret;
+
+	ret = v4l2_subdev_parse_pad_states(v->media, p, &states, &num_states);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < num_states; ++i) {
+		struct v4l2_subdev_pad_state *state = &states[i];
+		struct v4l2_subdev_pad_state *model;
+		struct media_entity *entity = state->pad->entity;
+
+		model = media_validate_pad(v, state->pad);
+		if (state->format.width && state->format.height)
+			model->format = state->format;
+		if (state->crop.left != -1)
+			model->crop = state->crop;
+		if (state->compose.left != -1)
+			model->compose = state->compose;
+
+		if (!(state->pad->flags & MEDIA_PAD_FL_SOURCE) ||
+		    !state->format.width || !state->format.height)
+			continue;
+
+		for (j = 0; j < entity->num_links; ++j) {
+			struct media_link *link = &entity->links[j];
+
+			if (link->source != state->pad ||
+			    !(*media_validate_link_flags(v, link) &
+			      MEDIA_LNK_FL_ENABLED) ||
+			    media_entity_type(link->sink->entity) !=
+			    MEDIA_ENT_T_V4L2_SUBDEV)
+				continue;
+
+			media_validate_pad(v, link->sink)->format = state->format;
+		}
+	}
+
+	free(states);
+	return 0;
+}
+
+static void media_validate_sink(struct media_validator *v,
+				struct media_pad *pad)
+{
+	struct media_entity *entity = pad->entity;
+	struct v4l2_subdev_pad_state *model = media_validate_pad(v, pad);
+	struct media_pad *source = NULL;
+	unsigned int sources = 0;
+	unsigned int i;
+
+	for (i = 0; i < entity->num_links; ++i) {
+		struct media_link *link = &entity->links[i];
+
+		if (link->sink != pad ||
+		    !(*media_validate_link_flags(v, link) & MEDIA_LNK_FL_ENABLED))
+			continue;
+
+		source = link->source;
+		sources++;
+	}
+
+	if (sources > 1)
+		media_validate_error(v, pad, "%u enabled links", sources);
+
+	if (media_entity_type(entity) != MEDIA_ENT_T_V4L2_SUBDEV)
+		return;
+
+	/* Formats must match across enabled links between subdevs. */
+	if (sources == 1 &&
+	    media_entity_type(source->entity) == MEDIA_ENT_T_V4L2_SUBDEV) {
+		struct v4l2_mbus_framefmt *format = &model->format;
+		struct v4l2_mbus_framefmt *remote =
+			&media_validate_pad(v, source)->format;
+
+		if (format->width && remote->width &&
+		    (format->code != remote->code ||
+		     format->width != remote->width ||
+		     format->height != remote->height))
+			media_validate_error(v, pad,
+				"format %s/%ux%u doesn't match \"%s\":%u %s/%ux%u",
+				v4l2_subdev_pixelcode_to_string(format->code),
+				format->width, format->height,
+				source->entity->info.name, source->index,
+				v4l2_subdev_pixelcode_to_string(remote->code),
+				remote->width, remote->height);
+	}
+
+	/* The crop rectangle must be inside the sink format. */
+	if (model->crop.left != -1 && model->format.width) {
+		struct v4l2_rect *crop = &model->crop;
+
+		if (crop->left < 0 || crop->top < 0 ||
+		    crop->width == 0 || crop->height == 0 ||
+		    (__u64)crop->left + crop->width > model->format.width ||
+		    (__u64)crop->top + crop->height > model->format.height)
+			media_validate_error(v, pad,
+				"crop (%d,%d)/%ux%u outside of %ux%u",
+				crop->left, crop->top, crop->width,
+				crop->height, model->format.width,
+				model->format.height);
+	}
+}
+
+int v4l2_subdev_validate_pipeline(struct media_device *media,
+				  const char *links, const char *formats,
+				  unsigned int flags,
+				  v4l2_subdev_validate_error_t error, void *priv)
+{
+	struct media_validator v;
+	unsigned int i, j;
+	int ret;
+
+	memset(&v, 0, sizeof(v));
+	v.media = media;
+	v.error = error;
+	v.priv = priv;
+
+	ret = media_validate_init(&v, flags);
+	if (ret < 0)
+		goto done;
+
+	if (links && *links) {
+		ret = media_validate_apply_links(&v, links);
+		if (ret < 0)
+			goto done;
+	}
+
+	if (formats && *formats) {
+		ret = media_validate_apply_formats(&v, formats);
+		if (ret < 0)
+			goto done;
+	}
+
+	for (i = 0; i < media->entities_count; ++i) {
+		struct media_entity *entity = &media->entities[i];
+
+		for (j = 0; j < entity->info.pads; ++j) {
+			if (entity->pads[j].flags & MEDIA_PAD_FL_SINK)
+				media_validate_sink(&v, &entity->pads[j]);
+		}
+	}
+
+	ret = v.errors;
+
+done:
+	free(v.link_base);
+	free(v.link_flags);
+	free(v.pad_base);
+	free(v.pads);
+	return ret;
+}
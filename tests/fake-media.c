@@ -0,0 +1,293 @@
+/*
+ * Media controller test suite - fake media device
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/media.h>
+
+#include "fake-media.h"
+
+/*
+ * The fake device exposes a chain of subdevs terminated by a video device
+ * node. Subdev n (with n starting at 1) has one sink pad and two source pads.
+ * Source pad 1 is linked to the sink pad of subdev n + 1 through an enabled
+ * link, and source pad 2 to the sink pad of subdev n + 2 through a disabled
+ * link. The last subdev is linked to the video node with an immutable link.
+ * Optional unlinked subdevs with a single sink pad follow the video node.
+ *
+ * Links are reported in reverse pad order to exercise link sorting. Link setup
+ * updates the link flags, and can be made to fail to test error handling.
+ *
+ * The open() and ioctl() functions below override the C library ones for the
+ * test program. Calls for other files are forwarded to the kernel.
+ */
+static unsigned int fake_subdevs;
+static unsigned int fake_orphans;
+static int fake_fd = -1;
+static unsigned long fake_ioctls;
+static unsigned int fake_setups_left;
+
+/* Flags of the links from source pads 1 and 2 of every subdev. */
+static __u32 fake_flags[FAKE_MEDIA_MAX_SUBDEVS + 1][2];
+
+void fake_media_init(unsigned int num_subdevs)
+{
+	unsigned int i;
+
+	if (num_subdevs > FAKE_MEDIA_MAX_SUBDEVS)
+		num_subdevs = FAKE_MEDIA_MAX_SUBDEVS;
+
+	fake_subdevs = num_subdevs;
+	fake_orphans = 0;
+	fake_ioctls = 0;
+	fake_setups_left = ~0U;
+
+	for (i = 1; i <= num_subdevs; ++i) {
+		fake_flags[i][0] = i == num_subdevs ?
+				   MEDIA_LNK_FL_ENABLED | MEDIA_LNK_FL_IMMUTABLE :
+				   MEDIA_LNK_FL_ENABLED;
+		fake_flags[i][1] = 0;
+	}
+}
+
+void fake_media_add_orphans(unsigned int count)
+{
+	fake_orphans = count;
+}
+
+void fake_media_fail_setup(unsigned int count)
+{
+	fake_setups_left = count;
+}
+
+__u32 fake_media_link_flags(__u32 id, unsigned int pad)
+{
+	return fake_flags[id][pad - 1];
+}
+
+unsigned long fake_media_ioctl_count(void)
+{
+	return fake_ioctls;
+}
+
+unsigned int fake_media_num_links(__u32 id)
+{
+	if (id > fake_subdevs)
+		return 0;
+
+	return id + 2 <= fake_subdevs ? 2 : 1;
+}
+
+static int fake_enum_entities(struct media_entity_desc *desc)
+{
+	__u32 id = desc->id;
+
+	if (id & MEDIA_ENT_ID_FLAG_NEXT)
+		id = (id & ~MEDIA_ENT_ID_FLAG_NEXT) + 1;
+
+	if (id == 0 || id > fake_subdevs + 1 + fake_orphans)
+		return -EINVAL;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->id = id;
+
+	if (id <= fake_subdevs) {
+		snprintf(desc->name, sizeof(desc->name), "subdev %u", id);
+		desc->type = MEDIA_ENT_T_V4L2_SUBDEV;
+		desc->pads = 3;
+	} else if (id == fake_subdevs + 1) {
+		snprintf(desc->name, sizeof(desc->name), "video");
+		desc->type = MEDIA_ENT_T_DEVNODE_V4L;
+		desc->pads = 1;
+	} else {
+		snprintf(desc->name, sizeof(desc->name), "orphan %u", id);
+		desc->type = MEDIA_ENT_T_V4L2_SUBDEV;
+		desc->pads = 1;
+	}
+
+	desc->links = fake_media_num_links(id);
+	return 0;
+}
+
+static void fake_link(struct media_link_desc *link, __u32 source, __u16 pad,
+		      __u32 sink, __u32 flags)
+{
+	memset(link, 0, sizeof(*link));
+	link->source.entity = source;
+	link->source.index = pad;
+	link->source.flags = MEDIA_PAD_FL_SOURCE;
+	link->sink.entity = sink;
+	link->sink.index = 0;
+	link->sink.flags = MEDIA_PAD_FL_SINK;
+	link->flags = flags;
+}
+
+static int fake_enum_links(struct media_links_enum *links)
+{
+	__u32 id = links->entity;
+	unsigned int num_pads;
+	unsigned int i;
+
+	if (id == 0 || id > fake_subdevs + 1 + fake_orphans)
+		return -EINVAL;
+
+	num_pads = id <= fake_subdevs ? 3 : 1;
+
+	if (links->pads) {
+		for (i = 0; i < num_pads; ++i) {
+			memset(&links->pads[i], 0, sizeof(links->pads[i]));
+			links->pads[i].entity = id;
+			links->pads[i].index = i;
+			links->pads[i].flags = i == 0 ? MEDIA_PAD_FL_SINK
+					     : MEDIA_PAD_FL_SOURCE;
+		}
+	}
+
+	if (links->links == NULL || id > fake_subdevs)
+		return 0;
+
+	i = 0;
+	if (id + 2 <= fake_subdevs)
+		fake_link(&links->links[i++], id, 2, id + 2, fake_flags[id][1]);
+
+	fake_link(&links->links[i++], id, 1, id + 1, fake_flags[id][0]);
+	return 0;
+}
+
+static int fake_setup_link(struct media_link_desc *link)
+{
+	__u32 id = link->source.entity;
+	unsigned int pad = link->source.index;
+	__u32 *flags;
+
+	if (id == 0 || id > fake_subdevs || pad < 1 || pad > 2 ||
+	    link->sink.entity != id + pad || link->sink.index != 0)
+		return -EINVAL;
+
+	flags = &fake_flags[id][pad - 1];
+	if (*flags & MEDIA_LNK_FL_IMMUTABLE)
+		return -EINVAL;
+
+	if (fake_setups_left == 0) {
+		fake_setups_left = ~0U;
+		return -EIO;
+	}
+
+	fake_setups_left--;
+	*flags = link->flags & MEDIA_LNK_FL_ENABLED;
+	link->flags = *flags;
+	return 0;
+}
+
+static int fake_open(const char *path, int flags, mode_t mode)
+{
+	int fd;
+
+	if (strcmp(path, FAKE_MEDIA_DEVNODE)) {
+		fd = syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+		/* The fake device has been closed and its fd reused. */
+		if (fd == fake_fd)
+			fake_fd = -1;
+		return fd;
+	}
+
+	fd = syscall(SYS_openat, AT_FDCWD, "/dev/null", O_RDWR);
+	if (fd >= 0)
+		fake_fd = fd;
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	va_start(ap, flags);
+	if (flags & O_CREAT)
+		mode = va_arg(ap, mode_t);
+	va_end(ap);
+
+	return fake_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	va_start(ap, flags);
+	if (flags & O_CREAT)
+		mode = va_arg(ap, mode_t);
+	va_end(ap);
+
+	return fake_open(path, flags, mode);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	void *arg;
+	va_list ap;
+	int ret;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (fd != fake_fd)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	fake_ioctls++;
+
+	switch (request) {
+	case MEDIA_IOC_DEVICE_INFO:
+		memset(arg, 0, sizeof(struct media_device_info));
+		strcpy(((struct media_device_info *)arg)->driver, "fake");
+		ret = 0;
+		break;
+	case MEDIA_IOC_ENUM_ENTITIES:
+		ret = fake_enum_entities(arg);
+		break;
+	case MEDIA_IOC_ENUM_LINKS:
+		ret = fake_enum_links(arg);
+		break;
+	case MEDIA_IOC_SETUP_LINK:
+		ret = fake_setup_link(arg);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
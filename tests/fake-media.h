@@ -0,0 +1,44 @@
+/*
+ * Media controller test suite - fake media device
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __FAKE_MEDIA_H__
+#define __FAKE_MEDIA_H__
+
+#include <linux/types.h>
+
+#define FAKE_MEDIA_DEVNODE	"/dev/fake-media"
+#define FAKE_MEDIA_MAX_SUBDEVS	1024
+
+/* Create a fake device with a chain of num_subdevs subdevs. */
+void fake_media_init(unsigned int num_subdevs);
+/* Add count unlinked subdevs after the video node, until the next init. */
+void fake_media_add_orphans(unsigned int count);
+/* Return the number of ioctls issued on the fake device since init. */
+unsigned long fake_media_ioctl_count(void);
+/* Return the number of outbound links of the entity with the given ID. */
+unsigned int fake_media_num_links(__u32 id);
+/* Fail the link setup following the next count successful setups with -EIO. */
+void fake_media_fail_setup(unsigned int count);
+/* Return the flags of the link from the given source pad of a subdev. */
+__u32 fake_media_link_flags(__u32 id, unsigned int pad);
+
+#endif /* __FAKE_MEDIA_H__ */
@@ -0,0 +1,512 @@
+/*
+ * Media controller test suite - graph and entity lookups
+ *
+ * Copyright (C) 2010-2011 Ideas on board SPRL
+ *
+ * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/media.h>
+
+#include "fake-media.h"
+#include "mediactl.h"
+
+/*
+ * Enumerate a fake media device and verify the graph, the entity lookups by ID
+ * and name, the per-pad links, the route finder, the link setup transactions
+ * and the topology cache. With -b the enumeration and the lookups are also
+ * timed, giving a benchmark that can be compared across changes:
+ *
+ *	graph-test [-b] [-n subdevs] [-i iterations]
+ */
+
+static unsigned int failures;
+
+#define check(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "FAIL: " __VA_ARGS__);		\
+			fprintf(stderr, "\n");				\
+			failures++;					\
+		}							\
+	} while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct media_device *enumerate(unsigned int num_subdevs)
+{
+	struct media_device *media;
+	int ret;
+
+	fake_media_init(num_subdevs);
+
+	media = media_device_new(FAKE_MEDIA_DEVNODE);
+	if (media == NULL)
+		return NULL;
+
+	/* Device names are resolved through sysfs, skip them. */
+	media_device_set_lazy_devnames(media, 1);
+
+	ret = media_device_enumerate(media);
+	if (ret < 0) {
+		fprintf(stderr, "FAIL: enumeration failed (%d)\n", ret);
+		media_device_unref(media);
+		return NULL;
+	}
+
+	return media;
+}
+
+static void test_entities(struct media_device *media, unsigned int num_subdevs)
+{
+	unsigned int count = media_get_entities_count(media);
+	unsigned int i;
+
+	check(count == num_subdevs + 1, "%u entities, expected %u", count,
+	      num_subdevs + 1);
+
+	for (i = 0; i < count; ++i) {
+		struct media_entity *entity = media_get_entity(media, i);
+		const struct media_entity_desc *info;
+
+		info = media_entity_get_info(entity);
+
+		check(media_get_entity_by_id(media, info->id) == entity,
+		      "lookup of entity ID %u", info->id);
+		check(media_get_entity_by_name(media, info->name,
+					       strlen(info->name)) == entity,
+		      "lookup of entity '%s'", info->name);
+	}
+
+	check(media_get_entity_by_id(media, num_subdevs + 2) == NULL,
+	      "lookup of unknown entity ID");
+	check(media_get_entity_by_name(media, "subdev", 6) == NULL,
+	      "lookup of entity name prefix");
+	check(media_get_entity_by_name(media, "subdev 1x", 9) == NULL,
+	      "lookup of unknown entity name");
+}
+
+static void test_links(struct media_device *media, unsigned int num_subdevs)
+{
+	unsigned int i;
+
+	for (i = 1; i <= num_subdevs; ++i) {
+		struct media_entity *entity = media_get_entity_by_id(media, i);
+		struct media_pad *sink, *source, *remote;
+		unsigned int inbound = (i > 1) + (i > 2);
+		unsigned int links;
+
+		links = media_entity_get_links_count(entity);
+		check(links == fake_media_num_links(i) + inbound,
+		      "subdev %u has %u links, expected %u", i, links,
+		      fake_media_num_links(i) + inbound);
+
+		/* Links of an entity are sorted by pad. */
+		if (links)
+			check(media_entity_get_link(entity, 0)->sink->entity ==
+			      entity || i == 1,
+			      "subdev %u links are not sorted by pad", i);
+
+		sink = (struct media_pad *)media_entity_get_pad(entity, 0);
+		source = (struct media_pad *)media_entity_get_pad(entity, 1);
+
+		check(media_pad_get_links_count(sink) == inbound,
+		      "subdev %u sink pad has %u links, expected %u", i,
+		      media_pad_get_links_count(sink), inbound);
+		check(media_pad_get_links_count(source) == 1,
+		      "subdev %u source pad has %u links, expected 1", i,
+		      media_pad_get_links_count(source));
+
+		/* Only the link from the previous subdev is enabled. */
+		remote = media_entity_remote_source(sink);
+		if (i == 1)
+			check(remote == NULL, "subdev 1 has a remote source");
+		else
+			check(remote && remote->index == 1 &&
+			      media_entity_get_info(remote->entity)->id == i - 1,
+			      "subdev %u remote source", i);
+
+		check(media_pad_get_enabled_links(source, NULL, 0) == 1,
+		      "subdev %u source pad enabled links", i);
+	}
+}
+
+static struct media_pad *pad(struct media_device *media, __u32 id,
+			     unsigned int index)
+{
+	struct media_entity *entity = media_get_entity_by_id(media, id);
+
+	return (struct media_pad *)media_entity_get_pad(entity, index);
+}
+
+/* Check the library and device flags of the links from a source pad. */
+static unsigned int check_links(struct media_device *media,
+				unsigned int num_subdevs, unsigned int index,
+				__u32 expected)
+{
+	unsigned int errors = 0;
+	unsigned int i;
+
+	for (i = 1; i + index <= num_subdevs; ++i) {
+		struct media_link *link =
+			media_pad_get_link(pad(media, i, index), 0);
+		__u32 flags = fake_media_link_flags(i, index);
+
+		if ((link->flags & MEDIA_LNK_FL_ENABLED) !=
+		    (flags & MEDIA_LNK_FL_ENABLED) ||
+		    (flags & MEDIA_LNK_FL_ENABLED) != expected)
+			errors++;
+	}
+
+	return errors;
+}
+
+/*
+ * Swap the enabled links from pad 1 to pad 2 of every subdev but the last one
+ * in a single transaction, staging every link twice.
+ */
+static int swap_links(struct media_device *media, unsigned int num_subdevs)
+{
+	unsigned int i;
+	int ret;
+
+	ret = media_links_begin(media);
+	if (ret < 0)
+		return ret;
+
+	check(media_links_begin(media) == -EBUSY, "nested transaction");
+
+	for (i = 1; i < num_subdevs; ++i) {
+		media_links_stage(media, pad(media, i, 1), pad(media, i + 1, 0),
+				  MEDIA_LNK_FL_ENABLED);
+		media_links_stage(media, pad(media, i, 1), pad(media, i + 1, 0),
+				  0);
+
+		if (i + 2 > num_subdevs)
+			continue;
+
+		media_links_stage(media, pad(media, i, 2), pad(media, i + 2, 0),
+				  0);
+		media_links_stage(media, pad(media, i, 2), pad(media, i + 2, 0),
+				  MEDIA_LNK_FL_ENABLED);
+	}
+
+	return media_links_commit(media, NULL, NULL);
+}
+
+static void test_transaction(unsigned int num_subdevs)
+{
+	struct media_device *media;
+	unsigned int errors;
+	int ret;
+
+	media = enumerate(num_subdevs);
+	if (media == NULL) {
+		failures++;
+		return;
+	}
+
+	/* A failed commit restores the links changed before the failure. */
+	fake_media_fail_setup(num_subdevs / 2);
+	ret = swap_links(media, num_subdevs);
+	check(ret == -EIO, "failed commit returned %d", ret);
+
+	errors = check_links(media, num_subdevs, 1, MEDIA_LNK_FL_ENABLED)
+	       + check_links(media, num_subdevs, 2, 0);
+	check(errors == 0, "%u links not restored", errors);
+
+	fake_media_fail_setup(~0U);
+	ret = swap_links(media, num_subdevs);
+	check(ret == 0, "commit returned %d", ret);
+
+	/* The link from the last subdev is immutable. */
+	errors = check_links(media, num_subdevs - 1, 1, 0)
+	       + check_links(media, num_subdevs, 2, MEDIA_LNK_FL_ENABLED);
+	check(errors == 0, "%u links not swapped", errors);
+
+	media_device_unref(media);
+}
+
+/*
+ * A route through the disabled link from pad 2 of subdev 1 to subdev 3 first
+ * disables the link arriving at subdev 3 from subdev 2.
+ */
+static void test_route(struct media_device *media)
+{
+	struct media_link_setup *changes;
+	unsigned int num_changes;
+	int ret;
+
+	ret = media_find_route(media, pad(media, 1, 2),
+			       media_get_entity_by_id(media, 3), &changes,
+			       &num_changes);
+	check(ret == 0 && num_changes == 2, "route plan (%d, %u changes)", ret,
+	      ret == 0 ? num_changes : 0);
+	if (ret < 0)
+		return;
+
+	if (num_changes == 2) {
+		check(changes[0].link->source == pad(media, 2, 1) &&
+		      !(changes[0].flags & MEDIA_LNK_FL_ENABLED),
+		      "route disables the conflicting link first");
+		check(changes[1].link->source == pad(media, 1, 2) &&
+		      changes[1].flags & MEDIA_LNK_FL_ENABLED,
+		      "route enables the link to the sink");
+	}
+
+	free(changes);
+}
+
+static int entity_is(struct media_entity *entity, const char *name)
+{
+	return entity && !strcmp(media_entity_get_info(entity)->name, name);
+}
+
+/*
+ * Entities added to an emulated device are stored in an array that grows with
+ * each entity, the default entities must follow it.
+ */
+static void test_emulated(void)
+{
+	struct media_device_info info;
+	struct media_entity_desc desc;
+	struct media_entity *entity;
+	struct media_device *media;
+	unsigned int i;
+
+	memset(&info, 0, sizeof(info));
+	media = media_device_new_emulated(&info);
+	if (media == NULL) {
+		failures++;
+		return;
+	}
+
+	for (i = 0; i < 64; ++i) {
+		memset(&desc, 0, sizeof(desc));
+		snprintf(desc.name, sizeof(desc.name), "video %u", i);
+		desc.type = i % 2 ? MEDIA_ENT_T_DEVNODE_V4L
+		     : MEDIA_ENT_T_DEVNODE_ALSA;
+		desc.flags = i < 2 ? MEDIA_ENT_FL_DEFAULT : 0;
+
+		check(media_device_add_entity(media, &desc, "/dev/null") == 0,
+		      "adding emulated entity %u", i);
+
+		entity = media_get_default_entity(media,
+						  MEDIA_ENT_T_DEVNODE_V4L);
+		check(i == 0 || entity_is(entity, "video 1"),
+		      "default V4L entity after %u entities", i + 1);
+
+		entity = media_get_default_entity(media,
+						  MEDIA_ENT_T_DEVNODE_ALSA);
+		check(entity_is(entity, "video 0"),
+		      "default ALSA entity after %u entities", i + 1);
+	}
+
+	media_device_unref(media);
+}
+
+static unsigned int enumerate_cached(const char *cache,
+				     unsigned int num_subdevs,
+				     unsigned int num_orphans)
+{
+	struct media_device *media;
+	unsigned int count = 0;
+
+	fake_media_init(num_subdevs);
+	fake_media_add_orphans(num_orphans);
+
+	media = media_device_new(FAKE_MEDIA_DEVNODE);
+	if (media == NULL)
+		return 0;
+
+	media_device_set_lazy_devnames(media, 1);
+
+	if (media_device_set_cache(media, cache) == 0 &&
+	    media_device_enumerate(media) == 0)
+		count = media_get_entities_count(media);
+
+	media_device_unref(media);
+	return count;
+}
+
+/*
+ * The topology cache is keyed by the device information only, which the fake
+ * device reports identically regardless of its size. Entities and links added
+ * to or removed from the device must be detected and the cache ignored.
+ */
+static void test_cache(void)
+{
+	static const struct {
+		unsigned int subdevs;
+		unsigned int orphans;
+	} steps[] = {
+		{ 2, 0 }, { 2, 0 }, { 3, 0 }, { 3, 1 }, { 3, 1 }, { 3, 0 },
+		{ 16, 0 }, { 15, 0 },
+	};
+	char cache[] = "/tmp/graph-test-XXXXXX";
+	struct dirent *ent;
+	unsigned int expected;
+	unsigned int count;
+	unsigned int i;
+	DIR *dir;
+
+	if (mkdtemp(cache) == NULL) {
+		fprintf(stderr, "FAIL: can't create cache directory\n");
+		failures++;
+		return;
+	}
+
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i) {
+		count = enumerate_cached(cache, steps[i].subdevs,
+					 steps[i].orphans);
+		expected = steps[i].subdevs + 1 + steps[i].orphans;
+		check(count == expected, "%u entities from cache, expected %u",
+		      count, expected);
+	}
+
+	dir = opendir(cache);
+	if (dir) {
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] != '.')
+				unlinkat(dirfd(dir), ent->d_name, 0);
+		}
+		closedir(dir);
+	}
+
+	rmdir(cache);
+}
+
+static void benchmark(unsigned int num_subdevs, unsigned int iterations)
+{
+	struct media_device *media;
+	char name[32];
+	double start;
+	double enumeration;
+	double by_id;
+	double by_name;
+	unsigned long ioctls;
+	unsigned int i, j;
+
+	start = now();
+	for (i = 0; i < iterations; ++i) {
+		media = enumerate(num_subdevs);
+		if (media == NULL)
+			return;
+		ioctls = fake_media_ioctl_count();
+		media_device_unref(media);
+	}
+	enumeration = (now() - start) / iterations;
+
+	media = enumerate(num_subdevs);
+	if (media == NULL)
+		return;
+
+	start = now();
+	for (i = 0; i < iterations; ++i) {
+		for (j = 1; j <= num_subdevs + 1; ++j)
+			media_get_entity_by_id(media, j);
+	}
+	by_id = (now() - start) / iterations / (num_subdevs + 1);
+
+	start = now();
+	for (i = 0; i < iterations; ++i) {
+		for (j = 1; j <= num_subdevs; ++j) {
+			snprintf(name, sizeof(name), "subdev %u", j);
+			media_get_entity_by_name(media, name, strlen(name));
+		}
+	}
+	by_name = (now() - start) / iterations / num_subdevs;
+
+	media_device_unref(media);
+
+	printf("%u entities, %u iterations\n", num_subdevs + 1, iterations);
+	printf("enumeration     %10.1f us (%lu ioctls)\n", enumeration * 1e6,
+	       ioctls);
+	printf("lookup by ID    %10.1f ns\n", by_id * 1e9);
+	printf("lookup by name  %10.1f ns\n", by_name * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int sizes[] = { 1, 2, 3, 16, 200 };
+	unsigned int num_subdevs = 200;
+	unsigned int iterations = 1000;
+	struct media_device *media;
+	int bench = 0;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bi:n:")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'i':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			num_subdevs = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b] [-n subdevs] "
+				"[-i iterations]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (bench) {
+		if (num_subdevs == 0 || iterations == 0)
+			return EXIT_FAILURE;
+
+		benchmark(num_subdevs, iterations);
+		return EXIT_SUCCESS;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		media = enumerate(sizes[i]);
+		if (media == NULL) {
+			failures++;
+			continue;
+		}
+
+		test_entities(media, sizes[i]);
+		test_links(media, sizes[i]);
+		if (sizes[i] >= 3)
+			test_route(media);
+		media_device_unref(media);
+	}
+
+	test_emulated();
+	test_transaction(16);
+	test_cache();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}